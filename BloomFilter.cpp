@@ -0,0 +1,108 @@
+/**
+ * Blocked Bloom filters, for quickly rejecting states which are not in a sorted node file (see TIERED_CLOSED_SET).
+ *
+ * Each key sets BLOOM_HASHES bits, all in the same 512-bit block (one cache line), so that a lookup costs at most one cache
+ * miss. The filter takes BLOOM_BITS_PER_NODE bits per key; with the default of 10 bits, about 1% of the keys which are not in
+ * the filter aren't rejected. Keys are hashed to 64 bits, as a 32-bit hash would let larger filters fill up with collisions.
+ */
+
+#ifndef BLOOM_BITS_PER_NODE
+# define BLOOM_BITS_PER_NODE 10
+#endif
+
+#ifndef BLOOM_HASHES
+# define BLOOM_HASHES ((BLOOM_BITS_PER_NODE * 69 + 50) / 100) // ln 2 * bits per key, which gives the fewest false positives
+#endif
+
+// MurmurHash64A ( https://github.com/aappleby/smhasher/blob/master/src/MurmurHash2.cpp )
+INLINE uint64_t hashBytes64(const void* key, size_t len)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995LL;
+	const int r = 47;
+
+	uint64_t h = len * m;
+
+	const uint8_t* data = (const uint8_t*)key;
+	const uint8_t* end = data + (len & ~(size_t)7);
+
+	for (; data != end; data += 8)
+	{
+		uint64_t k;
+		memcpy(&k, data, 8);
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+	}
+
+	switch (len & 7)
+	{
+	case 7: h ^= uint64_t(data[6]) << 48;
+	case 6: h ^= uint64_t(data[5]) << 40;
+	case 5: h ^= uint64_t(data[4]) << 32;
+	case 4: h ^= uint64_t(data[3]) << 24;
+	case 3: h ^= uint64_t(data[2]) << 16;
+	case 2: h ^= uint64_t(data[1]) << 8;
+	case 1: h ^= uint64_t(data[0]);
+	        h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
+}
+
+class BloomFilter
+{
+	enum { BLOCK_WORDS = 8 }; // 512 bits
+	std::vector<uint64_t> words;
+	uint64_t blocks;
+
+	// The block is picked by the low bits of the hash; the bits in it, by double hashing on the high bits.
+	INLINE const uint64_t* block(uint64_t hash) const { return &words[(size_t)(hash % blocks) * BLOCK_WORDS]; }
+	INLINE static unsigned first(uint64_t hash) { return (unsigned)(hash >> 55); }
+	INLINE static unsigned step (uint64_t hash) { return ((unsigned)(hash >> 46) & 511) | 1; } // odd, so the bits differ
+
+public:
+	BloomFilter() : blocks(0) {}
+
+	void init(uint64_t keys)
+	{
+		blocks = (keys * BLOOM_BITS_PER_NODE + BLOCK_WORDS*64-1) / (BLOCK_WORDS*64);
+		if (blocks == 0)
+			blocks = 1;
+		words.assign((size_t)blocks * BLOCK_WORDS, 0);
+	}
+
+	void clear()
+	{
+		std::vector<uint64_t>().swap(words);
+		blocks = 0;
+	}
+
+	uint64_t sizeInBytes() const { return words.size() * sizeof(uint64_t); }
+
+	INLINE void add(uint64_t hash)
+	{
+		uint64_t* b = (uint64_t*)block(hash);
+		unsigned bit = first(hash), s = step(hash);
+		for (unsigned i=0; i<BLOOM_HASHES; i++, bit += s)
+			b[(bit / 64) % BLOCK_WORDS] |= 1ULL << (bit % 64);
+	}
+
+	// False means that the key was never added.
+	INLINE bool mayContain(uint64_t hash) const
+	{
+		const uint64_t* b = block(hash);
+		unsigned bit = first(hash), s = step(hash);
+		for (unsigned i=0; i<BLOOM_HASHES; i++, bit += s)
+			if (!(b[(bit / 64) % BLOCK_WORDS] & (1ULL << (bit % 64))))
+				return false;
+		return true;
+	}
+};
@@ -0,0 +1,533 @@
+/**
+ * Delta-coded files of sorted nodes (closed and combined nodes), stored through the disk plugin's byte streams.
+ *
+ * Consecutive states of a sorted file are close to each other, so each state is stored as its difference to the previous one:
+ * a byte with the number of significant bytes of the difference, followed by these bytes, least significant first. The rest of
+ * each node (the frame of an OpenNode, the subframe of a Node, alignment) is stored apart from the states, bit-packed as its
+ * difference to the smallest such value of the block, as it only takes a few distinct values.
+ *
+ * File layout:
+ *   DeltaFileHeader
+ *   blocks of up to DELTA_BLOCK_NODES nodes, each:
+ *     DeltaBlockHeader
+ *     the rest of the nodes, DeltaBlockHeader::otherBits each
+ *     the first state, in full
+ *     the differences of the other states
+ *   DeltaFileFooter, with the node count
+ *
+ * DeltaInputStream also reads files of plain nodes, so that readers don't need to know how a file was written.
+ */
+
+#include <stddef.h> // offsetof
+#include <string>
+
+#ifndef DELTA_BLOCK_NODES
+# define DELTA_BLOCK_NODES 4096
+#endif
+
+const uint64_t DELTA_FILE_MAGIC = 0x31444F43544C4544LL; // "DELTCOD1"
+
+struct DeltaFileHeader
+{
+	uint64_t magic;
+	uint32_t nodeSize;
+	uint32_t stateSize;
+};
+
+struct DeltaBlockHeader
+{
+	uint32_t nodes;
+	uint32_t bytes; // following this header
+	uint64_t otherBase;
+	uint8_t otherBits;
+	uint8_t _reserved[7];
+};
+
+struct DeltaFileFooter
+{
+	uint64_t nodes;
+	uint64_t magic;
+};
+
+template<class NODE>
+struct DeltaLayout
+{
+	enum { STATE_OFFSET = offsetof(NODE, state) };
+};
+
+template<>
+struct DeltaLayout<PackedCompressedState>
+{
+	enum { STATE_OFFSET = 0 };
+};
+
+template<class NODE>
+class DeltaCoder
+{
+protected:
+	enum
+	{
+		STATE_OFFSET = DeltaLayout<NODE>::STATE_OFFSET,
+		OTHER_BYTES = sizeof(NODE) - COMPRESSED_BYTES,
+		LIMBS = (COMPRESSED_BYTES + 7) / 8,
+	};
+	static_assert(OTHER_BYTES < 8, "Delta-coded files can't hold more than 7 bytes besides the state of a node");
+
+	static INLINE unsigned limbBytes(unsigned limb) { return limb < LIMBS-1 ? 8 : COMPRESSED_BYTES - 8*(LIMBS-1); }
+
+	// Stores state - previous, in the order of the CompressedState operators, least significant byte first.
+	// Returns the number of significant bytes.
+	static INLINE unsigned subtract(const uint8_t* state, const uint8_t* previous, uint8_t* difference)
+	{
+		unsigned significant = 0;
+#ifdef SLOW_COMPARE // memcmp order: the first byte is the most significant
+		unsigned borrow = 0;
+		for (unsigned b=0; b<COMPRESSED_BYTES; b++)
+		{
+			int d = (int)state[COMPRESSED_BYTES-1 - b] - previous[COMPRESSED_BYTES-1 - b] - borrow;
+			borrow = d < 0;
+			difference[b] = (uint8_t)d;
+			if (difference[b])
+				significant = b+1;
+		}
+#else
+		uint64_t borrow = 0;
+		for (unsigned limb=0; limb<LIMBS; limb++)
+		{
+			uint64_t a = 0, b = 0;
+			memcpy(&a, state    + 8*limb, limbBytes(limb));
+			memcpy(&b, previous + 8*limb, limbBytes(limb));
+			uint64_t d = a - b - borrow;
+			borrow = a < b || (a == b && borrow);
+			memcpy(difference + 8*limb, &d, limbBytes(limb));
+			if (limbBytes(limb) < 8)
+				d &= (1ULL << (8*limbBytes(limb))) - 1;
+			for (unsigned bytes=8*limb; d; d >>= 8)
+				significant = ++bytes;
+		}
+#endif
+		return significant;
+	}
+
+	// The inverse of subtract.
+	static INLINE void add(uint8_t* state, const uint8_t* difference, unsigned significant)
+	{
+#ifdef SLOW_COMPARE
+		unsigned carry = 0;
+		for (unsigned b=0; b<COMPRESSED_BYTES && (b<significant || carry); b++)
+		{
+			unsigned sum = state[COMPRESSED_BYTES-1 - b] + (b<significant ? difference[b] : 0) + carry;
+			state[COMPRESSED_BYTES-1 - b] = (uint8_t)sum;
+			carry = sum >> 8;
+		}
+#else
+		uint64_t carry = 0;
+		for (unsigned limb=0; limb<LIMBS && (8*limb<significant || carry); limb++)
+		{
+			uint64_t a = 0, d = 0;
+			memcpy(&a, state + 8*limb, limbBytes(limb));
+			if (8*limb < significant)
+				memcpy(&d, difference + 8*limb, significant - 8*limb < 8 ? significant - 8*limb : 8);
+			uint64_t sum = a + d + carry;
+			carry = sum < a || (sum == a && carry);
+			memcpy(state + 8*limb, &sum, limbBytes(limb));
+		}
+#endif
+	}
+
+	// The bytes of a node besides its state (frame, subframe, alignment), as a little-endian number
+	static INLINE uint64_t getOther(const NODE* node)
+	{
+		uint64_t value = 0;
+		memcpy(&value, node, STATE_OFFSET);
+		memcpy((uint8_t*)&value + STATE_OFFSET, (const uint8_t*)node + STATE_OFFSET + COMPRESSED_BYTES, OTHER_BYTES - STATE_OFFSET);
+		return value;
+	}
+
+	static INLINE void setOther(NODE* node, uint64_t value)
+	{
+		memcpy(node, &value, STATE_OFFSET);
+		memcpy((uint8_t*)node + STATE_OFFSET + COMPRESSED_BYTES, (const uint8_t*)&value + STATE_OFFSET, OTHER_BYTES - STATE_OFFSET);
+	}
+};
+
+template<class NODE> class DeltaInputStream;
+
+template<class NODE>
+class DeltaOutputStream : DeltaCoder<NODE>
+{
+	typedef DeltaCoder<NODE> Coder;
+
+	OutputStream<uint8_t> s;
+	bool coded, started;
+	uint64_t nodes, bytes; // written so far, if coded
+	std::vector<uint8_t> block;
+#ifdef NODE_INDEX
+	NodeIndexWriter<NODE> index; // of the blocks
+#endif
+
+	// Written with the first block rather than on opening, as preallocating the file moves back to its start.
+	void writeHeader()
+	{
+		DeltaFileHeader header = { DELTA_FILE_MAGIC, sizeof(NODE), COMPRESSED_BYTES };
+		s.write((const uint8_t*)&header, sizeof(header));
+		bytes = sizeof(header);
+		started = true;
+	}
+
+	void writeBlock(const NODE* p, size_t n)
+	{
+		DeltaBlockHeader header;
+		memset(&header, 0, sizeof(header));
+		header.nodes = (uint32_t)n;
+
+		uint64_t minOther = Coder::getOther(p), maxOther = minOther;
+		for (size_t i=1; i<n; i++)
+		{
+			uint64_t other = Coder::getOther(p+i);
+			if (minOther > other) minOther = other;
+			if (maxOther < other) maxOther = other;
+		}
+		header.otherBase = minOther;
+		while ((maxOther - minOther) >> header.otherBits)
+			header.otherBits++;
+
+		size_t columnBytes = (n * header.otherBits + 7) / 8;
+		block.resize(sizeof(header) + columnBytes + n * (1 + COMPRESSED_BYTES));
+		uint8_t* out = block.data() + sizeof(header);
+
+		// otherBits is at most 56, so a value fits in the accumulator next to the 7 bits which may be left over
+		uint64_t bits = 0;
+		unsigned bitCount = 0;
+		for (size_t i=0; i<n; i++)
+		{
+			bits |= (Coder::getOther(p+i) - minOther) << bitCount;
+			bitCount += header.otherBits;
+			for (; bitCount >= 8; bitCount -= 8, bits >>= 8)
+				*out++ = (uint8_t)bits;
+		}
+		if (bitCount)
+			*out++ = (uint8_t)bits;
+
+		const uint8_t* previous = (const uint8_t*)p + Coder::STATE_OFFSET;
+		memcpy(out, previous, COMPRESSED_BYTES);
+		out += COMPRESSED_BYTES;
+		for (size_t i=1; i<n; i++)
+		{
+			const uint8_t* state = (const uint8_t*)(p+i) + Coder::STATE_OFFSET;
+			unsigned significant = Coder::subtract(state, previous, out+1);
+			*out = (uint8_t)significant;
+			out += 1 + significant;
+			previous = state;
+		}
+
+		header.bytes = (uint32_t)(out - block.data() - sizeof(header));
+		memcpy(block.data(), &header, sizeof(header));
+		if (!started)
+			writeHeader();
+#ifdef NODE_INDEX
+		index.add(p, nodes, bytes);
+#endif
+		s.write(block.data(), out - block.data());
+		nodes += n;
+		bytes += out - block.data();
+	}
+
+public:
+	DeltaOutputStream() : coded(false), started(false), nodes(0), bytes(0) {}
+
+	~DeltaOutputStream()
+	{
+		close();
+	}
+
+	bool isOpen() { return s.isOpen(); }
+
+	// Delta-coded files are written in one go, so they can't be resumed.
+	void open(const char* filename, bool resume=false, bool deltaCoded=false)
+	{
+		assert(!(resume && deltaCoded), "Delta-coded files can't be resumed");
+		s.open(filename, resume);
+		coded = deltaCoded;
+		started = false;
+		nodes = bytes = 0;
+#ifdef NODE_INDEX
+		if (coded)
+			index.open(filename);
+#endif
+	}
+
+	uint64_t size()
+	{
+		return coded ? nodes : s.size() / sizeof(NODE);
+	}
+
+	void write(const NODE* p, size_t n)
+	{
+		if (!coded)
+		{
+			s.write((const uint8_t*)p, n * sizeof(NODE));
+			return;
+		}
+		for (size_t i=0; i<n; i+=DELTA_BLOCK_NODES)
+			writeBlock(p+i, n-i < DELTA_BLOCK_NODES ? n-i : DELTA_BLOCK_NODES);
+	}
+
+#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
+	void preallocate(uint64_t size) { s.preallocate(size); }
+#endif
+
+	void flush() { s.flush(); }
+
+	void append(DeltaInputStream<NODE>* input);
+
+	void close()
+	{
+		if (s.isOpen() && coded)
+		{
+			if (!started)
+				writeHeader();
+			DeltaFileFooter footer = { nodes, DELTA_FILE_MAGIC };
+			s.write((const uint8_t*)&footer, sizeof(footer));
+#ifdef NODE_INDEX
+			index.close(nodes, bytes + sizeof(footer));
+#endif
+		}
+		coded = false;
+		s.close();
+	}
+};
+
+template<class NODE>
+class DeltaInputStream : DeltaCoder<NODE>
+{
+	typedef DeltaCoder<NODE> Coder;
+
+	InputStream<uint8_t> s;
+	bool coded;
+	uint64_t nodes, pos; // if coded
+	std::string filename;
+	NodeIndex<NODE> index; // loaded by the first seek
+	bool indexLoaded;
+
+	// the current block
+	std::vector<uint8_t> block;
+	DeltaBlockHeader header;
+	uint32_t blockPos;           // nodes of the block already decoded
+	const uint8_t* cursor;       // the next state difference
+	uint8_t state[COMPRESSED_BYTES]; // the last decoded state
+
+	void readBlock()
+	{
+		enforce(s.read((uint8_t*)&header, sizeof(header)) == sizeof(header), "Truncated delta-coded block header");
+		block.resize(header.bytes + 8); // the bit-packed column is read 8 bytes at a time
+		enforce(s.read(block.data(), header.bytes) == header.bytes, "Truncated delta-coded block");
+		cursor = block.data() + (header.nodes * header.otherBits + 7) / 8;
+		blockPos = 0;
+	}
+
+	INLINE void decode(NODE* node)
+	{
+		if (blockPos == 0)
+		{
+			memcpy(state, cursor, COMPRESSED_BYTES);
+			cursor += COMPRESSED_BYTES;
+		}
+		else
+		{
+			unsigned significant = *cursor++;
+			Coder::add(state, cursor, significant);
+			cursor += significant;
+		}
+		memcpy((uint8_t*)node + Coder::STATE_OFFSET, state, COMPRESSED_BYTES);
+
+		if (Coder::OTHER_BYTES)
+		{
+			uint64_t bit = (uint64_t)blockPos * header.otherBits, bits;
+			memcpy(&bits, block.data() + bit / 8, sizeof(bits));
+			bits = (bits >> bit % 8) & ((1ULL << header.otherBits) - 1);
+			Coder::setOther(node, header.otherBase + bits);
+		}
+		blockPos++;
+	}
+
+#ifdef DISK_MMAP
+	std::vector<NODE> decoded; // handed out by view()
+#endif
+
+public:
+#ifdef DISK_MMAP
+	enum { MAPPED = true }; // ReadBuffer uses view() instead of read()
+#endif
+
+	DeltaInputStream() : coded(false), nodes(0), pos(0) {}
+	DeltaInputStream(const char* filename) { open(filename); }
+
+	bool isOpen() { return s.isOpen(); }
+
+	void open(const char* filename)
+	{
+		s.open(filename);
+		this->filename = filename;
+		indexLoaded = false;
+		coded = false;
+		pos = 0;
+		header.nodes = blockPos = 0;
+
+		uint64_t bytes = s.size();
+		DeltaFileHeader fileHeader;
+		if (bytes >= sizeof(DeltaFileHeader) + sizeof(DeltaFileFooter)
+		 && s.read((uint8_t*)&fileHeader, sizeof(fileHeader)) == sizeof(fileHeader) && fileHeader.magic == DELTA_FILE_MAGIC)
+		{
+			enforce(fileHeader.nodeSize == sizeof(NODE) && fileHeader.stateSize == COMPRESSED_BYTES, format("Delta-coded file %s was written with a different node size", filename));
+			DeltaFileFooter footer;
+			s.seek(bytes - sizeof(footer));
+			enforce(s.read((uint8_t*)&footer, sizeof(footer)) == sizeof(footer) && footer.magic == DELTA_FILE_MAGIC, format("Delta-coded file %s is incomplete", filename));
+			nodes = footer.nodes;
+			coded = true;
+			s.seek(sizeof(fileHeader));
+		}
+		else
+			s.seek(0);
+	}
+
+	void close()
+	{
+		s.close();
+		block.clear();
+	}
+
+	uint64_t size()
+	{
+		if (coded)
+			return nodes;
+		uint64_t bytes = s.size();
+		assert(bytes % sizeof(NODE) == 0, "Unaligned EOF");
+		return bytes / sizeof(NODE);
+	}
+
+	uint64_t position()
+	{
+		return coded ? pos : s.position() / sizeof(NODE);
+	}
+
+	// Starts at the block which the index (if any) points to, skips whole blocks by their headers,
+	// then decodes the block with the wanted node up to it.
+	void seek(uint64_t target)
+	{
+		if (!coded)
+		{
+			s.seek(target * sizeof(NODE));
+			return;
+		}
+		if (!indexLoaded)
+		{
+			index.load(filename.c_str());
+			indexLoaded = true;
+		}
+		const NodeIndexEntry<NODE>* entry = index.find(target);
+		s.seek(entry ? entry->offset : sizeof(DeltaFileHeader));
+		header.nodes = blockPos = 0;
+		for (pos = entry ? entry->node : 0; pos < target && pos < nodes; )
+		{
+			enforce(s.read((uint8_t*)&header, sizeof(header)) == sizeof(header), "Truncated delta-coded block header");
+			if (target - pos < header.nodes)
+			{
+				s.seek(s.position() - sizeof(header));
+				readBlock();
+				NODE node;
+				for (; pos < target; pos++)
+					decode(&node);
+				break;
+			}
+			s.seek(s.position() + header.bytes);
+			pos += header.nodes;
+			header.nodes = 0;
+		}
+	}
+
+	bool isCoded() { return coded; }
+
+	// Reads the next block of a delta-coded file as it is (its header included), and decodes its first node.
+	// Returns false at the end of the file. Can't be mixed with reading single nodes.
+	bool readRawBlock(std::vector<uint8_t>* raw, NODE* first)
+	{
+		assert(coded && blockPos == header.nodes, "Not at a block boundary");
+		if (pos == nodes)
+			return false;
+		readBlock();
+		decode(first);
+		blockPos = header.nodes;
+		pos += header.nodes;
+		raw->resize(sizeof(header) + header.bytes);
+		memcpy(raw->data(), &header, sizeof(header));
+		memcpy(raw->data() + sizeof(header), block.data(), header.bytes);
+		return true;
+	}
+
+#ifdef DISK_MMAP
+	// Plain files are handed out straight from the mapping, delta-coded ones up to a block at a time.
+	const NODE* view(size_t n, size_t* count)
+	{
+		if (!coded)
+		{
+			const NODE* p = (const NODE*)s.view(n * sizeof(NODE), count);
+			*count /= sizeof(NODE);
+			return p;
+		}
+		decoded.resize(DELTA_BLOCK_NODES);
+		*count = read(decoded.data(), n < DELTA_BLOCK_NODES ? n : DELTA_BLOCK_NODES);
+		return decoded.data();
+	}
+#endif
+
+	size_t read(NODE* p, size_t n)
+	{
+		if (!coded)
+			return s.read((uint8_t*)p, n * sizeof(NODE)) / sizeof(NODE);
+
+		if (n > nodes - pos)
+			n = (size_t)(nodes - pos);
+		for (size_t i=0; i<n; )
+		{
+			if (blockPos == header.nodes)
+				readBlock();
+			size_t count = header.nodes - blockPos;
+			if (count > n-i)
+				count = n-i;
+			for (size_t j=0; j<count; j++)
+				decode(p + i + j);
+			i += count;
+		}
+		pos += n;
+		return n;
+	}
+};
+
+// Appends the rest of another file of the same nodes (e.g. a part of a file which was written in parallel).
+// The blocks of a delta-coded file are appended to a delta-coded one as they are, without decoding them.
+template<class NODE>
+void DeltaOutputStream<NODE>::append(DeltaInputStream<NODE>* input)
+{
+	if (coded && input->isCoded())
+	{
+		NODE first;
+		while (input->readRawBlock(&block, &first))
+		{
+			if (!started)
+				writeHeader();
+#ifdef NODE_INDEX
+			index.add(&first, nodes, bytes);
+#endif
+			s.write(block.data(), block.size());
+			nodes += ((const DeltaBlockHeader*)block.data())->nodes;
+			bytes += block.size();
+		}
+		return;
+	}
+
+	std::vector<NODE> buffer(DELTA_BLOCK_NODES);
+	size_t records;
+	while ((records = input->read(buffer.data(), buffer.size())))
+		write(buffer.data(), records);
+}
@@ -0,0 +1,213 @@
+/**
+ * Sparse key indexes of sorted node files.
+ *
+ * A sorted file written with BufferedOutputStream::openSorted gets a sidecar file (its name + ".idx") with every
+ * NODE_INDEX_INTERVAL-th node of the file, or the first node of every block of a delta-coded file, each with its position in
+ * the file (in nodes) and the byte offset at which to start reading it. The last entry holds the number of nodes and the size
+ * of the file instead, so that an index which is out of date (e.g. left behind by an interrupted rename) is ignored.
+ *
+ * NodeIndex loads an index into RAM, and narrows the range of positions in which a key can be, or finds where to start
+ * reading a given position, with a binary search. Files without an index are simply searched or read from the start.
+ */
+
+#ifndef NODE_INDEX_INTERVAL
+# define NODE_INDEX_INTERVAL 4096
+#endif
+
+template<class NODE>
+struct NodeIndexEntry
+{
+	NODE first;
+	uint64_t node;   // position of first in the file
+	uint64_t offset; // byte offset at which to start reading
+};
+
+const char* formatNodeIndexName(const char* filename)
+{
+	return format("%s.idx", filename);
+}
+
+template<class NODE>
+class NodeIndex
+{
+	std::vector<NodeIndexEntry<NODE>> entries;
+	uint64_t nodes;
+
+	template<class> friend class NodeIndexWriter;
+
+public:
+	NodeIndex() : nodes(0) {}
+
+	// Returns false if the node file has no index, or it is out of date.
+	bool load(const char* filename)
+	{
+		entries.clear();
+		nodes = 0;
+		const char* indexName = formatNodeIndexName(filename);
+		if (!fileExists(indexName))
+			return false;
+		{
+			InputStream<NodeIndexEntry<NODE>> input(indexName);
+			entries.resize((size_t)input.size());
+			if (entries.empty() || input.read(entries.data(), entries.size()) != entries.size())
+			{
+				entries.clear();
+				return false;
+			}
+		}
+		NodeIndexEntry<NODE> last = entries.back();
+		entries.pop_back();
+		if (last.offset != getFileSize(filename))
+		{
+			entries.clear();
+			return false;
+		}
+		nodes = last.node;
+		return true;
+	}
+
+	bool isLoaded() const { return nodes != 0 || !entries.empty(); }
+
+	uint64_t size() const { return nodes; }
+
+	// Narrows [*lo, *hi], the positions at which the first node which is not less than key can be (*hi if there is none),
+	// down to the nodes after the last indexed node which is less than key, up to the first indexed one which isn't.
+	void narrow(const NODE* key, uint64_t* lo, uint64_t* hi) const
+	{
+		size_t a = 0, b = entries.size();
+		while (a < b)
+		{
+			size_t mid = a + (b-a)/2;
+			if (entries[mid].first < *key)
+				a = mid+1;
+			else
+				b = mid;
+		}
+		if (a < entries.size() && *hi > entries[a].node)
+			*hi = entries[a].node;
+		if (a > 0 && *lo < entries[a-1].node + 1)
+			*lo = entries[a-1].node + 1;
+	}
+
+	// The last entry at or before the given position, or NULL if there is none.
+	const NodeIndexEntry<NODE>* find(uint64_t node) const
+	{
+		size_t a = 0, b = entries.size();
+		while (a < b)
+		{
+			size_t mid = a + (b-a)/2;
+			if (entries[mid].node <= node)
+				a = mid+1;
+			else
+				b = mid;
+		}
+		return a ? &entries[a-1] : NULL;
+	}
+};
+
+template<class NODE>
+class NodeIndexWriter
+{
+	OutputStream<NodeIndexEntry<NODE>> s;
+	std::vector<NodeIndexEntry<NODE>> entries; // not yet written
+	uint64_t nodes; // seen by addEvery
+
+	void writeEntries()
+	{
+		if (entries.size())
+			s.write(entries.data(), entries.size());
+		entries.clear();
+	}
+
+public:
+	NodeIndexWriter() : nodes(0) {}
+
+	~NodeIndexWriter()
+	{
+		s.close(); // without the last entry, which leaves the index unusable
+	}
+
+	bool isOpen() { return s.isOpen(); }
+
+	// Opens the index of the given node file.
+	void open(const char* filename)
+	{
+		s.open(formatNodeIndexName(filename));
+		entries.clear();
+		nodes = 0;
+	}
+
+	void add(const NODE* first, uint64_t node, uint64_t offset)
+	{
+		NodeIndexEntry<NODE> entry = { *first, node, offset };
+		entries.push_back(entry);
+		if (entries.size() == 4096)
+			writeEntries();
+	}
+
+	// Indexes every NODE_INDEX_INTERVAL-th node of a plain file, given all of its nodes in order.
+	void addEvery(const NODE* p, size_t n)
+	{
+		for (uint64_t node = (nodes + NODE_INDEX_INTERVAL-1) / NODE_INDEX_INTERVAL * NODE_INDEX_INTERVAL; node < nodes + n; node += NODE_INDEX_INTERVAL)
+			add(p + (node - nodes), node, node * sizeof(NODE));
+		nodes += n;
+	}
+
+	// Appends the index of a plain node file, as if the file was appended to the indexed one. Returns false if it has no index.
+	bool append(const char* filename)
+	{
+		NodeIndex<NODE> index;
+		if (!index.load(filename))
+			return false;
+		for (size_t i=0; i<index.entries.size(); i++)
+			add(&index.entries[i].first, nodes + index.entries[i].node, (nodes + index.entries[i].node) * sizeof(NODE));
+		nodes += index.size();
+		return true;
+	}
+
+	// For indexes built with add(); nodes and bytes describe the whole node file.
+	void close(uint64_t nodes, uint64_t bytes)
+	{
+		if (!isOpen())
+			return;
+		NodeIndexEntry<NODE> last;
+		memset(&last, 0, sizeof(last));
+		last.node = nodes;
+		last.offset = bytes;
+		entries.push_back(last);
+		writeEntries();
+		s.close();
+	}
+
+	// For indexes built with addEvery() and append().
+	void close()
+	{
+		close(nodes, nodes * sizeof(NODE));
+	}
+};
+
+// Renaming or deleting a sorted node file also renames or deletes its index.
+void renameNodeFile(const char* from, const char* to)
+{
+	renameFile(from, to);
+	const char* fromIndex = formatNodeIndexName(from);
+	const char* toIndex = formatNodeIndexName(to);
+	if (fileExists(fromIndex))
+		renameFile(fromIndex, toIndex, true);
+	else
+	if (fileExists(toIndex))
+		deleteFile(toIndex);
+}
+
+void deleteNodeIndex(const char* filename)
+{
+	const char* index = formatNodeIndexName(filename);
+	if (fileExists(index))
+		deleteFile(index);
+}
+
+void deleteNodeFile(const char* filename)
+{
+	deleteFile(filename);
+	deleteNodeIndex(filename);
+}
@@ -0,0 +1,115 @@
+/**
+ * LSD radix sort for nodes (any type with a PackedCompressedState "state" member).
+ *
+ * Sorts in the same order as the CompressedState comparison operators, one byte of the state per pass, starting
+ * with the least significant byte. The counts for all passes are collected in a single read of the input, and
+ * passes in which every node has the same byte (e.g. the unused high bits of the state) are skipped.
+ * The sort is stable, like TimSort, which it can be used in place of.
+ *
+ * An instance keeps its scratch buffer between calls, so reuse one instance per thread.
+ */
+template<class T>
+class RadixSort
+{
+private:
+	/**
+	 * Arrays shorter than this are sorted with an insertion sort.
+	 */
+	enum { MIN_RADIX = 64 };
+
+	uint32_t counts[COMPRESSED_BYTES][256];
+
+	T *tmp;
+	size_t tmp_len;
+
+	// The CompressedState operators compare the state as a little-endian number, the memcmp ones as a big-endian one.
+	static INLINE unsigned byteOfPass(unsigned pass)
+	{
+#ifdef SLOW_COMPARE
+		return COMPRESSED_BYTES-1 - pass;
+#else
+		return pass;
+#endif
+	}
+
+	static INLINE uint8_t digit(const T& node, unsigned byte)
+	{
+		return ((const uint8_t*)&node.state)[byte];
+	}
+
+	static void insertionSort(T *a, size_t len)
+	{
+		for (size_t i=1; i<len; i++)
+		{
+			if (!(a[i] < a[i-1]))
+				continue;
+			T t = a[i];
+			size_t j = i;
+			do
+			{
+				a[j] = a[j-1];
+				j--;
+			} while (j && t < a[j-1]);
+			a[j] = t;
+		}
+	}
+
+public:
+	RadixSort() : tmp(NULL), tmp_len(0) {}
+
+	~RadixSort()
+	{
+		delete [] tmp;
+	}
+
+	void sort(T *a, size_t len)
+	{
+		if (len < MIN_RADIX)
+		{
+			insertionSort(a, len);
+			return;
+		}
+
+		if (tmp_len < len)
+		{
+			delete [] tmp;
+			tmp = new T[len];
+			tmp_len = len;
+		}
+
+		memset(counts, 0, sizeof(counts));
+		for (size_t i=0; i<len; i++)
+			for (unsigned byte=0; byte<COMPRESSED_BYTES; byte++)
+				counts[byte][digit(a[i], byte)]++;
+
+		T *src = a, *dst = tmp;
+		for (unsigned pass=0; pass<COMPRESSED_BYTES; pass++)
+		{
+			unsigned byte = byteOfPass(pass);
+			uint32_t* count = counts[byte];
+			if (count[digit(src[0], byte)] == len)
+				continue;
+
+			uint32_t offset = 0;
+			for (unsigned d=0; d<256; d++)
+			{
+				uint32_t n = count[d];
+				count[d] = offset;
+				offset += n;
+			}
+
+			for (size_t i=0; i<len; i++)
+				dst[count[digit(src[i], byte)]++] = src[i];
+
+			T *t = src; src = dst; dst = t;
+		}
+
+		if (src != a)
+			memcpy(a, src, len * sizeof(T));
+
+#ifdef DEBUG
+		for (size_t i=1; i<len; i++)
+			assert(a[i-1] <= a[i]);
+#endif
+	}
+};
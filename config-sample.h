@@ -14,14 +14,16 @@
 // Needs to be supported by PROBLEM; should result in a huge speed boost
 //#define USE_TRANSFORM_INVARIANT_SORTING
 
-// Use this in combination with DISK_WINFILES to achieve more efficient disk I/O when the data set has gotten very large (however, this is slower with small data sets)
+// Use this in combination with DISK_WINFILES or DISK_POSIX to achieve more efficient disk I/O when the data set has gotten very large (however, this is slower with small data sets)
+// With DISK_POSIX, files are opened with O_DIRECT, which also keeps them from evicting everything else from the page cache.
 //#define USE_UNBUFFERED_DISK_IO
 #define DISK_IO_CHUNK_SIZE (16*1024*1024)
 
 // MULTITHREADING will enable threading and synchronization code.
 #define MULTITHREADING
 #define THREADS (1+4)
-#define QUEUE_CHUNK_SIZE 256 // increases the efficiency of multithreading by dequeueing in chunks of this many nodes, reducing the amount of time spent waiting for sync
+#define QUEUE_CHUNK_SIZE 256 // the processing queue hands nodes to workers in batches of this many nodes; larger batches mean fewer queue operations
+//#define THREAD_POOL_SIZE 8 // threads started once and shared by all parallel tasks; defaults to twice the number of workers, must be more than the number of workers
 
 // THREAD_* defines how will threads be created.
 #define THREAD_STD
@@ -50,6 +52,14 @@
 // The expected ratio of Merging output/input
 #define EXPECTED_MERGING_RATIO 0.99
 
+// Disk characteristics used to decide whether merging the expanded chunks in several passes (merging groups of chunks into larger
+// runs first) is faster than merging them all at once. With many chunks, each input gets a small buffer, so most of the time is spent
+// seeking between chunks. DISK_SEEK_TIME is in seconds (use something like 0.0001 for solid state drives), DISK_TRANSFER_RATE in bytes
+// per second. MAX_MERGE_INPUTS caps the number of files open at once during a merge (keep it below "ulimit -n").
+//#define DISK_SEEK_TIME 0.01
+//#define DISK_TRANSFER_RATE (100*1024*1024)
+//#define MAX_MERGE_INPUTS 768
+
 // If defined, preallocate expanded chunks to this size to avoid disk fragmentation, then truncate them to their actual size upon closing. This
 // dramatically speeds up the Merging step when using magnetic hard drives (as opposed to solid state drives). it requires administrative-level
 // privilege, as the preallocated space contains whatever contents previously occupied that location on disk.
@@ -62,7 +72,6 @@
 // The parameters for the multithreaded Expansion queue/scheduler
 
 //#define DEBUG_EXPANSION
-//#define ENABLE_EXPANSION_SPILLOVER // buggy, drops a small number of nodes during Expansion; leave this disabled for now unless working on fixing it
 
 #ifdef DEBUG_EXPANSION
 #define EXPANSION_NODES_PER_QUEUE_ELEMENT (RAM_SIZE / sizeof(OpenNode) / 256)
@@ -70,12 +79,46 @@
 #define EXPANSION_NODES_PER_QUEUE_ELEMENT 0x1000
 #endif
 
-#ifdef ENABLE_EXPANSION_SPILLOVER
-#define EXPANSION_BUFFER_FILL_RATIO 0.98
-#define SPILLOVER_CHUNK_SIZE (2LL*1024*1024*1024)
-#else
+// If defined, sort each slot of expanded nodes with an LSD radix sort on the state's bytes, instead of TimSort.
+// Expanded nodes are in no particular order, which makes TimSort's run detection useless.
+//#define USE_RADIX_SORT
+
+// If defined, each worker keeps a hash cache of the children it generated in the current and previous two frame groups,
+// and drops children which are already in it. This takes the given share of RAM_SIZE away from the other buffers.
+// Helps on problems where many moves lead to the same states (transpositions).
+//#define STATE_CACHE_SHARE 0.125
+
+// Fraction of the expansion buffer's slots that are merged and written to disk as one chunk.
+// Filled slots don't need to be adjacent in the buffer.
 #define EXPANSION_BUFFER_FILL_RATIO (1./WORKERS)
-#endif
+
+// If defined, the Merging step splits the expanded chunks into one key range per worker and merges the ranges in parallel.
+// Helps when there are many chunks and merging them is CPU-bound; the merged ranges are concatenated afterwards.
+//#define PARALLEL_MERGE
+
+// If defined, the Combining step is split into key ranges in the same way, and the ranges are combined in parallel (this needs
+// PARALLEL_MERGE). Helps when Combining is CPU-bound, e.g. with DELTA_CODED_FILES.
+//#define PARALLEL_COMBINING
+
+// If defined, chunks written during Expansion are merged in the background, this many at a time, while the workers keep expanding.
+// Merged chunks are merged again once there are enough of them (a tiered merge), so only a few big chunks are left for the Merging step.
+// The background merge allocates its buffers (one standard buffer per input and one for the output) outside of RAM_SIZE.
+//#define BACKGROUND_MERGE 4
+
+// If defined, the expanded chunks are not merged into one file before Combining; the Combining step merges them directly, together
+// with the combined file. This saves writing and reading back all expanded nodes, but the chunks share the expanded nodes' buffer
+// (and PARALLEL_MERGE is not used). Merge passes which bring the number of chunks down (see DISK_SEEK_TIME) are still done.
+//#define MERGE_WHILE_COMBINING
+
+// If defined, the Combining step hands the nodes of the next frame group to the expansion workers as it finds them, so that the
+// next Expanding step overlaps it, instead of reading the closed file back afterwards (the closed file is still written, for
+// resuming and for tracing the exit). As the expansion buffer then takes all of RAM_SIZE, this many more bytes are allocated
+// after it for the Combining step's buffers. PARALLEL_COMBINING is not used while the next frame group is being expanded.
+//#define PIPELINED_EXPANSION (256*1024*1024)
+
+// If defined, buffered input and output streams use half of their buffer for reading ahead / writing behind on this many I/O threads,
+// so that merging overlaps with disk transfers. The time spent waiting for the disk is shown for the Expanding and Combining steps.
+//#define ASYNC_IO 2
 
 //#define ALIGN_TO_32BITS
 
@@ -84,6 +127,51 @@
 #define DISK_WINFILES
 //#define DISK_POSIX
 //#define DISK_C
+//#define DISK_URING // Linux only; needs a kernel with io_uring (5.1+), but not liburing
+
+// With DISK_URING, each read or write is split into blocks of URING_BLOCK_SIZE bytes, and up to URING_QUEUE_DEPTH of them are in flight.
+// URING_REGISTER_RAM registers RAM_SIZE with the kernel, which avoids mapping the buffers on every transfer, but pins (and thus commits)
+// all of it; this needs CAP_IPC_LOCK or a high enough "ulimit -l", otherwise it is silently skipped.
+//#define URING_QUEUE_DEPTH 8
+//#define URING_BLOCK_SIZE (256*1024)
+//#define URING_REGISTER_RAM
+//#define DISK_MMAP // POSIX, 64-bit only; input files are memory-mapped, and read without copying them into the stream buffers
+
+// With DISK_MMAP, a sequential scan asks the kernel to read in this many bytes ahead of it at a time.
+//#define MMAP_WINDOW_SIZE (64*1024*1024)
+
+// If defined, closed and combined node files (which are sorted) are stored delta-coded: each state as its difference to the previous
+// one, and the frames bit-packed apart from the states, in blocks of DELTA_BLOCK_NODES nodes. This shrinks the files (and the I/O of
+// the Combining step) at the cost of some CPU time. Plain files left by a build without this option can still be read.
+//#define DELTA_CODED_FILES
+//#define DELTA_BLOCK_NODES 4096
+
+// If defined, sorted node files (expanded chunks, closed and combined) get a small ".idx" file next to them, with every
+// NODE_INDEX_INTERVAL-th node (or the first node of every delta-coded block). Binary searches in these files (splitting the
+// Merging step between workers) and seeks in delta-coded files start from it instead of the whole file.
+//#define NODE_INDEX
+//#define NODE_INDEX_INTERVAL 4096
+
+// If defined, the Combining step checks the expanded nodes against sorted runs of closed nodes (the closed files, and runs compacted
+// from them in the background), each with a Bloom filter, instead of merging them with a combined file of all nodes seen so far; the
+// combined file only keeps the nodes which aren't closed yet. This makes the Combining step's I/O follow the size of the frontier rather
+// than of the whole search, which pays off once the combined file no longer fits in the OS cache. The filters and every
+// NODE_INDEX_INTERVAL-th state of each run are kept in memory outside of RAM_SIZE (BLOOM_BITS_PER_NODE bits per closed node), and are
+// rebuilt from the runs when resuming. PARALLEL_COMBINING is not used. A search started with this option must be finished with it,
+// but it can take over a search started without it. With DELTA_CODED_FILES, NODE_INDEX is required, so that looking up a
+// state doesn't decode the runs from the start.
+//#define TIERED_CLOSED_SET
+//#define TIERED_FANOUT 4 // this many consecutive runs of similar size are merged into one
+//#define TIERED_MAX_RUNS 32 // above this many runs, the smallest consecutive ones are merged too
+//#define BLOOM_BITS_PER_NODE 10
+
+// If defined, no closed node files are written: the Expanding step reads the nodes of the current frame group from the combined
+// file instead (it keeps the lowest frame of each state, so they are all in it), and so does tracing the exit, which then reads
+// the last combined file once per frame group. This saves writing every closed node a second time, and the disk space of the
+// closed files, at the cost of reading the whole combined file in the Expanding step. Not used with TIERED_CLOSED_SET. A search
+// started with this option must be finished with it (the exit can't be traced without the closed files), and the runmodes which
+// read closed files don't find any.
+//#define NO_CLOSED_FILES
 
 // This option disables flushing files to disk (fflush/FlushFileBuffers).
 // Turning this on will speed up search, but will likely cause data loss in case of system crash or power failure.
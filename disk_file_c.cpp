@@ -160,6 +160,7 @@ public:
 			{
 				if (feof(archive))
 				{
+					bytes += r;
 					assert(bytes % sizeof(NODE) == 0, "Unaligned EOF");
 					return bytes / sizeof(NODE);
 				}
@@ -0,0 +1,364 @@
+// Memory-mapped POSIX files
+// Input files are mapped whole: buffered input streams hand out nodes straight from the mapping instead of copying them into
+// their buffer, and seeking (sample, binary searches) costs nothing. Output files are written with write(), as with DISK_POSIX.
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h> // perror
+
+#ifdef USE_UNBUFFERED_DISK_IO
+#error USE_UNBUFFERED_DISK_IO is not supported in DISK_MMAP
+#endif
+
+#if UINTPTR_MAX <= 0xFFFFFFFFU
+#error DISK_MMAP needs a 64-bit address space
+#endif
+
+#ifndef MMAP_WINDOW_SIZE
+# define MMAP_WINDOW_SIZE (64*1024*1024) // bytes ahead of a sequential scan which the kernel is asked to read in
+#endif
+
+uint64_t getFileSize(const char* filename)
+{
+	struct stat st;
+	if (stat(filename, &st) == 0)
+		return st.st_size;
+	perror(format("stat (%s)", filename));
+	return 0;
+}
+
+template<class NODE>
+class Stream
+{
+protected:
+	int archive; // file descriptor
+
+public:
+	Stream() : archive(-1) {}
+
+	bool isOpen() const { return archive >= 0; }
+
+	uint64_t size()
+	{
+		struct stat st;
+		if (fstat(archive, &st) == 0)
+		{
+			assert(st.st_size % sizeof(NODE) == 0, "Unaligned EOF");
+			return st.st_size / sizeof(NODE);
+		}
+		perror("fstat");
+		return 0;
+	}
+
+	uint64_t position()
+	{
+		return lseek(archive, 0, SEEK_CUR) / sizeof(NODE);
+	}
+
+	void seek(uint64_t pos)
+	{
+		off_t res = lseek(archive, pos * sizeof(NODE), SEEK_SET);
+		if (res == -1)
+			perror("lseek");
+	}
+
+	void close()
+	{
+		if (isOpen())
+		{
+#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
+			ftruncate(archive, position() * sizeof(NODE));
+#endif
+			::close(archive);
+			archive = -1;
+		}
+	}
+
+	~Stream()
+	{
+		close();
+	}
+};
+
+template<class NODE>
+class OutputStream : virtual public Stream<NODE>
+{
+protected:
+	using Stream<NODE>::archive;
+
+public:
+	using Stream<NODE>::seek;
+	using Stream<NODE>::size;
+	using Stream<NODE>::isOpen;
+
+	OutputStream(){}
+
+	OutputStream(const char* filename, bool resume=false)
+	{
+		open(filename, resume);
+	}
+
+	void open(const char* filename, bool resume=false)
+	{
+		archive = ::open(filename, O_WRONLY | (resume ? 0 : O_CREAT | O_TRUNC), 0666);
+		if (archive < 0)
+			perror(format("File creation failure (%s)", filename));
+		if (resume)
+			seek(size());
+	}
+
+	void write(const NODE* p, size_t n)
+	{
+		assert(isOpen(), "File not open");
+		size_t total = n * sizeof(NODE);
+		size_t bytes = 0;
+		const char* data = (const char*)p;
+		while (bytes < total) // write in 256 KB chunks
+		{
+			size_t left = total-bytes;
+			uint32_t chunk = left > 256*1024 ? 256*1024 : (uint32_t)left;
+			ssize_t w = ::write(archive, data + bytes, chunk);
+			if (w < 0)
+				perror("Write error");
+			if (w == 0)
+				perror("Out of disk space?");
+			bytes += w;
+		}
+	}
+
+#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
+	void preallocate(uint64_t size)
+	{
+		assert(isOpen());
+		int res = posix_fallocate(archive, 0, size);
+		if (res != 0)
+			perror("fallocate");
+		seek(0);
+	}
+#endif
+
+	void flush()
+	{
+		fsync(archive);
+	}
+};
+
+template<class NODE>
+class InputStream : virtual public Stream<NODE>
+{
+protected:
+	using Stream<NODE>::archive;
+
+	const char* mapping; // the whole file, or NULL if it is empty
+	uint64_t mappingSize, offset; // in bytes
+	uint64_t advisedEnd; // the end of the part of the file which the kernel was asked to read in
+	bool sequential;
+
+	void openMapped(const char* filename, int flags)
+	{
+		archive = ::open(filename, flags);
+		if (archive < 0)
+			perror(format("File open failure (%s)", filename));
+		mappingSize = Stream<NODE>::size() * sizeof(NODE);
+		mapping = NULL;
+		if (mappingSize)
+		{
+			void* m = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, archive, 0);
+			if (m == MAP_FAILED)
+				error(format("mmap failed (%s): %s", filename, strerror(errno)));
+			mapping = (const char*)m;
+		}
+		offset = advisedEnd = 0;
+		sequential = false;
+	}
+
+	// Asks the kernel to read in the file up to a window ahead of the current position, so that a sequential scan rarely waits
+	// for a page fault. The first time, the whole mapping is also marked as sequential, so that pages behind are dropped early.
+	void adviseAhead()
+	{
+		if (offset + MMAP_WINDOW_SIZE/2 < advisedEnd || advisedEnd >= mappingSize)
+			return;
+		if (!sequential)
+		{
+			madvise((void*)mapping, mappingSize, MADV_SEQUENTIAL);
+			sequential = true;
+		}
+		static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+		uint64_t start = advisedEnd > offset ? advisedEnd : offset & ~(pageSize-1);
+		uint64_t end = start + MMAP_WINDOW_SIZE < mappingSize ? start + MMAP_WINDOW_SIZE : mappingSize;
+		madvise((void*)(mapping + start), end - start, MADV_WILLNEED);
+		advisedEnd = end;
+	}
+
+public:
+	enum { MAPPED = true }; // ReadBuffer uses view() instead of read()
+
+	using Stream<NODE>::isOpen;
+
+	InputStream() : mapping(NULL), mappingSize(0), offset(0), advisedEnd(0), sequential(false) {}
+
+	InputStream(const char* filename)
+	{
+		open(filename);
+	}
+
+	~InputStream()
+	{
+		close();
+	}
+
+	void open(const char* filename)
+	{
+		openMapped(filename, O_RDONLY);
+	}
+
+	void close()
+	{
+		if (mapping)
+		{
+			munmap((void*)mapping, mappingSize);
+			mapping = NULL;
+		}
+		mappingSize = offset = 0;
+		Stream<NODE>::close();
+	}
+
+	uint64_t size()
+	{
+		return mappingSize / sizeof(NODE);
+	}
+
+	uint64_t position()
+	{
+		return offset / sizeof(NODE);
+	}
+
+	void seek(uint64_t pos)
+	{
+		offset = pos * sizeof(NODE);
+	}
+
+	// Returns up to n nodes at the current position, without copying them, and moves past them.
+	// They stay valid until the stream is closed.
+	const NODE* view(size_t n, size_t* count)
+	{
+		assert(isOpen(), "File not open");
+		uint64_t left = offset < mappingSize ? (mappingSize - offset) / sizeof(NODE) : 0;
+		if (n > left)
+			n = (size_t)left;
+		const NODE* p = (const NODE*)(mapping + offset);
+		offset += n * sizeof(NODE);
+		*count = n;
+		adviseAhead();
+		return p;
+	}
+
+	size_t read(NODE* p, size_t n)
+	{
+		assert(isOpen(), "File not open");
+		uint64_t left = offset < mappingSize ? (mappingSize - offset) / sizeof(NODE) : 0;
+		if (n > left)
+			n = (size_t)left;
+		memcpy(p, mapping + offset, n * sizeof(NODE));
+		offset += n * sizeof(NODE);
+		if (n > 1) // single nodes are read at random positions (sample, binary searches)
+			adviseAhead();
+		return n;
+	}
+};
+
+// For in-place filtering. Written nodes must be <= read nodes.
+template<class NODE>
+class RewriteStream : public InputStream<NODE>, public OutputStream<NODE>
+{
+	using Stream<NODE>::archive;
+	using Stream<NODE>::isOpen;
+
+	uint64_t readpos, writepos;
+public:
+	enum { MAPPED = false }; // nodes are written back over the mapped file, so they are copied out of it first
+
+	using InputStream<NODE>::position;
+	using InputStream<NODE>::seek;
+
+	RewriteStream(){}
+
+	RewriteStream(const char* filename)
+	{
+		open(filename);
+	}
+
+	void open(const char* filename)
+	{
+		this->openMapped(filename, O_RDWR);
+		readpos = writepos = 0;
+	}
+
+	uint64_t size()
+	{
+		return InputStream<NODE>::size();
+	}
+
+	size_t read(NODE* p, size_t n)
+	{
+		assert(readpos >= writepos, "Write position overwritten");
+		InputStream<NODE>::seek(readpos);
+		size_t r = InputStream<NODE>::read(p, n);
+		readpos += r;
+		return r;
+	}
+
+	void write(const NODE* p, size_t n)
+	{
+		Stream<NODE>::seek(writepos);
+		OutputStream<NODE>::write(p, n);
+		writepos += n;
+	}
+
+	void truncate()
+	{
+		Stream<NODE>::seek(writepos); // so that closing a preallocated file truncates it at the same place
+		if (ftruncate(archive, writepos * sizeof(NODE)) != 0)
+			perror("ftruncate");
+	}
+};
+
+void deleteFile(const char* filename)
+{
+	int ret = unlink(filename);
+	if (ret < 0)
+		perror("unlink");
+}
+
+void renameFile(const char* from, const char* to, bool replaceExisting=false)
+{
+	int ret = rename(from, to);
+	if (ret < 0)
+		perror("rename");
+}
+
+bool fileExists(const char* filename)
+{
+	struct stat st;
+	return stat(filename, &st) == 0;
+}
+
+uint64_t getFreeSpace()
+{
+	struct statvfs stat;
+	if (statvfs("." , &stat) != 0)
+		perror("statvfs");
+	return stat.f_bavail * stat.f_frsize;
+}
+
+#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
+void preparePreallocation()
+{
+}
+#endif
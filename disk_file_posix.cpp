@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h> // perror
 
 uint64_t getFileSize(const char* filename)
@@ -16,14 +17,144 @@ uint64_t getFileSize(const char* filename)
 	return 0;
 }
 
+#ifdef USE_UNBUFFERED_DISK_IO
+
+// O_DIRECT transfers need the file offset and length to be multiples of the logical block size, and the memory to be aligned too.
+// Reads and writes which start or end in the middle of a block go through a block-sized buffer (like sectorBuffer in the Windows
+// version); whole blocks from or to memory which is not aligned are copied through a staging buffer, shared by the streams of a thread.
+
+class DirectIOStagingBuffer
+{
+	char* buf;
+
+public:
+	enum { SIZE = 1<<20, ALIGNMENT = 1<<16 }; // both are multiples of any logical block size / memory alignment we'd see
+
+	DirectIOStagingBuffer() : buf(NULL) {}
+	~DirectIOStagingBuffer() { free(buf); }
+
+	char* get()
+	{
+		if (!buf && posix_memalign((void**)&buf, ALIGNMENT, SIZE) != 0)
+			error("Staging buffer allocation failed");
+		return buf;
+	}
+};
+
+thread_local DirectIOStagingBuffer directIOStaging;
+
+void warnNoDirectIO(const char* filename)
+{
+	static bool warned = false;
+	if (!warned)
+	{
+		warned = true;
+		printf("Warning: O_DIRECT is not supported for %s, using buffered I/O\n", filename);
+	}
+}
+
+#endif
+
 template<class NODE>
 class Stream
 {
 protected:
 	int archive; // file descriptor
+#ifdef USE_UNBUFFERED_DISK_IO
+	uint64_t offset; // in bytes; transfers use explicit offsets, not the descriptor's position
+	uint32_t blockSize; // file offsets and lengths of transfers must be multiples of this
+	uint32_t memoryAlignment; // and memory addresses multiples of this
+
+	// Opens the file with O_DIRECT (F_NOCACHE on macOS), and finds out the alignment it requires. File systems which don't
+	// support it (e.g. tmpfs on older kernels) are used with buffered I/O, with the same code paths.
+	void openDirect(const char* filename, int flags)
+	{
+# ifdef O_DIRECT
+		archive = ::open(filename, flags | O_DIRECT, 0666);
+		if (archive < 0 && errno == EINVAL)
+		{
+			warnNoDirectIO(filename);
+			archive = ::open(filename, flags, 0666);
+		}
+# else // macOS
+		archive = ::open(filename, flags, 0666);
+		if (archive >= 0)
+			fcntl(archive, F_NOCACHE, 1);
+# endif
+		offset = 0;
+		blockSize = memoryAlignment = 512;
+		if (archive < 0)
+			return;
+# ifdef STATX_DIOALIGN
+		struct statx stx;
+		if (statx(archive, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN))
+		{
+			if (stx.stx_dio_offset_align)
+			{
+				blockSize = stx.stx_dio_offset_align;
+				memoryAlignment = stx.stx_dio_mem_align;
+			}
+			else // opened with O_DIRECT, but it won't work for this file
+			{
+				warnNoDirectIO(filename);
+				fcntl(archive, F_SETFL, fcntl(archive, F_GETFL) & ~O_DIRECT);
+			}
+			return;
+		}
+# endif
+		// Older kernels don't report it; the file system's block size is a multiple of the logical block size.
+		struct stat st;
+		if (fstat(archive, &st) == 0 && st.st_blksize > 512)
+			blockSize = memoryAlignment = (uint32_t)st.st_blksize;
+	}
+
+	char* allocateBlock()
+	{
+		char* block;
+		if (posix_memalign((void**)&block, memoryAlignment > sizeof(void*) ? memoryAlignment : sizeof(void*), blockSize) != 0)
+			error("Block buffer allocation failed");
+		return block;
+	}
+
+	// Reads or writes len bytes at pos; both must be multiples of blockSize.
+	// Returns the number of bytes transferred, which is less than len only when reading past the end of the file.
+	size_t transferBlocks(bool write, char* data, size_t len, uint64_t pos)
+	{
+		size_t done = 0;
+		while (done < len)
+		{
+			char* p = data + done;
+			bool staged = (uintptr_t)p % memoryAlignment != 0;
+			size_t chunk = staged ? DirectIOStagingBuffer::SIZE : DISK_IO_CHUNK_SIZE - DISK_IO_CHUNK_SIZE % blockSize;
+			if (chunk > len - done)
+				chunk = len - done;
+			char* buf = staged ? directIOStaging.get() : p;
+			if (write && staged)
+				memcpy(buf, p, chunk);
+			ssize_t r = write ? pwrite(archive, buf, chunk, pos + done) : pread(archive, buf, chunk, pos + done);
+			if (r < 0)
+			{
+				perror(write ? "Write error" : "read");
+				break;
+			}
+			if (!write && staged)
+				memcpy(p, buf, r);
+			done += r;
+			if (r == 0 && write)
+				perror("Out of disk space?");
+			if (r == 0 || (!write && (size_t)r < chunk))
+				break;
+		}
+		return done;
+	}
+#endif
 
 public:
+#ifdef USE_UNBUFFERED_DISK_IO
+	Stream() : archive(-1), offset(0), blockSize(512), memoryAlignment(512) {}
+#else
 	Stream() : archive(-1) {}
+#endif
 
 	bool isOpen() const { return archive >= 0; }
 
@@ -39,6 +170,17 @@ public:
 		return 0;
 	}
 
+#ifdef USE_UNBUFFERED_DISK_IO
+	uint64_t position()
+	{
+		return offset / sizeof(NODE);
+	}
+
+	void seek(uint64_t pos)
+	{
+		offset = pos * sizeof(NODE);
+	}
+#else
 	uint64_t position()
 	{
 		return lseek(archive, 0, SEEK_CUR) / sizeof(NODE);
@@ -50,13 +192,14 @@ public:
 		if (res == -1)
 			perror("lseek");
 	}
+#endif
 
 	void close()
 	{
 		if (isOpen())
 		{
 #if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
-			ftruncate(archive, position());
+			ftruncate(archive, position() * sizeof(NODE));
 #endif
 			::close(archive);
 			archive = -1;
@@ -71,366 +214,264 @@ public:
 
 #ifdef USE_UNBUFFERED_DISK_IO
 
-#error Unfinished, TODO
-
 template<class NODE>
 class OutputStream : virtual public Stream<NODE>
 {
+protected:
 	using Stream<NODE>::archive;
-	using Stream<NODE>::isOpen;
-	using Stream<NODE>::size;
+	using Stream<NODE>::offset;
+	using Stream<NODE>::blockSize;
 
-private:
-	uint8_t sectorBuffer[512]; // currently assumes 512 byte sectors; maybe use GetDiskFreeSpace() in the future for increased portability
-	uint16_t sectorBufferUse;
-	uint16_t sectorBufferFlushed;
-	char filenameOpened[PATH_MAX];
+	enum : uint64_t { NO_SECTOR = ~(uint64_t)0 };
 
-public:
-	OutputStream() : sectorBufferUse(0), sectorBufferFlushed(0) {}
+	char* sector; // the block being written partially
+	uint64_t sectorStart; // its offset in the file, or NO_SECTOR
+	bool sectorDirty;
+	uint64_t dataEnd; // the contents of the file after this don't need to be preserved when writing a partial block
+	uint64_t fileSize; // the size the file should have; a partial last block is written padded, then the file is truncated back
 
-	OutputStream(const char* filename, bool resume=false) : sectorBufferUse(0), sectorBufferFlushed(0)
+	// Makes the block at start the current sector, reading its current contents.
+	void loadSector(uint64_t start)
 	{
-		open(filename, resume);
+		if (sectorStart == start)
+			return;
+		flushSector();
+		size_t r = start < dataEnd ? this->transferBlocks(false, sector, blockSize, start) : 0;
+		memset(sector + r, 0, blockSize - r);
+		sectorStart = start;
 	}
 
-	~OutputStream()
+	void flushSector()
 	{
-		close();
+		if (!sectorDirty)
+			return;
+		this->transferBlocks(true, sector, blockSize, sectorStart);
+		sectorDirty = false;
+		if (sectorStart + blockSize > fileSize && ftruncate(archive, fileSize) != 0)
+			perror("ftruncate");
 	}
 
-	void close()
+	void advance(size_t bytes)
 	{
-		flush(false);
+		offset += bytes;
+		if (dataEnd < offset)
+			dataEnd = offset;
+		if (fileSize < offset)
+			fileSize = offset;
 	}
 
-	void flush()
+protected:
+	// Call after opening the file.
+	void startWriting()
 	{
-		flush(true);
+		free(sector);
+		sector = this->allocateBlock();
+		sectorStart = NO_SECTOR;
+		sectorDirty = false;
+		dataEnd = fileSize = Stream<NODE>::size() * sizeof(NODE);
 	}
 
-	NOINLINE(void) seek(uint64_t pos)
-	{
-		if (sectorBufferFlushed < sectorBufferUse)
-		{
-			ssize_t w = ::write(archive, sectorBuffer, sizeof(sectorBuffer));
-			if (w < 0)
-				perror("write");
-			if (w != sizeof(sectorBuffer))
-				perror("write (incomplete) - out of disk space?");
-			sectorBufferUse = 0;
-			sectorBufferFlushed = 0;
-		}
-
-		pos *= sizeof(NODE);
-
-		Stream<NODE>::seek(pos & -(int64_t)sizeof(sectorBuffer));
+public:
+	using Stream<NODE>::seek;
+	using Stream<NODE>::isOpen;
 
-		sectorBufferUse = (uint16_t)pos % (uint16_t)sizeof(sectorBuffer);
+	OutputStream() : sector(NULL), sectorStart(NO_SECTOR), sectorDirty(false), dataEnd(0), fileSize(0) {}
 
-		if (sectorBufferUse)
-		{
-			memset(sectorBuffer, 0, sizeof(sectorBuffer));
-			ssize_t r = ::read(archive, sectorBuffer, sizeof(sectorBuffer));
-			if (r < 0)
-				perror("read");
-			if (r>=0 && r!=sectorBufferUse)
-				perror(format("Read alignment error in write alignment (%s)", filenameOpened));
-			if (r==0)
-				perror(format("Read error in write alignment (%s)", filenameOpened));
+	OutputStream(const char* filename, bool resume=false) : sector(NULL), sectorStart(NO_SECTOR), sectorDirty(false), dataEnd(0), fileSize(0)
+	{
+		open(filename, resume);
+	}
 
-			Stream<NODE>::seek(pos & -(int64_t)sizeof(sectorBuffer));
-		}
+	~OutputStream()
+	{
+		close();
+		free(sector);
 	}
 
-	NOINLINE(void) open(const char* filename, bool resume=false)
+	void open(const char* filename, bool resume=false)
 	{
 		assert(!isOpen());
-		sectorBufferUse = 0;
-		sectorBufferFlushed = 0;
-		strcpy(filenameOpened, filename);
-		archive = ::open(filename, O_RDWR | (resume ? 0 : O_CREAT | O_TRUNC) | O_DIRECT, 0666);
-		if (archive < 0)
+		this->openDirect(filename, O_RDWR | (resume ? 0 : O_CREAT | O_TRUNC));
+		if (!isOpen())
 			perror(format("File creation failure (%s)", filename));
+		startWriting();
 		if (resume)
 			seek(size());
 	}
 
-#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
-	NOINLINE(void) preallocate(uint64_t size)
+	void close()
 	{
-		assert(isOpen());
-		int res = posix_fallocate(archive, 0, size);
-		if (res != 0)
-			perror("fallocate");
-		seek(0);
+		if (isOpen())
+		{
+			flushSector();
+			sectorStart = NO_SECTOR;
+			Stream<NODE>::close();
+		}
+	}
+
+	// Includes a partial last block which wasn't written yet.
+	uint64_t size()
+	{
+		return fileSize / sizeof(NODE);
 	}
-#endif
 
-	NOINLINE(void) write(const NODE* p, size_t n)
+	void write(const NODE* p, size_t n)
 	{
 		assert(isOpen(), "File not open");
 		size_t total = n * sizeof(NODE);
 		size_t bytes = 0;
-		const uint8_t* data = (const uint8_t*)p;
+		char* data = (char*)p;
 		while (bytes < total)
 		{
-			size_t left = total-bytes;
-			uint32_t chunk = left > DISK_IO_CHUNK_SIZE ? DISK_IO_CHUNK_SIZE : (uint32_t)left;
-			if (sectorBufferUse)
+			uint32_t inBlock = (uint32_t)(offset % blockSize);
+			if (inBlock == 0 && total - bytes >= blockSize)
 			{
-				if (chunk > (uint32_t)sizeof(sectorBuffer) - (uint32_t)sectorBufferUse)
-					chunk = (uint32_t)sizeof(sectorBuffer) - (uint32_t)sectorBufferUse;
-				memcpy(sectorBuffer + sectorBufferUse, data + bytes, chunk);
-				sectorBufferUse += (uint16_t)chunk;
-				if (sectorBufferUse == sizeof(sectorBuffer))
+				size_t len = total - bytes;
+				len -= len % blockSize;
+				if (sectorStart != NO_SECTOR && sectorStart >= offset && sectorStart < offset + len) // about to be overwritten
 				{
-					ssize_t w = ::write(archive, sectorBuffer, sizeof(sectorBuffer));
-					if (w < 0)
-						perror("write");
-					if (w != sizeof(sectorBuffer))
-						perror("write (incomplete) - out of disk space?");
-					sectorBufferUse = 0;
-					sectorBufferFlushed = 0;
+					sectorStart = NO_SECTOR;
+					sectorDirty = false;
 				}
-				bytes += chunk;
-				continue;
+				size_t w = this->transferBlocks(true, data + bytes, len, offset);
+				advance(w);
+				bytes += w;
+				if (w < len)
+					break;
 			}
-			if (chunk % sizeof(sectorBuffer) != 0)
+			else
 			{
-				if (chunk > sizeof(sectorBuffer))
-					chunk &= -(int)sizeof(sectorBuffer);
-				else
-				{
-					memset(sectorBuffer, 0, sizeof(sectorBuffer));
-					memcpy(sectorBuffer, data + bytes, chunk);
-					sectorBufferUse = (uint16_t)chunk;
-					return;
-				}
+				loadSector(offset - inBlock);
+				size_t len = blockSize - inBlock;
+				if (len > total - bytes)
+					len = total - bytes;
+				memcpy(sector + inBlock, data + bytes, len);
+				sectorDirty = true;
+				advance(len);
+				bytes += len;
+				if (inBlock + len == blockSize)
+					flushSector();
 			}
-			ssize_t w = ::write(archive, data + bytes, chunk);
-			if (w < 0)
-				perror("write");
-			if (w != sizeof(sectorBuffer))
-				perror("write (incomplete) - out of disk space?");
-			bytes += w;
 		}
 	}
 
-private:
-	NOINLINE(void) flush(bool reopen)
-	{
-		if (!archive)
-			return;
-
-		if (sectorBufferFlushed == sectorBufferUse) // nothing to flush?
-		{
-			if (reopen)
-				FlushFileBuffers(archive);
-			else
-			{
 #if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
-				SetEndOfFile(archive);
+	void preallocate(uint64_t size)
+	{
+		assert(isOpen());
+		int res = posix_fallocate(archive, 0, size);
+		if (res != 0)
+			perror("fallocate");
+		else if (fileSize < size)
+			fileSize = size;
+		seek(0);
+	}
 #endif
-				CloseHandle(archive);
-				archive = 0;
-			}
-			return;
-		}
-		assert(sectorBufferFlushed < sectorBufferUse);
 
-		BOOL b;
-		uint32_t w;
-		ULARGE_INTEGER size;
-#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
-		{
-			LARGE_INTEGER size0;
-			size0.QuadPart = 0;
-			if (!SetFilePointerEx(archive, size0, &(LARGE_INTEGER&)size, FILE_CURRENT))
-				perror("Seek error");
-		}
-#else
-		size.LowPart = GetFileSize(archive, &size.HighPart);
-#endif
-		size.QuadPart += sectorBufferUse;
-
-		b = WriteFile(archive, sectorBuffer, sizeof(sectorBuffer), &w, NULL);
-		if (!b)
-			perror("Write error");
-		if (w != sizeof(sectorBuffer))
-			perror("Out of disk space?");
-		CloseHandle(archive);
-
-		archive = CreateFile(filenameOpened, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_WRITE_THROUGH, NULL);
-		if (archive == INVALID_HANDLE_VALUE)
-			perror(format("File creation failure upon reopening (%s) buffered", filenameOpened));
-		
-		ULARGE_INTEGER seekPos = size;
-		uint32_t seek_error;
-		seekPos.LowPart = SetFilePointer(archive, seekPos.LowPart, (LONG*)&seekPos.HighPart, FILE_BEGIN);
-		if (seekPos.LowPart == INVALID_SET_FILE_POINTER && (seek_error=GetLastError()) != NO_ERROR)
-			perror("SetFilePointer() #1 error");
-		if (seekPos.QuadPart != size.QuadPart)
-			error("Error setting file size");
-		b = SetEndOfFile(archive);
-		if (!b)
-			perror("SetEndOfFile() error");
-		CloseHandle(archive);
-		sectorBufferFlushed = sectorBufferUse;
-		if (!reopen)
-		{
-			archive = 0;
-			return;
-		}
+	void flush()
+	{
+		flushSector();
+		fsync(archive);
+	}
 
-		archive = CreateFile(filenameOpened, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_NO_BUFFERING, NULL);
-		if (archive == INVALID_HANDLE_VALUE)
-			perror(format("File creation failure upon reopening (%s) unbuffered", filenameOpened));
-		size.QuadPart -= sectorBufferUse;
-		seekPos.QuadPart = size.QuadPart;
-		seekPos.LowPart = SetFilePointer(archive, seekPos.LowPart, (LONG*)&seekPos.HighPart, FILE_BEGIN);
-		if (seekPos.QuadPart != size.QuadPart)
-			perror("SetFilePointer() #2 error");
+	// For RewriteStream
+	void truncate(uint64_t bytes)
+	{
+		flushSector();
+		if (ftruncate(archive, bytes) != 0)
+			perror("ftruncate");
+		dataEnd = fileSize = bytes;
+		sectorStart = NO_SECTOR;
 	}
 };
 
 template<class NODE>
 class InputStream : virtual public Stream<NODE>
 {
-private:
-	uint8_t sectorBuffer[512]; // currently assumes 512 byte sectors; maybe use GetDiskFreeSpace() in the future for increased portability
-	unsigned sectorBufferPos;
-	unsigned sectorBufferEnd;
-	uint64_t filePosition;
-#ifdef DEBUG
-	char filenameOpened[MAX_PATH];
-#endif
+protected:
+	using Stream<NODE>::archive;
+	using Stream<NODE>::offset;
+	using Stream<NODE>::blockSize;
 
-public:
-	InputStream() : sectorBufferPos(0), filePosition(0) {}
+	enum : uint64_t { NO_BLOCK = ~(uint64_t)0 };
+
+	char* block; // the last block read partially
+	uint64_t blockStart; // its offset in the file, or NO_BLOCK
+	uint32_t blockLength; // less than blockSize at the end of the file
 
-	InputStream(const char* filename) : sectorBufferPos(0), filePosition(0)
+protected:
+	// Call after opening the file.
+	void startReading()
 	{
-		open(filename);
+		free(block);
+		block = this->allocateBlock();
+		blockStart = NO_BLOCK;
 	}
 
-	NOINLINE(void) open(const char* filename)
+public:
+	using Stream<NODE>::size;
+	using Stream<NODE>::isOpen;
+
+	InputStream() : block(NULL), blockStart(NO_BLOCK), blockLength(0) {}
+
+	InputStream(const char* filename) : block(NULL), blockStart(NO_BLOCK), blockLength(0)
 	{
-#ifdef DEBUG
-		strcpy(filenameOpened, filename);
-#endif
-		assert(archive==0);
-		sectorBufferPos = 0;
-		filePosition = 0;
-		archive = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_NO_BUFFERING, NULL);
-		if (archive == INVALID_HANDLE_VALUE)
-			perror(format("File open failure (%s)", filename));
+		open(filename);
 	}
 
-	uint64_t position()
+	~InputStream()
 	{
-		return filePosition / sizeof(NODE);
+		free(block);
 	}
 
-	NOINLINE(void) seek(uint64_t pos)
+	void open(const char* filename)
 	{
-		filePosition = pos * sizeof(NODE);
-		sectorBufferPos = (unsigned)filePosition % (unsigned)sizeof(sectorBuffer);
-
-		LARGE_INTEGER li;
-		uint32_t error;
-		li.QuadPart = filePosition & -(int64_t)sizeof(sectorBuffer);
-		li.LowPart = SetFilePointer(archive, li.LowPart, &li.HighPart, FILE_BEGIN);
-		if (li.LowPart == INVALID_SET_FILE_POINTER && (error=GetLastError()) != NO_ERROR)
-			perror("Seek error");
-
-		if (sectorBufferPos)
-		{
-			uint32_t r;
-			BOOL b = ReadFile(archive, sectorBuffer, sizeof(sectorBuffer), &r, NULL);
-			if (b)
-				sectorBufferEnd = r;
-			if (!b || r==0)
-				perror(format("Read error %d", GetLastError()));
-		}
+		assert(!isOpen());
+		this->openDirect(filename, O_RDONLY);
+		if (!isOpen())
+			perror(format("File open failure (%s)", filename));
+		startReading();
 	}
 
-	NOINLINE(size_t) read(NODE* p, size_t n)
+	size_t read(NODE* p, size_t n)
 	{
-		assert(archive, "File not open");
+		assert(isOpen(), "File not open");
 		size_t total = n * sizeof(NODE);
 		size_t bytes = 0;
 		char* data = (char*)p;
 		while (bytes < total)
 		{
-			size_t left = total-bytes;
-			uint32_t chunk = left > DISK_IO_CHUNK_SIZE ? DISK_IO_CHUNK_SIZE : (uint32_t)left;
-			uint32_t r = 0;
-			BOOL b;
-			if (sectorBufferPos)
+			uint32_t inBlock = (uint32_t)(offset % blockSize);
+			if (inBlock == 0 && total - bytes >= blockSize)
 			{
-				if (chunk > sectorBufferEnd - sectorBufferPos)
-				{
-					chunk = sectorBufferEnd - sectorBufferPos;
-					if (chunk == 0)
-					{
-						assert(bytes % sizeof(NODE) == 0, "Unaligned EOF");
-						return bytes / sizeof(NODE);
-					}
-				}
-				memcpy(data + bytes, sectorBuffer + sectorBufferPos, chunk);
-				sectorBufferPos += chunk;
-				if (sectorBufferPos == sizeof(sectorBuffer))
-					sectorBufferPos = 0;
-				filePosition += chunk;
-				bytes += chunk;
-				continue;
+				size_t len = total - bytes;
+				len -= len % blockSize;
+				size_t r = this->transferBlocks(false, data + bytes, len, offset);
+				offset += r;
+				bytes += r;
+				if (r < len)
+					break;
 			}
-			if (chunk % sizeof(sectorBuffer) != 0)
+			else
 			{
-				if (chunk > sizeof(sectorBuffer))
-					chunk &= -(int)sizeof(sectorBuffer);
-				else
+				uint64_t start = offset - inBlock;
+				if (blockStart != start)
 				{
-					b = ReadFile(archive, sectorBuffer, sizeof(sectorBuffer), &r, NULL);
-					sectorBufferEnd = r;
-					if (b && r!=sizeof(sectorBuffer))
-					{
-						if (r<chunk)
-						{
-							sectorBufferPos = r;
-							filePosition += r;
-							memcpy(data + bytes, sectorBuffer, r);
-							bytes += r;
-							assert(bytes % sizeof(NODE) == 0, "Unaligned EOF");
-							return bytes / sizeof(NODE);
-						}
-					}
-					if (!b || r==0)
-						perror(format("Read error %d", GetLastError()));
-					memcpy(data + bytes, sectorBuffer, chunk);
-					sectorBufferPos = chunk;
-					filePosition += chunk;
-					return n;
+					blockLength = (uint32_t)this->transferBlocks(false, block, blockSize, start);
+					blockStart = start;
 				}
+				if (inBlock >= blockLength)
+					break;
+				size_t len = blockLength - inBlock;
+				if (len > total - bytes)
+					len = total - bytes;
+				memcpy(data + bytes, block + inBlock, len);
+				offset += len;
+				bytes += len;
 			}
-			b = ReadFile(archive, data + bytes, chunk, &r, NULL);
-			if (b && r<chunk)
-			{
-				sectorBufferEnd = r % (uint32_t)sizeof(sectorBuffer);
-				sectorBufferPos = sectorBufferEnd;
-				memcpy(sectorBuffer, data + bytes + r - sectorBufferEnd, sectorBufferEnd);
-				filePosition += r;
-				bytes += r;
-				assert(bytes % sizeof(NODE) == 0, "Unaligned EOF");
-				return bytes / sizeof(NODE);
-			}
-			if (!b || r==0)
-				perror(format("Read error %d", GetLastError()));
-			filePosition += r;
-			bytes += r;
 		}
-		return n;
+		assert(bytes % sizeof(NODE) == 0, "Unaligned EOF");
+		return bytes / sizeof(NODE);
 	}
 };
 
@@ -439,6 +480,7 @@ public:
 template<class NODE>
 class OutputStream : virtual public Stream<NODE>
 {
+protected:
 	using Stream<NODE>::archive;
 
 public:
@@ -501,6 +543,7 @@ public:
 template<class NODE>
 class InputStream : virtual public Stream<NODE>
 {
+protected:
 	using Stream<NODE>::archive;
 
 public:
@@ -567,9 +610,15 @@ public:
 
 	void open(const char* filename)
 	{
-		archive = open(filename, O_RDWR);
+#ifdef USE_UNBUFFERED_DISK_IO
+		this->openDirect(filename, O_RDWR);
+		this->startReading();
+		this->startWriting();
+#else
+		archive = ::open(filename, O_RDWR);
+#endif
 		if (archive < 0)
-			perror("File creation failure");
+			perror(format("File open failure (%s)", filename));
 		readpos = writepos = 0;
 	}
 
@@ -591,8 +640,13 @@ public:
 
 	void truncate()
 	{
-		seek(writepos);
-		SetEndOfFile(archive);
+		seek(writepos); // so that closing a preallocated file truncates it at the same place
+#ifdef USE_UNBUFFERED_DISK_IO
+		OutputStream<NODE>::truncate(writepos * sizeof(NODE));
+#else
+		if (ftruncate(archive, writepos * sizeof(NODE)) != 0)
+			perror("ftruncate");
+#endif
 	}
 };
 
@@ -0,0 +1,477 @@
+// Linux io_uring files
+// Every read or write is split into URING_BLOCK_SIZE blocks, up to URING_QUEUE_DEPTH of which are in flight at once.
+// Each thread has its own ring, so streams used by different threads (merge parts, ASYNC_IO threads) keep separate queues.
+// The kernel interface is used directly (no liburing).
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h> // perror
+#include <linux/io_uring.h>
+
+#ifdef USE_UNBUFFERED_DISK_IO
+#error USE_UNBUFFERED_DISK_IO is not supported in DISK_URING
+#endif
+
+#ifndef URING_QUEUE_DEPTH
+# define URING_QUEUE_DEPTH 8
+#endif
+#ifndef URING_BLOCK_SIZE
+# define URING_BLOCK_SIZE (256*1024)
+#endif
+
+extern void* ram;
+extern void* ramEnd;
+
+uint64_t getFileSize(const char* filename)
+{
+	struct stat st;
+	if (stat(filename, &st) == 0)
+		return st.st_size;
+	perror(format("stat (%s)", filename));
+	return 0;
+}
+
+class URing
+{
+	int fd;
+	unsigned *sqHead, *sqTail, sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, cqMask;
+	io_uring_sqe* sqes;
+	io_uring_cqe* cqes;
+	void *sqRing, *cqRing;
+	size_t sqRingSize, cqRingSize, sqesSize;
+	unsigned ramBuffers; // "ram" is registered as this many fixed buffers of up to 1 GB (the kernel's limit per buffer), if at all
+
+	enum { RAM_BUFFER_SIZE = 1<<30 };
+
+public:
+	URing() : fd(-1) {}
+
+	~URing()
+	{
+		if (fd >= 0)
+		{
+			munmap(sqes, sqesSize);
+			if (cqRing != sqRing)
+				munmap(cqRing, cqRingSize);
+			munmap(sqRing, sqRingSize);
+			::close(fd);
+		}
+	}
+
+	bool isOpen() const { return fd >= 0; }
+
+	void open()
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		fd = (int)syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &p);
+		if (fd < 0)
+			error(format("io_uring_setup failed (%s) - disabled by kernel.io_uring_disabled or a seccomp filter?", strerror(errno)));
+
+		sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			if (cqRingSize > sqRingSize)
+				sqRingSize = cqRingSize;
+			cqRingSize = sqRingSize;
+		}
+		sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sqRing == MAP_FAILED)
+			error("io_uring mmap failed");
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			cqRing = sqRing;
+		else
+		{
+			cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (cqRing == MAP_FAILED)
+				error("io_uring mmap failed");
+		}
+		sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			error("io_uring mmap failed");
+
+		sqHead  = (unsigned*)((char*)sqRing + p.sq_off.head);
+		sqTail  = (unsigned*)((char*)sqRing + p.sq_off.tail);
+		sqMask  = *(unsigned*)((char*)sqRing + p.sq_off.ring_mask);
+		sqArray = (unsigned*)((char*)sqRing + p.sq_off.array);
+		cqHead  = (unsigned*)((char*)cqRing + p.cq_off.head);
+		cqTail  = (unsigned*)((char*)cqRing + p.cq_off.tail);
+		cqMask  = *(unsigned*)((char*)cqRing + p.cq_off.ring_mask);
+		cqes    = (io_uring_cqe*)((char*)cqRing + p.cq_off.cqes);
+
+		ramBuffers = 0;
+#ifdef URING_REGISTER_RAM
+		// Pins all of "ram" in physical memory. Without CAP_IPC_LOCK this is limited by "ulimit -l", so failing is not an error.
+		unsigned count = (unsigned)(((char*)ramEnd - (char*)ram + RAM_BUFFER_SIZE-1) / RAM_BUFFER_SIZE);
+		iovec* iov = new iovec[count];
+		for (unsigned i=0; i<count; i++)
+		{
+			iov[i].iov_base = (char*)ram + (size_t)i * RAM_BUFFER_SIZE;
+			iov[i].iov_len = i+1<count ? RAM_BUFFER_SIZE : (char*)ramEnd - (char*)iov[i].iov_base;
+		}
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, count) == 0)
+			ramBuffers = count;
+		delete[] iov;
+#endif
+	}
+
+	// Index of the registered buffer containing [p, p+len), or -1 if there is none.
+	int fixedBuffer(const void* p, size_t len) const
+	{
+		if (p < ram || (const char*)p + len > (char*)ramEnd)
+			return -1;
+		size_t offset = (const char*)p - (char*)ram;
+		unsigned index = (unsigned)(offset / RAM_BUFFER_SIZE);
+		if (index >= ramBuffers || (offset + len - 1) / RAM_BUFFER_SIZE != index)
+			return -1;
+		return (int)index;
+	}
+
+	// Queues one read or write; the caller makes sure that no more than URING_QUEUE_DEPTH are in flight.
+	void queue(int file, bool write, void* data, uint32_t len, uint64_t offset, uint64_t userData)
+	{
+		unsigned tail = *sqTail;
+		unsigned index = tail & sqMask;
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		int buffer = fixedBuffer(data, len);
+		if (buffer >= 0)
+		{
+			sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->buf_index = (uint16_t)buffer;
+		}
+		else
+			sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = file;
+		sqe->addr = (uint64_t)(uintptr_t)data;
+		sqe->len = len;
+		sqe->off = offset;
+		sqe->user_data = userData;
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail+1, __ATOMIC_RELEASE);
+	}
+
+	// Submits everything queued, and waits for at least one completion.
+	void submitAndWait(unsigned submit)
+	{
+		while (syscall(__NR_io_uring_enter, fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+			if (errno != EINTR)
+			{
+				perror("io_uring_enter");
+				break;
+			}
+	}
+
+	bool getCompletion(uint64_t* userData, int* res)
+	{
+		unsigned head = *cqHead;
+		if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+			return false;
+		io_uring_cqe* cqe = &cqes[head & cqMask];
+		*userData = cqe->user_data;
+		*res = cqe->res;
+		__atomic_store_n(cqHead, head+1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+thread_local URing uring;
+
+// Reads or writes len bytes at offset, keeping up to URING_QUEUE_DEPTH blocks in flight.
+// Returns the number of bytes transferred, which is less than len only when reading past the end of the file.
+size_t uringTransfer(int file, bool write, char* data, size_t len, uint64_t offset)
+{
+	if (!uring.isOpen())
+		uring.open();
+
+	size_t blocks = (len + URING_BLOCK_SIZE-1) / URING_BLOCK_SIZE;
+	size_t queued = 0, completed = 0, firstShort = blocks; // firstShort: the first block which wasn't transferred completely
+	unsigned inFlight = 0;
+	while (completed < blocks)
+	{
+		unsigned submit = 0;
+		while (queued < blocks && inFlight < URING_QUEUE_DEPTH)
+		{
+			size_t start = queued * URING_BLOCK_SIZE;
+			uint32_t blockLen = (uint32_t)(len - start < URING_BLOCK_SIZE ? len - start : URING_BLOCK_SIZE);
+			uring.queue(file, write, data + start, blockLen, offset + start, queued);
+			queued++;
+			inFlight++;
+			submit++;
+		}
+
+		uring.submitAndWait(submit);
+
+		uint64_t block;
+		int res;
+		while (uring.getCompletion(&block, &res))
+		{
+			if (res < 0)
+			{
+				errno = -res;
+				perror(write ? "io_uring write" : "io_uring read");
+			}
+			size_t blockLen = len - block * URING_BLOCK_SIZE < URING_BLOCK_SIZE ? len - block * URING_BLOCK_SIZE : URING_BLOCK_SIZE;
+			if ((size_t)res != blockLen && block < firstShort)
+				firstShort = (size_t)block;
+			inFlight--;
+			completed++;
+		}
+	}
+
+	if (firstShort == blocks)
+		return len;
+
+	// Short transfers are rare (the end of the file, or a full disk), so the rest is done synchronously.
+	size_t done = firstShort * URING_BLOCK_SIZE;
+	while (done < len)
+	{
+		ssize_t r = write ? pwrite(file, data + done, len - done, offset + done) : pread(file, data + done, len - done, offset + done);
+		if (r < 0)
+			perror(write ? "Write error" : "read");
+		if (r == 0)
+		{
+			if (write)
+				perror("Out of disk space?");
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
+template<class NODE>
+class Stream
+{
+protected:
+	int archive; // file descriptor
+	uint64_t offset; // in bytes; transfers use explicit offsets, not the descriptor's position
+
+public:
+	Stream() : archive(-1), offset(0) {}
+
+	bool isOpen() const { return archive >= 0; }
+
+	uint64_t size()
+	{
+		struct stat st;
+		if (fstat(archive, &st) == 0)
+		{
+			assert(st.st_size % sizeof(NODE) == 0, "Unaligned EOF");
+			return st.st_size / sizeof(NODE);
+		}
+		perror("fstat");
+		return 0;
+	}
+
+	uint64_t position()
+	{
+		return offset / sizeof(NODE);
+	}
+
+	void seek(uint64_t pos)
+	{
+		offset = pos * sizeof(NODE);
+	}
+
+	void close()
+	{
+		if (isOpen())
+		{
+#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
+			ftruncate(archive, offset);
+#endif
+			::close(archive);
+			archive = -1;
+		}
+	}
+
+	~Stream()
+	{
+		close();
+	}
+};
+
+template<class NODE>
+class OutputStream : virtual public Stream<NODE>
+{
+protected:
+	using Stream<NODE>::archive;
+	using Stream<NODE>::offset;
+
+public:
+	using Stream<NODE>::seek;
+	using Stream<NODE>::size;
+	using Stream<NODE>::isOpen;
+
+	OutputStream(){}
+
+	OutputStream(const char* filename, bool resume=false)
+	{
+		open(filename, resume);
+	}
+
+	void open(const char* filename, bool resume=false)
+	{
+		archive = ::open(filename, O_WRONLY | (resume ? 0 : O_CREAT | O_TRUNC), 0666);
+		if (archive < 0)
+			perror(format("File creation failure (%s)", filename));
+		offset = 0;
+		if (resume)
+			seek(size());
+	}
+
+	void write(const NODE* p, size_t n)
+	{
+		assert(isOpen(), "File not open");
+		offset += uringTransfer(archive, true, (char*)p, n * sizeof(NODE), offset);
+	}
+
+#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
+	void preallocate(uint64_t size)
+	{
+		assert(isOpen());
+		int res = posix_fallocate(archive, 0, size);
+		if (res != 0)
+			perror("fallocate");
+		seek(0);
+	}
+#endif
+
+	void flush()
+	{
+		fsync(archive);
+	}
+};
+
+template<class NODE>
+class InputStream : virtual public Stream<NODE>
+{
+protected:
+	using Stream<NODE>::archive;
+	using Stream<NODE>::offset;
+
+public:
+	using Stream<NODE>::size;
+	using Stream<NODE>::isOpen;
+
+	InputStream(){}
+
+	InputStream(const char* filename)
+	{
+		open(filename);
+	}
+
+	void open(const char* filename)
+	{
+		archive = ::open(filename, O_RDONLY);
+		if (archive < 0)
+			perror(format("File open failure (%s)", filename));
+		offset = 0;
+		posix_fadvise(archive, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	size_t read(NODE* p, size_t n)
+	{
+		assert(isOpen(), "File not open");
+		size_t bytes = uringTransfer(archive, false, (char*)p, n * sizeof(NODE), offset);
+		assert(bytes % sizeof(NODE) == 0, "Unaligned EOF");
+		offset += bytes;
+		return bytes / sizeof(NODE);
+	}
+};
+
+// For in-place filtering. Written nodes must be <= read nodes.
+template<class NODE>
+class RewriteStream : public InputStream<NODE>, public OutputStream<NODE>
+{
+	using Stream<NODE>::archive;
+	using Stream<NODE>::offset;
+	using Stream<NODE>::seek;
+	using Stream<NODE>::isOpen;
+
+	uint64_t readpos, writepos;
+public:
+	RewriteStream(){}
+
+	RewriteStream(const char* filename)
+	{
+		open(filename);
+	}
+
+	void open(const char* filename)
+	{
+		archive = ::open(filename, O_RDWR);
+		if (archive < 0)
+			perror(format("File open failure (%s)", filename));
+		offset = 0;
+		readpos = writepos = 0;
+	}
+
+	size_t read(NODE* p, size_t n)
+	{
+		assert(readpos >= writepos, "Write position overwritten");
+		seek(readpos);
+		size_t r = InputStream<NODE>::read(p, n);
+		readpos += r;
+		return r;
+	}
+
+	void write(const NODE* p, size_t n)
+	{
+		seek(writepos);
+		OutputStream<NODE>::write(p, n);
+		writepos += n;
+	}
+
+	void truncate()
+	{
+		seek(writepos); // so that closing a preallocated file truncates it at the same place
+		if (ftruncate(archive, writepos * sizeof(NODE)) != 0)
+			perror("ftruncate");
+	}
+};
+
+void deleteFile(const char* filename)
+{
+	int ret = unlink(filename);
+	if (ret < 0)
+		perror("unlink");
+}
+
+void renameFile(const char* from, const char* to, bool replaceExisting=false)
+{
+	int ret = rename(from, to);
+	if (ret < 0)
+		perror("rename");
+}
+
+bool fileExists(const char* filename)
+{
+	struct stat st;
+	return stat(filename, &st) == 0;
+}
+
+uint64_t getFreeSpace()
+{
+	struct statvfs stat;
+	if (statvfs("." , &stat) != 0)
+		perror("statvfs");
+	return stat.f_bavail * stat.f_frsize;
+}
+
+#if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
+void preparePreallocation()
+{
+}
+#endif
@@ -10,6 +10,9 @@
 #include <algorithm>
 #include <list>
 #include <queue>
+#include <vector>
+#include <atomic>
+#include <chrono>
 
 #ifdef _WIN32
 # include <windows.h>
@@ -625,16 +628,38 @@ FRAME_GROUP currentFrameGroup;
 #elif defined(DISK_C)
 # define PLUGIN_DISK "C"
 # include "disk_file_c.cpp"
+#elif defined(DISK_URING)
+# define PLUGIN_DISK "io_uring"
+# include "disk_file_uring.cpp"
+#elif defined(DISK_MMAP)
+# define PLUGIN_DISK "mmap"
+# include "disk_file_mmap.cpp"
 #else
 # error Disk plugin not set
 #endif
 
 // *********************************************** Memory ***********************************************
 
+#if defined(PIPELINED_EXPANSION) && !defined(MULTITHREADING)
+# undef PIPELINED_EXPANSION
+#endif
+
+// With PIPELINED_EXPANSION, the Combining step's buffers follow RAM_SIZE, as the expansion buffer takes all of it meanwhile
+#ifdef PIPELINED_EXPANSION
+# define RAM_EXTRA_SIZE (PIPELINED_EXPANSION)
+#else
+# define RAM_EXTRA_SIZE 0
+#endif
+
 // Allocate RAM at start, use it for different purposes depending on what we're doing
 // Even if we won't use all of it, most OSes shouldn't reserve physical RAM for the entire amount
-void* ram = malloc(RAM_SIZE);
-void* ramEnd = (char*)ram + RAM_SIZE;
+#ifdef USE_UNBUFFERED_DISK_IO
+// Unbuffered transfers can skip copying through an aligned buffer only from and to aligned memory
+void* ram = (void*)(((uintptr_t)malloc(RAM_SIZE + RAM_EXTRA_SIZE + 4095) + 4095) & ~(uintptr_t)4095);
+#else
+void* ram = malloc(RAM_SIZE + RAM_EXTRA_SIZE);
+#endif
+void* ramEnd = (char*)ram + RAM_SIZE + RAM_EXTRA_SIZE;
 
 #ifndef STANDARD_BUFFER_SIZE
 # define STANDARD_BUFFER_SIZE (1024*1024 / sizeof(Node)) // 1 MB
@@ -645,6 +670,15 @@ void* ramEnd = (char*)ram + RAM_SIZE;
 #ifndef EXPECTED_MERGING_RATIO
 # define EXPECTED_MERGING_RATIO 0.6
 #endif
+#ifndef DISK_SEEK_TIME
+# define DISK_SEEK_TIME 0.01 // seconds
+#endif
+#ifndef DISK_TRANSFER_RATE
+# define DISK_TRANSFER_RATE (100*1024*1024) // bytes per second
+#endif
+#ifndef MAX_MERGE_INPUTS
+# define MAX_MERGE_INPUTS 768 // open files in one merge (ulimit -n is often 1024)
+#endif
 
 #ifndef USE_ALL
 # undef  ALL_FILE_BUFFER_SIZE
@@ -722,14 +756,134 @@ INLINE bool operator>=(const OpenNode& a, const OpenNode& b) { return a.getState
 #ifdef GROUP_FRAMES
 INLINE unsigned getFrame(const Node* node) { return node->subframe; }
 INLINE void setFrame(Node* node, uint8_t frame) { node->subframe = frame; }
+#else
+INLINE unsigned getFrame(const Node*) { return 0; }
+INLINE void setFrame(Node*, uint8_t) {}
 #endif
 INLINE PACKED_FRAME getFrame(const OpenNode* node) { return node->frame; }
 INLINE void setFrame(OpenNode* node, PACKED_FRAME frame) { node->frame = frame; }
 
-const size_t BUFFER_SIZE = RAM_SIZE / sizeof(Node);
-const size_t OPENNODE_BUFFER_SIZE = RAM_SIZE / sizeof(OpenNode);
+#ifdef STATE_CACHE_SHARE
+const size_t STATE_CACHE_SIZE = (size_t)(RAM_SIZE * STATE_CACHE_SHARE); // at the end of "ram", kept across frames (see Cache)
+#else
+const size_t STATE_CACHE_SIZE = 0;
+#endif
+
+const size_t BUFFER_SIZE = (RAM_SIZE - STATE_CACHE_SIZE) / sizeof(Node);
+const size_t OPENNODE_BUFFER_SIZE = (RAM_SIZE - STATE_CACHE_SIZE) / sizeof(OpenNode);
 Node* buffer = (Node*) ram;
 
+// ***************************************** Sorted node files ******************************************
+
+#include "NodeIndex.cpp"
+
+#ifdef DELTA_CODED_FILES
+# include "DeltaStream.cpp"
+template<class NODE> using NodeInputStream  = DeltaInputStream<NODE>; // reads plain files too
+template<class NODE> using NodeOutputStream = DeltaOutputStream<NODE>;
+#else
+template<class NODE> using NodeInputStream  = InputStream<NODE>;
+template<class NODE> using NodeOutputStream = OutputStream<NODE>;
+#endif
+
+// ****************************************** Asynchronous I/O ******************************************
+
+#if defined(ASYNC_IO) && !defined(MULTITHREADING)
+# undef ASYNC_IO
+#endif
+
+#ifdef ASYNC_IO
+
+// Buffered streams which are read or written sequentially split their buffer in two halves, and hand the transfer of one half to one
+// of ASYNC_IO threads while the other half is consumed or filled. Each stream has at most one transfer in flight.
+class AsyncTransfer
+{
+	MUTEX mutex;
+	CONDITION condition;
+	bool pending;
+	void (*function)(void*);
+	void* context;
+	uint64_t stallTime; // nanoseconds spent in wait() while the transfer was still running
+
+public:
+	AsyncTransfer() : pending(false), stallTime(0) {}
+
+	void start(void (*function)(void*), void* context);
+
+	void run()
+	{
+		function(context);
+		SCOPED_LOCK lock(mutex);
+		pending = false;
+		CONDITION_NOTIFY(condition, lock);
+	}
+
+	// Returns immediately if no transfer is in flight.
+	void wait()
+	{
+		SCOPED_LOCK lock(mutex);
+		if (!pending)
+			return;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		while (pending)
+			CONDITION_WAIT(condition, lock);
+		stallTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	double stallSeconds() const { return stallTime / 1e9; }
+};
+
+// The I/O threads are started with the first transfer. Like the thread pool's state, the queue is never freed,
+// as the I/O threads are still waiting on it when the program exits.
+struct AsyncIOQueue
+{
+	MUTEX mutex;
+	CONDITION condition;
+	std::queue<AsyncTransfer*> transfers;
+} *asyncIOQueue = NULL;
+
+void asyncIOThread()
+{
+	while (true)
+	{
+		AsyncTransfer* transfer;
+		{
+			SCOPED_LOCK lock(asyncIOQueue->mutex);
+			while (asyncIOQueue->transfers.empty())
+				CONDITION_WAIT(asyncIOQueue->condition, lock);
+			transfer = asyncIOQueue->transfers.front();
+			asyncIOQueue->transfers.pop();
+		}
+		transfer->run();
+	}
+}
+
+AsyncIOQueue* startAsyncIO()
+{
+	asyncIOQueue = new AsyncIOQueue;
+	for (unsigned i=0; i<ASYNC_IO; i++)
+		THREAD_CREATE<asyncIOThread>((THREAD_ID)-1); // not a worker
+	return asyncIOQueue;
+}
+
+void AsyncTransfer::start(void (*function)(void*), void* context)
+{
+	{
+		SCOPED_LOCK lock(mutex);
+		debug_assert(!pending);
+		pending = true;
+		this->function = function;
+		this->context = context;
+	}
+
+	static AsyncIOQueue* queue = startAsyncIO(); // once, even if several streams start their first transfer at the same time
+	SCOPED_LOCK lock(queue->mutex);
+	queue->transfers.push(this);
+	CONDITION_NOTIFY(queue->condition, lock);
+}
+
+#endif // ASYNC_IO
+
 // ****************************************** Buffered streams ******************************************
 
 template<class NODE>
@@ -814,42 +968,124 @@ template<class STREAM, class NODE>
 class WriteBuffer : virtual public BufferedStreamBase<STREAM>
 {
 	uint32_t pos;
+	NODE* data;        // the buffer, or the half of it being filled
+	uint32_t capacity;
+#ifdef NODE_INDEX
+	NodeIndexWriter<NODE> index; // of sorted plain files, see BufferedOutputStream::openSorted
+#endif
+	bool sequential; // with ASYNC_IO, half of the buffer is written behind
+#ifdef ASYNC_IO
+	AsyncTransfer transfer;
+	STREAM* stream; // this->s, without going through the virtual base while this object may be being destroyed
+	const NODE* behind; // the half being written
+	uint32_t behindCount;
+
+	static void writeBehind(void* context)
+	{
+		WriteBuffer* b = (WriteBuffer*)context;
+		b->stream->write(b->behind, b->behindCount);
+	}
+#endif
+
+	void waitForTransfer()
+	{
+#ifdef ASYNC_IO
+		transfer.wait();
+#endif
+	}
+
 protected:
 	Buffer<NODE> buffer;
+
+	// Call whenever the buffer is (re)allocated.
+	void attachBuffer()
+	{
+		data = buffer.buf;
+		capacity = buffer.size;
+#ifdef ASYNC_IO
+		if (sequential && capacity >= 2)
+			capacity /= 2;
+#endif
+	}
+
 public:
-	WriteBuffer(uint32_t size) : buffer(size), pos(0) {}
+	WriteBuffer(uint32_t size, bool sequential=false) : pos(0), data(NULL), capacity(0), sequential(sequential), buffer(size)
+	{
+#ifdef ASYNC_IO
+		stream = &this->s;
+#endif
+	}
 
 	void write(const NODE* p, bool verify=false)
 	{
-		buffer.buf[pos++] = *p;
+		data[pos++] = *p;
 #ifdef DEBUG
 		if (verify && pos > 1)
-			assert(buffer.buf[pos-1] > buffer.buf[pos-2], "Output is not sorted");
+			assert(data[pos-1] > data[pos-2], "Output is not sorted");
 #endif
-		if (pos == buffer.size)
+		if (pos == capacity)
 			flushBuffer();
 	}
 
+	// Writes a sorted run of nodes, which follow the ones written before, a buffer's worth at a time.
+	void writeRun(const NODE* p, size_t n)
+	{
+#ifdef DEBUG
+		if (n && pos > 0)
+			assert(p[0] > data[pos-1], "Output is not sorted");
+#endif
+		while (n)
+		{
+			uint32_t count = capacity - pos < n ? capacity - pos : (uint32_t)n;
+			memcpy(data + pos, p, count * sizeof(NODE));
+			pos += count;
+			p += count;
+			n -= count;
+			if (pos == capacity)
+				flushBuffer();
+		}
+	}
+
 	uint64_t size()
 	{
+		waitForTransfer();
 		return this->s.size() + pos;
 	}
 
 	void clearBuffer()
 	{
+		waitForTransfer();
 		buffer.clear();
 	}
 
 	void deallocateBuffer()
 	{
+		waitForTransfer();
 		buffer.deallocate();
+		attachBuffer();
 	}
 
 	void flushBuffer()
 	{
 		if (pos)
 		{
-			this->s.write(buffer.buf, pos);
+#ifdef NODE_INDEX
+			if (index.isOpen())
+				index.addEvery(data, pos);
+#endif
+#ifdef ASYNC_IO
+			if (capacity < buffer.size)
+			{
+				transfer.wait();
+				behind = data;
+				behindCount = pos;
+				transfer.start(&writeBehind, this);
+				data = data == buffer.buf ? buffer.buf + capacity : buffer.buf;
+				pos = 0;
+				return;
+			}
+#endif
+			this->s.write(data, pos);
 			pos = 0;
 		}
 	}
@@ -857,6 +1093,7 @@ public:
 	void flush()
 	{
 		flushBuffer();
+		waitForTransfer();
 #ifndef NO_DISK_FLUSH
 		this->s.flush();
 #endif
@@ -865,26 +1102,47 @@ public:
 	void close()
 	{
 		flushBuffer();
+		waitForTransfer();
+		closeIndex();
 		BufferedStreamBase<STREAM>::close();
 	}
 
 	~WriteBuffer()
 	{
 		flushBuffer();
+		waitForTransfer();
+		closeIndex();
 	}
 
+#ifdef NODE_INDEX
+	void openIndex(const char* filename) { index.open(filename); }
+	void closeIndex() { index.close(); }
+#else
+	void openIndex(const char*) {}
+	void closeIndex() {}
+#endif
+
 	void setWriteBuffer(NODE* buf, uint32_t size)
 	{
 		flushBuffer();
+		waitForTransfer();
 		buffer.assign(buf, size);
+		attachBuffer();
 	}
 
 	void setWriteBufferSize(uint32_t size)
 	{
 		flushBuffer();
+		waitForTransfer();
 		buffer.reallocate(size);
+		attachBuffer();
 	}
 
+#ifdef ASYNC_IO
+	// Time spent waiting for the previous half to be written.
+	double writeStallSeconds() const { return transfer.stallSeconds(); }
+#endif
+
 	enum { WRITABLE = true };
 };
 
@@ -892,10 +1150,68 @@ template<class STREAM, class NODE>
 class ReadBuffer : virtual public BufferedStreamBase<STREAM>
 {
 	uint32_t pos, end;
+	NODE* data; // the buffer, or the half of it being consumed
+	bool sequential; // with ASYNC_IO, half of the buffer is read ahead
+#ifdef ASYNC_IO
+	bool readingAhead;
+	AsyncTransfer transfer;
+	STREAM* stream; // this->s, without going through the virtual base while this object may be being destroyed
+	NODE* ahead; // the half being filled
+	uint32_t aheadEnd;
+
+	static void readAhead(void* context)
+	{
+		ReadBuffer* b = (ReadBuffer*)context;
+		uint32_t half = b->buffer.size / 2;
+		uint64_t left = b->stream->size() - b->stream->position();
+		b->aheadEnd = (uint32_t)b->stream->read(b->ahead, (size_t)(left < half ? left : half));
+	}
+#endif
+
 protected:
 	Buffer<NODE> buffer;
+
+	// Call before touching the stream from outside of the buffer.
+	void waitForTransfer()
+	{
+#ifdef ASYNC_IO
+		transfer.wait();
+#endif
+	}
+
+	// Call when the stream is closed or reopened, or the buffer is replaced.
+	void stopReadingAhead()
+	{
+#ifdef ASYNC_IO
+		transfer.wait();
+		readingAhead = false;
+#endif
+	}
+
+	// Streams which map the file (DISK_MMAP) hand out nodes from the mapping, so the buffer is not needed;
+	// its size only sets how many nodes are handed out at a time.
+	void allocateBuffer()
+	{
+#ifdef DISK_MMAP
+		if (STREAM::MAPPED)
+			return;
+#endif
+		buffer.allocate();
+	}
+
 public:
-	ReadBuffer(uint32_t size) : buffer(size), pos(0), end(0) {}
+	ReadBuffer(uint32_t size, bool sequential=false) : pos(0), end(0), data(NULL), sequential(sequential), buffer(size)
+	{
+#ifdef ASYNC_IO
+		readingAhead = false;
+		stream = &this->s;
+#endif
+	}
+
+	~ReadBuffer()
+	{
+		waitForTransfer();
+	}
 
 	const NODE* read()
 	{
@@ -907,24 +1223,131 @@ public:
 		}
 #ifdef DEBUG
 		if (pos > 0) 
-			assert(buffer.buf[pos-1] < buffer.buf[pos], "Input is not sorted");
+			assert(data[pos-1] < data[pos], "Input is not sorted");
+#endif
+		return &data[pos++];
+	}
+
+	// Hands out everything left in the buffer (refilling it first if needed) as one contiguous block.
+	// The block is valid until the next read operation.
+	const NODE* readBlock(uint32_t* count)
+	{
+		if (pos == end)
+		{
+			fillBuffer();
+			if (end == 0)
+				return NULL;
+		}
+#ifdef DEBUG
+		for (uint32_t i=pos ? pos : 1; i<end; i++)
+			assert(data[i-1] < data[i], "Input is not sorted");
 #endif
-		return &buffer.buf[pos++];
+		*count = end - pos;
+		const NODE* block = data + pos;
+		pos = end;
+		return block;
+	}
+
+	// The next node, without reading it; NULL if there are none left.
+	const NODE* peek()
+	{
+		if (pos == end)
+		{
+			fillBuffer();
+			if (end == 0)
+				return NULL;
+		}
+		return &data[pos];
+	}
+
+	// Like readBlock, but only hands out the nodes which are less than key; NULL if the next node isn't (or there are
+	// none left). The end of the block is found with a galloping search, so that short blocks take few comparisons.
+	const NODE* readBelow(const NODE* key, uint32_t* count)
+	{
+		if (pos == end)
+		{
+			fillBuffer();
+			if (end == 0)
+				return NULL;
+		}
+		if (!(data[pos] < *key))
+			return NULL;
+		uint32_t lo = pos, hi = end; // data[lo] < key; hi is end, or data[hi] >= key
+		for (uint32_t step = 1; lo + step < end; step *= 2)
+			if (data[lo + step] < *key)
+				lo += step;
+			else
+			{
+				hi = lo + step;
+				break;
+			}
+		while (hi - lo > 1)
+		{
+			uint32_t mid = lo + (hi-lo)/2;
+			if (data[mid] < *key)
+				lo = mid;
+			else
+				hi = mid;
+		}
+#ifdef DEBUG
+		for (uint32_t i=pos ? pos : 1; i<hi; i++)
+			assert(data[i-1] < data[i], "Input is not sorted");
+#endif
+		*count = hi - pos;
+		const NODE* block = data + pos;
+		pos = hi;
+		return block;
 	}
 
 	void fillBuffer()
 	{
 		pos = 0;
+#ifdef DISK_MMAP
+		if (STREAM::MAPPED)
+		{
+			size_t count;
+			data = (NODE*)this->s.view(buffer.size, &count);
+			end = (uint32_t)count;
+			return;
+		}
+#endif
+#ifdef ASYNC_IO
+		if (sequential && buffer.size >= 2)
+		{
+			if (!readingAhead) // the first fill
+			{
+				ahead = buffer.buf;
+				transfer.start(&readAhead, this);
+			}
+			transfer.wait();
+			data = ahead;
+			end = aheadEnd;
+			readingAhead = end != 0;
+			if (readingAhead)
+			{
+				ahead = data == buffer.buf ? buffer.buf + buffer.size / 2 : buffer.buf;
+				transfer.start(&readAhead, this);
+			}
+			return;
+		}
+#endif
+		data = buffer.buf;
 		uint64_t left = this->s.size() - this->s.position();
-		end = (uint32_t)this->s.read(buffer.buf, (size_t)(left < buffer.size ? left : buffer.size));
+		end = (uint32_t)this->s.read(data, (size_t)(left < buffer.size ? left : buffer.size));
 	}
 
 	void setReadBuffer(NODE* buf, uint32_t size)
 	{
 		assert(pos == end, "Buffer is dirty");
+		stopReadingAhead();
 		buffer.assign(buf, size);
 	}
 
+#ifdef ASYNC_IO
+	// Time spent waiting for the next half to be read.
+	double readStallSeconds() const { return transfer.stallSeconds(); }
+#endif
+
 	// Useable only before allocation
 	void setReadBufferSize(uint32_t size)
 	{
@@ -942,7 +1365,7 @@ public:
 	{
 		if (pos == 0)
 			return NULL;
-		return buffer.buf + (pos-1);
+		return data + (pos-1);
 	}
 
 	bool next()
@@ -955,7 +1378,7 @@ public:
 		}
 #ifdef DEBUG
 		if (pos > 0) 
-			assert(buffer.buf[pos-1] < buffer.buf[pos], "Input is not sorted");
+			assert(data[pos-1] < data[pos], "Input is not sorted");
 #endif
 		pos++;
 		return true;
@@ -973,19 +1396,20 @@ public:
 		else
 			debug_assert(getHead()==NULL || *getHead() < *target);
 
-		const NODE* node;
-		do
+		if (OUTPUT::WRITABLE)
 		{
+			const NODE* head = getHead();
+			if (head)
+				output->write(head);
+		}
+		const NODE* run;
+		uint32_t count;
+		while ((run = readBelow(target, &count)))
 			if (OUTPUT::WRITABLE)
-			{
-				const NODE* head = getHead();
-				if (head)
-					output->write(head);
-			}
-			node = read();
-			if (node == NULL)
-				return -1;
-		} while (*node < *target);
+				output->writeRun(run, count);
+		const NODE* node = read();
+		if (node == NULL)
+			return -1;
 		return (*node > *target);
 	}
 
@@ -1001,42 +1425,62 @@ public:
 		else
 			debug_assert(getHead()==NULL || *getHead() < *target);
 
-		const NODE* node;
-		do
+		if (OUTPUT1::WRITABLE || OUTPUT2::WRITABLE)
 		{
-			if (OUTPUT1::WRITABLE || OUTPUT2::WRITABLE)
+			const NODE* head = getHead();
+			if (head)
 			{
-				const NODE* head = getHead();
-				if (head)
-				{
-					if (OUTPUT1::WRITABLE) output1->write(head);
-					if (OUTPUT2::WRITABLE) output2->write(head);
-				}
+				if (OUTPUT1::WRITABLE) output1->write(head);
+				if (OUTPUT2::WRITABLE) output2->write(head);
 			}
-			node = read();
-			if (node == NULL)
-				return -1;
-		} while (*node < *target);
+		}
+		const NODE* run;
+		uint32_t count;
+		while ((run = readBelow(target, &count)))
+		{
+			if (OUTPUT1::WRITABLE) output1->writeRun(run, count);
+			if (OUTPUT2::WRITABLE) output2->writeRun(run, count);
+		}
+		const NODE* node = read();
+		if (node == NULL)
+			return -1;
 		return (*node > *target);
 	}
 };
 
 template<class NODE>
-class BufferedInputStream : public ReadBuffer<InputStream<NODE>, NODE>
+class BufferedInputStream : public ReadBuffer<NodeInputStream<NODE>, NODE>
 {
 public:
-	BufferedInputStream(uint32_t size = STANDARD_BUFFER_SIZE) : ReadBuffer<InputStream<NODE>, NODE>(size) {}
-	BufferedInputStream(const char* filename, uint32_t size = STANDARD_BUFFER_SIZE) : ReadBuffer<InputStream<NODE>, NODE>(size) { open(filename); }
-	void open(const char* filename) { this->s.open(filename); this->buffer.allocate(); }
+	BufferedInputStream(uint32_t size = STANDARD_BUFFER_SIZE) : ReadBuffer<NodeInputStream<NODE>, NODE>(size, true) {}
+	BufferedInputStream(const char* filename, uint32_t size = STANDARD_BUFFER_SIZE) : ReadBuffer<NodeInputStream<NODE>, NODE>(size, true) { open(filename); }
+	void open(const char* filename) { this->stopReadingAhead(); this->s.open(filename); this->allocateBuffer(); }
+	uint64_t size() { this->waitForTransfer(); return this->s.size(); }
+	void close() { this->stopReadingAhead(); this->s.close(); }
 };
 
 template<class NODE>
-class BufferedOutputStream : public WriteBuffer<OutputStream<NODE>, NODE>
+class BufferedOutputStream : public WriteBuffer<NodeOutputStream<NODE>, NODE>
 {
 public:
-	BufferedOutputStream(uint32_t size = STANDARD_BUFFER_SIZE) : WriteBuffer<OutputStream<NODE>, NODE>(size) {}
-	BufferedOutputStream(const char* filename, bool resume=false, uint32_t size = STANDARD_BUFFER_SIZE) : WriteBuffer<OutputStream<NODE>, NODE>(size) { open(filename, resume); }
-	void open(const char* filename, bool resume=false) { this->s.open(filename, resume); this->buffer.allocate(); }
+	BufferedOutputStream(uint32_t size = STANDARD_BUFFER_SIZE) : WriteBuffer<NodeOutputStream<NODE>, NODE>(size, true) {}
+	BufferedOutputStream(const char* filename, bool resume=false, uint32_t size = STANDARD_BUFFER_SIZE) : WriteBuffer<NodeOutputStream<NODE>, NODE>(size, true) { open(filename, resume); }
+	void open(const char* filename, bool resume=false) { this->s.open(filename, resume); this->buffer.allocate(); this->attachBuffer(); }
+	// For sorted files which are written in one go. With NODE_INDEX, they get a key index (see NodeIndex.cpp);
+	// with DELTA_CODED_FILES, they can be delta-coded (closed and combined nodes), which then indexes the blocks.
+	void openSorted(const char* filename, bool deltaCoded=false)
+	{
+#ifdef DELTA_CODED_FILES
+		this->s.open(filename, false, deltaCoded);
+#else
+		this->s.open(filename, false);
+		deltaCoded = false;
+#endif
+		if (!deltaCoded)
+			this->openIndex(filename);
+		this->buffer.allocate();
+		this->attachBuffer();
+	}
 #if defined(PREALLOCATE_EXPANDED) || defined(PREALLOCATE_COMBINING)
 	void preallocate(uint64_t size) { this->s.preallocate(size); }
 #endif
@@ -1048,7 +1492,7 @@ class BufferedRewriteStream : public ReadBuffer<RewriteStream<NODE>, NODE>, publ
 public:
 	BufferedRewriteStream(uint32_t readSize = STANDARD_BUFFER_SIZE, uint32_t writeSize = STANDARD_BUFFER_SIZE) : ReadBuffer<RewriteStream<NODE>, NODE>(readSize), WriteBuffer<RewriteStream<NODE>, NODE>(writeSize) {}
 	BufferedRewriteStream(const char* filename, uint32_t readSize = STANDARD_BUFFER_SIZE, uint32_t writeSize = STANDARD_BUFFER_SIZE) : ReadBuffer<RewriteStream<NODE>, NODE>(readSize), WriteBuffer<RewriteStream<NODE>, NODE>(writeSize) { open(filename); }
-	void open(const char* filename) { this->s.open(filename); ReadBuffer<RewriteStream<NODE>, NODE>::buffer.allocate(); WriteBuffer<RewriteStream<NODE>, NODE>::buffer.allocate(); }
+	void open(const char* filename) { this->s.open(filename); ReadBuffer<RewriteStream<NODE>, NODE>::buffer.allocate(); WriteBuffer<RewriteStream<NODE>, NODE>::buffer.allocate(); WriteBuffer<RewriteStream<NODE>, NODE>::attachBuffer(); }
 	void truncate() { this->s.truncate(); }
 };
 
@@ -1105,17 +1549,20 @@ public:
 	}
 };
 
-#if 0
+// A window [start, end) of a node file, which looks like a whole file to its users.
 template<class NODE>
-class SplitInputStream : public InputStream<NODE>
+class SplitInputStream : public NodeInputStream<NODE>
 {
 private:
 	uint64_t start, end;
 	uint64_t pos;
 public:
-	SplitInputStream() : InputStream(), start(0), end(0), pos(0) {}
+	SplitInputStream() : start(0), end(0), pos(0) {}
 
-	SplitInputStream(InputStream<NODE>& _stream, uint64_t _start, uint64_t _end) : InputStream(filename), start(_start), end(_end), pos(_start) {}
+	SplitInputStream(const char* filename, uint64_t _start, uint64_t _end)
+	{
+		open(filename, _start, _end);
+	}
 
 	void open(const char* filename, uint64_t _start, uint64_t _end)
 	{
@@ -1123,10 +1570,10 @@ public:
 		end = _end;
 		pos = _start;
 
-		InputStream::open(filename);
-		assert(end <= InputStream::size());
+		NodeInputStream<NODE>::open(filename);
+		assert(start <= end && end <= NodeInputStream<NODE>::size());
 		if (start != 0)
-			InputStream::seek(start);
+			NodeInputStream<NODE>::seek(start);
 	}
 
 	uint64_t size()
@@ -1144,52 +1591,74 @@ public:
 		pos = start + _pos;
 		if (pos > end)
 			pos = end;
-		InputStream::seek(pos);
+		NodeInputStream<NODE>::seek(pos);
 	}
 
 	size_t read(NODE* p, size_t n)
 	{
 		if (n > end - pos)
-			n = end - pos;
-		n = InputStream::read(p, n);
+			n = (size_t)(end - pos);
+		n = NodeInputStream<NODE>::read(p, n);
 		pos += n;
 		return n;
 	}
+
+#ifdef DISK_MMAP
+	const NODE* view(size_t n, size_t* count)
+	{
+		if (n > end - pos)
+			n = (size_t)(end - pos);
+		const NODE* p = NodeInputStream<NODE>::view(n, count);
+		pos += *count;
+		return p;
+	}
+#endif
 };
 
 template<class NODE>
 class BufferedSplitInputStream : public ReadBuffer<SplitInputStream<NODE>, NODE>
 {
 public:
-	BufferedSplitInputStream(uint32_t size = STANDARD_BUFFER_SIZE) : ReadBuffer(size) {}
-	BufferedSplitInputStream(InputStream<NODE>& stream, uint64_t start, uint64_t end, uint32_t size = STANDARD_BUFFER_SIZE) : ReadBuffer(size) { open(stream, start, end); }
-	void open(const char* filename, uint64_t start, uint64_t end) { s.open(filename, start, end); buffer.allocate(); }
+	BufferedSplitInputStream(uint32_t size = STANDARD_BUFFER_SIZE) : ReadBuffer<SplitInputStream<NODE>, NODE>(size, true) {}
+	BufferedSplitInputStream(const char* filename, uint64_t start, uint64_t end, uint32_t size = STANDARD_BUFFER_SIZE) : ReadBuffer<SplitInputStream<NODE>, NODE>(size, true) { open(filename, start, end); }
+	void open(const char* filename, uint64_t start, uint64_t end) { this->stopReadingAhead(); this->s.open(filename, start, end); this->allocateBuffer(); }
+	void close() { this->stopReadingAhead(); this->s.close(); }
 };
 
-template<class NODE, unsigned PIECES>
+// Splits a node file into PIECES consecutive ranges of about as many nodes each, read by one STREAM each (e.g. one per worker).
+// STREAM is opened with the file name, its range of nodes and any further arguments to open().
+template<class NODE, unsigned PIECES, class STREAM = BufferedSplitInputStream<NODE>>
 class BufferedSplitInputStreamSet
 {
 private:
-	BufferedSplitInputStream<NODE> bufferedStream[PIECES];
+	STREAM bufferedStream[PIECES];
 public:
 	void setReadBuffer(NODE* buf, uint32_t size)
 	{
 		uint32_t pos = 0;
-		uint32_t numerator;
+		uint64_t numerator;
 		unsigned i;
 		for (i=0, numerator=size; i<PIECES; i++, numerator+=size)
 		{
-			uint32_t endPos = numerator / PIECES;
+			uint32_t endPos = (uint32_t)(numerator / PIECES);
 			bufferedStream[i].setReadBuffer(buf + pos, endPos - pos);
 			pos = endPos;
 		}
 	}
 
-	void open(const char* filename)
+	// The pieces share size; useable only before the first open.
+	void setReadBufferSize(uint32_t size)
+	{
+		for (unsigned i=0; i<PIECES; i++)
+			bufferedStream[i].setReadBufferSize(size / PIECES ? size / PIECES : 1);
+	}
+
+	template<class... ARGS>
+	void open(const char* filename, ARGS... args)
 	{
 		uint64_t fileSize;
 		{
-			InputStream<NODE> getSize(filename);
+			NodeInputStream<NODE> getSize(filename); // in nodes, also for delta-coded files
 			fileSize = getSize.size();
 		}
 		uint64_t pos = 0;
@@ -1198,7 +1667,7 @@ public:
 		for (i=0, numerator=fileSize; i<PIECES; i++, numerator+=fileSize)
 		{
 			uint64_t endPos = numerator / PIECES;
-			bufferedStream[i].open(filename, pos, endPos);
+			bufferedStream[i].open(filename, pos, endPos, args...);
 			pos = endPos;
 		}
 	}
@@ -1209,12 +1678,22 @@ public:
 			bufferedStream[i].close();
 	}
 
-	BufferedSplitInputStream<NODE>& stream(unsigned n)
+	STREAM& stream(unsigned n)
 	{
 		return bufferedStream[n];
 	}
-};
+
+#ifdef ASYNC_IO
+	// Summed over the pieces, which are usually read at the same time.
+	double readStallSeconds()
+	{
+		double total = 0;
+		for (unsigned i=0; i<PIECES; i++)
+			total += bufferedStream[i].readStallSeconds();
+		return total;
+	}
 #endif
+};
 
 template<class NODE>
 void copyFile(const char* from, const char* to)
@@ -1366,63 +1845,260 @@ public:
 	}
 };
 
-template<class NODE, unsigned CHUNK_SIZE, class OUTPUT>
-void mergeChunks(NODE* input, unsigned inputSize, OUTPUT* output)
+// A tournament tree of losers over the heads (current nodes) of several sorted inputs. When the winner's head changes,
+// it is played against the stored loser of each match on the way up, so that's one comparison per level - a binary heap
+// needs two (first between the children, then against the parent). The losers are stored with their heads, so a match
+// doesn't need to look up the leaf.
+// Exhausted leaves hold a sentinel, a node with all bits set, so that matches against them need no extra checks. A real
+// node can be equal to it, so the sentinel is compared by address when it is the winner (see replayExhausted).
+template<class NODE>
+class LoserTree
 {
-	InputHeapChunked<NODE, CHUNK_SIZE> heap(input, inputSize);
+protected:
+	struct Entry
+	{
+		const NODE* head;
+		unsigned leaf;
+	};
 
-	const NODE* first = heap.read();
-	if (!first)
-		return;
-	NODE cs = *(NODE*)first;
-	const NODE* cs2;
+	Entry* tree; // tree[0] is the winner, tree[1..leaves-1] the loser of each match
+	unsigned leaves; // rounded up to a power of two, with the extra leaves exhausted
+	unsigned live; // leaves which are not exhausted
+	const NODE* sentinel;
 
-	while ((cs2 = heap.read()))
+	INLINE bool less(const NODE* a, const NODE* b) const
 	{
-		debug_assert(*cs2 >= cs);
-		if (cs == *cs2) // CompressedState::operator== does not compare subframe
-		{
-			if (getFrame(&cs) > getFrame(cs2)) // in case of duplicate frames, pick the one from the smallest frame
-				setFrame(&cs,   getFrame(cs2));
-		}
-		else
+		return a != sentinel && (b == sentinel || *a < *b);
+	}
+
+	LoserTree(unsigned count)
+	{
+		if (count==0)
+			error("No inputs");
+		for (leaves=1; leaves<count; leaves*=2) {}
+		tree = new Entry[leaves];
+		live = 0;
+
+		static struct Sentinel
 		{
-			output->write(&cs, true);
-			cs = *cs2;
-		}
+			uint64_t padding; // the comparison operators can read a few bytes before the state
+			NODE node;
+			Sentinel() { memset(this, 0xFF, sizeof(*this)); }
+		} maxNode;
+		sentinel = &maxNode.node;
 	}
-	output->write(&cs, true);
-}
 
-template<class NODE, unsigned CHUNK_SIZE, class OUTPUT>
-void mergeChunks(NODE* inputBase, HeapNode* inputHeap, unsigned count, OUTPUT* output)
-{
-	InputHeapChunked<NODE, CHUNK_SIZE> heap(inputBase, inputHeap, count);
+	~LoserTree()
+	{
+		delete[] tree;
+	}
 
-	const NODE* first = heap.read();
-	if (!first)
-		return;
-	NODE cs = *(NODE*)first;
-	const NODE* cs2;
+	// Plays all matches from scratch. heads has an entry for every leaf, with the sentinel for exhausted ones.
+	void build(const NODE** heads)
+	{
+		tree[0] = build(heads, 1);
+		if (live == 0)
+			tree[0].head = NULL; // the sentinel won, but there is no head
+	}
 
-	while ((cs2 = heap.read()))
+	Entry build(const NODE** heads, unsigned n)
 	{
-		debug_assert(*cs2 >= cs);
-		if (cs == *cs2) // CompressedState::operator== does not compare subframe
+		if (n >= leaves)
 		{
-			if (getFrame(&cs) > getFrame(cs2)) // in case of duplicate frames, pick the one from the smallest frame
-				setFrame(&cs,   getFrame(cs2));
+			Entry leaf = { heads[n - leaves], n - leaves };
+			return leaf;
 		}
-		else
+		Entry a = build(heads, n*2);
+		Entry b = build(heads, n*2+1);
+		if (less(b.head, a.head))
 		{
-			output->write(&cs, true);
-			cs = *cs2;
+			tree[n] = a;
+			return b;
 		}
+		tree[n] = b;
+		return a;
 	}
-	output->write(&cs, true);
-}
 
-// ***************************************** Stream operations ******************************************
+	// Replays the matches of the winning leaf, whose head has changed to the given (real) node.
+	INLINE void replay(const NODE* head)
+	{
+		Entry winner = { head, tree[0].leaf };
+		for (unsigned n=(winner.leaf+leaves)/2; n; n/=2)
+			if (*tree[n].head < *winner.head)
+			{
+				Entry t = tree[n];
+				tree[n] = winner;
+				winner = t;
+			}
+		tree[0] = winner;
+		test();
+	}
+
+	// Same as above, after the winning leaf has been exhausted. Returns false if all leaves are.
+	bool replayExhausted()
+	{
+		if (--live == 0)
+		{
+			tree[0].head = NULL;
+			return false;
+		}
+		Entry winner = { sentinel, tree[0].leaf };
+		for (unsigned n=(winner.leaf+leaves)/2; n; n/=2)
+			if (less(tree[n].head, winner.head))
+			{
+				Entry t = tree[n];
+				tree[n] = winner;
+				winner = t;
+			}
+		tree[0] = winner;
+		test();
+		return true;
+	}
+
+	// Like InputHeap, the first next() call reads the first node again.
+	void startBeforeFirst()
+	{
+		if (live)
+			tree[0].head = NULL;
+	}
+
+	void test() const
+	{
+#ifdef DEBUG
+		assert(tree[0].head != sentinel);
+		for (unsigned n=1; n<leaves; n++)
+			assert(!less(tree[n].head, tree[0].head));
+#endif
+	}
+
+public:
+	const NODE* getHead() const { return tree[0].head; }
+
+	unsigned getHeadLeaf() const { return tree[0].leaf; }
+
+	// The second smallest head, which has lost a match directly against the winner. NULL if there is none.
+	const NODE* runnerUp() const
+	{
+		const NODE* best = sentinel;
+		for (unsigned n=(tree[0].leaf+leaves)/2; n; n/=2)
+			if (less(tree[n].head, best))
+				best = tree[n].head;
+		return best == sentinel ? NULL : best;
+	}
+};
+
+template<class NODE, unsigned CHUNK_SIZE>
+class InputLoserTreeChunked : public LoserTree<NODE>
+{
+	NODE* input;
+	HeapNode* ranges;
+
+	void init(unsigned count)
+	{
+		const NODE** heads = new const NODE*[this->leaves];
+		for (unsigned i=0; i<this->leaves; i++)
+		{
+			heads[i] = this->sentinel;
+			if (i < count && ranges[i].pos < ranges[i].end)
+			{
+				heads[i] = input + ranges[i].pos;
+				this->live++;
+			}
+		}
+		this->build(heads);
+		delete[] heads;
+		if (this->live)
+			ranges[this->getHeadLeaf()].pos--;
+		this->startBeforeFirst();
+	}
+
+public:
+	InputLoserTreeChunked(NODE* input, unsigned inputSize) : LoserTree<NODE>((inputSize + CHUNK_SIZE-1) / CHUNK_SIZE)
+	{
+		this->input = input;
+		unsigned count = (inputSize + CHUNK_SIZE-1) / CHUNK_SIZE;
+		ranges = new HeapNode[count];
+		for (unsigned i=0; i<count; i++)
+		{
+			ranges[i].pos = i * CHUNK_SIZE;
+			ranges[i].end = i == count-1 ? inputSize : (i+1) * CHUNK_SIZE;
+		}
+		init(count);
+	}
+
+	// Takes ownership of inputRanges, which must have been allocated with new[].
+	InputLoserTreeChunked(NODE* inputBase, HeapNode* inputRanges, unsigned count) : LoserTree<NODE>(count)
+	{
+		input = inputBase;
+		ranges = inputRanges;
+		init(count);
+	}
+
+	~InputLoserTreeChunked()
+	{
+		delete[] ranges;
+	}
+
+	bool next()
+	{
+		if (this->live == 0)
+			return false;
+		HeapNode& range = ranges[this->getHeadLeaf()];
+		if (++range.pos == range.end)
+			return this->replayExhausted();
+		this->replay(input + range.pos);
+		return true;
+	}
+
+	INLINE const NODE* read()
+	{
+		next();
+		return this->getHead();
+	}
+};
+
+// Writes the nodes read from a merger (a LoserTree or heap) to output, keeping only the copy with the smallest frame of each state.
+template<class NODE, class MERGER, class OUTPUT>
+void mergeDeduplicated(MERGER* merger, OUTPUT* output)
+{
+	const NODE* first = merger->read();
+	if (!first)
+		return;
+	NODE cs = *(NODE*)first;
+	const NODE* cs2;
+
+	while ((cs2 = merger->read()))
+	{
+		debug_assert(*cs2 >= cs);
+		if (cs == *cs2) // CompressedState::operator== does not compare subframe
+		{
+			if (getFrame(&cs) > getFrame(cs2)) // in case of duplicate frames, pick the one from the smallest frame
+				setFrame(&cs,   getFrame(cs2));
+		}
+		else
+		{
+			output->write(&cs, true);
+			cs = *cs2;
+		}
+	}
+	output->write(&cs, true);
+}
+
+template<class NODE, unsigned CHUNK_SIZE, class OUTPUT>
+void mergeChunks(NODE* input, unsigned inputSize, OUTPUT* output)
+{
+	InputLoserTreeChunked<NODE, CHUNK_SIZE> tree(input, inputSize);
+	mergeDeduplicated<NODE>(&tree, output);
+}
+
+template<class NODE, unsigned CHUNK_SIZE, class OUTPUT>
+void mergeChunks(NODE* inputBase, HeapNode* inputHeap, unsigned count, OUTPUT* output)
+{
+	InputLoserTreeChunked<NODE, CHUNK_SIZE> tree(inputBase, inputHeap, count);
+	mergeDeduplicated<NODE>(&tree, output);
+}
+
+// ***************************************** Stream operations ******************************************
 
 template<class INPUT, class NODE>
 class InputHeap
@@ -1533,13 +2209,14 @@ public:
 				if (readUntil > *minChild)
 					readUntil = *minChild;
 				
-				do
-				{
-					if (OUTPUT::WRITABLE && head->state) // can we get rid of this check?
-						output->write(head->state);
-					head->state = head->input->read();
-				}
-				while (head->state && *head->state < readUntil);
+				if (OUTPUT::WRITABLE && head->state) // can we get rid of this check?
+					output->write(head->state);
+				const NODE* run;
+				uint32_t count;
+				while ((run = head->input->readBelow(&readUntil, &count)))
+					if (OUTPUT::WRITABLE)
+						output->writeRun(run, count);
+				head->state = head->input->read();
 
 				if (head->state == NULL)
 				{
@@ -1565,17 +2242,19 @@ public:
 		else
 		{
 		size1:
-			do
+			if (OUTPUT::WRITABLE && head->state) // can we get rid of this check?
+				output->write(head->state);
+			const NODE* run;
+			uint32_t count;
+			while ((run = head->input->readBelow(target, &count)))
+				if (OUTPUT::WRITABLE)
+					output->writeRun(run, count);
+			head->state = head->input->read();
+			if (head->state == NULL)
 			{
-				if (OUTPUT::WRITABLE && head->state) // can we get rid of this check?
-					output->write(head->state);
-				head->state = head->input->read();
-				if (head->state == NULL)
-				{
-					size = 0;
-					return -1;
-				}
-			} while (*head->state < *target);
+				size = 0;
+				return -1;
+			}
 			test();
 			return (*head->state > *target);
 		}
@@ -1632,34 +2311,227 @@ void copyStream(INPUT* input, OUTPUT* output)
 		output->write(node, false);
 }
 
-template<class NODE, class INPUT, class OUTPUT>
-void mergeStreams(INPUT inputs[], int inputCount, OUTPUT* output)
+// Same interface as InputHeap.
+template<class INPUT, class NODE>
+class InputLoserTree : public LoserTree<NODE>
 {
-	InputHeap<INPUT, NODE> heap(inputs, inputCount);
+	INPUT** inputs;
 
-	const NODE* first = heap.read();
-	if (!first)
+public:
+	InputLoserTree(INPUT inputs[], int count) : LoserTree<NODE>(count)
+	{
+		this->inputs = new INPUT*[this->leaves];
+		const NODE** heads = new const NODE*[this->leaves];
+		for (unsigned i=0; i<this->leaves; i++)
+		{
+			this->inputs[i] = NULL;
+			heads[i] = this->sentinel;
+			if (i < (unsigned)count && inputs[i].isOpen())
+			{
+				this->inputs[i] = &inputs[i];
+				const NODE* head = inputs[i].read();
+				if (head)
+				{
+					heads[i] = head;
+					this->live++;
+				}
+			}
+		}
+		this->build(heads);
+		delete[] heads;
+		if (this->live)
+			getHeadInput()->rewind(); // prepare for first next() call
+		this->startBeforeFirst();
+	}
+
+	~InputLoserTree()
+	{
+		delete[] inputs;
+	}
+
+	INPUT* getHeadInput() const { return inputs[this->getHeadLeaf()]; }
+
+	bool next()
+	{
+		if (this->live == 0)
+			return false;
+		const NODE* head = getHeadInput()->read();
+		if (head == NULL)
+			return this->replayExhausted();
+		this->replay(head);
+		return true;
+	}
+
+	INLINE const NODE* read()
+	{
+		next();
+		return this->getHead();
+	}
+
+	/// output receives "old" states (that is, *getHead() on function entry but not on exit)
+	template<bool checkFirst, class OUTPUT>
+	int scanTo(const NODE* target, OUTPUT* output)
+	{
+		if (this->live == 0)
+			return -1;
+
+		if (checkFirst)
+		{
+			const NODE* headState = this->getHead();
+			if (headState && *headState >= *target)
+				return (*headState > *target);
+		}
+		else
+			debug_assert(this->getHead()==NULL || *this->getHead() < *target);
+
+		while (true)
+		{
+			// copy from the winning input until it reaches the target or the runner-up, without replaying
+			NODE readUntil = *target;
+			const NODE* runnerUp = this->runnerUp();
+			if (runnerUp && readUntil > *runnerUp)
+				readUntil = *runnerUp;
+
+			INPUT* input = getHeadInput();
+			const NODE* head = this->getHead();
+			if (OUTPUT::WRITABLE && head)
+				output->write(head);
+			const NODE* run;
+			uint32_t count;
+			while ((run = input->readBelow(&readUntil, &count)))
+				if (OUTPUT::WRITABLE)
+					output->writeRun(run, count);
+			head = input->read();
+
+			if (head == NULL)
+			{
+				if (!this->replayExhausted())
+					return -1;
+			}
+			else
+				this->replay(head);
+			head = this->getHead();
+			if (*head >= *target)
+				return (*head > *target);
+		}
+	}
+};
+
+#define MERGE_MIN_GALLOP 7 // like TimSort's MIN_GALLOP
+
+// Like mergeDeduplicated, but once MERGE_MIN_GALLOP nodes in a row came from the same input, the nodes of that input which
+// are less than the other inputs' heads are handed to output->writeRun as whole blocks of its read buffer (see
+// ReadBuffer::readBelow), instead of going through the tree one by one. Galloping stops when it copies fewer nodes than that.
+template<class NODE, class INPUT, class OUTPUT>
+void mergeDeduplicatedGalloping(InputLoserTree<INPUT, NODE>* tree, OUTPUT* output)
+{
+	const NODE* head = tree->read();
+	if (!head)
 		return;
-	NODE cs = *(NODE*)first;
-	const NODE* cs2;
-	
-	while ((cs2 = heap.read()))
+	NODE cs = *head;
+	unsigned leaf = tree->getHeadLeaf(), wins = 1; // distinct nodes in a row from leaf, the last one being cs
+
+	while (true)
 	{
-		debug_assert(*cs2 >= cs);
-		if (cs == *cs2) // CompressedState::operator== does not compare subframe
+		if (wins >= MERGE_MIN_GALLOP)
 		{
-			if (getFrame(&cs) > getFrame(cs2)) // in case of duplicate frames, pick the one from the smallest frame
-				setFrame(&cs,   getFrame(cs2));
+			wins = 0;
+			const NODE* runnerUp = tree->runnerUp();
+			if (runnerUp == NULL || cs < *runnerUp) // otherwise, another input has cs too
+			{
+				output->write(&cs, true);
+				INPUT* input = tree->getHeadInput();
+				const NODE* run;
+				uint32_t count;
+				uint64_t copied = 0;
+				while ((run = runnerUp ? input->readBelow(runnerUp, &count) : input->readBlock(&count)))
+				{
+					output->writeRun(run, count);
+					copied += count;
+				}
+				head = tree->read(); // the next node of input, as the tree's head is still cs
+				if (!head)
+					return;
+				cs = *head;
+				if (tree->getHeadLeaf() == leaf && copied >= MERGE_MIN_GALLOP)
+					wins = MERGE_MIN_GALLOP;
+				else
+				{
+					leaf = tree->getHeadLeaf();
+					wins = 1;
+				}
+				continue;
+			}
+		}
+
+		head = tree->read();
+		if (!head)
+			break;
+		if (cs == *head) // CompressedState::operator== does not compare subframe
+		{
+			if (getFrame(&cs) > getFrame(head)) // in case of duplicate frames, pick the one from the smallest frame
+				setFrame(&cs,   getFrame(head));
+			continue;
 		}
+		output->write(&cs, true);
+		cs = *head;
+		if (tree->getHeadLeaf() == leaf)
+			wins++;
 		else
 		{
-			output->write(&cs, true);
-			cs = *cs2;
+			leaf = tree->getHeadLeaf();
+			wins = 1;
 		}
 	}
 	output->write(&cs, true);
 }
 
+template<class NODE, class INPUT, class OUTPUT>
+void mergeStreams(INPUT inputs[], int inputCount, OUTPUT* output)
+{
+	InputLoserTree<INPUT, NODE> tree(inputs, inputCount);
+	mergeDeduplicatedGalloping<NODE>(&tree, output);
+}
+
+// Like mergeStreams, for when inputs[0] is much bigger than the other inputs (the combined file in the Combining step).
+// The nodes of inputs[0] between two nodes of the others are handed to output->writeRun as whole blocks of the read buffer
+// (see ReadBuffer::readBelow), so that they are only copied, instead of going through the merge one by one.
+template<class NODE, class INPUT, class OUTPUT>
+void mergeIntoStream(INPUT inputs[], int inputCount, OUTPUT* output)
+{
+	INPUT* input = &inputs[0];
+	if (inputCount < 2 || !input->isOpen()) // see InputLoserTree
+	{
+		mergeStreams<NODE>(inputs, inputCount, output);
+		return;
+	}
+	InputLoserTree<INPUT, NODE> tree(inputs + 1, inputCount - 1);
+
+	const NODE* run;
+	uint32_t count;
+	const NODE* next = tree.read(); // NULL if the other inputs are all empty; inputs[0] is then copied through as it is
+	while (next)
+	{
+		NODE cs = *next;
+		while ((next = tree.read()) && cs == *next) // CompressedState::operator== does not compare subframe
+			if (getFrame(&cs) > getFrame(next)) // in case of duplicate frames, pick the one from the smallest frame
+				setFrame(&cs,   getFrame(next));
+
+		while ((run = input->readBelow(&cs, &count)))
+			output->writeRun(run, count);
+		const NODE* head = input->peek();
+		if (head && *head == cs)
+		{
+			if (getFrame(&cs) > getFrame(head))
+				setFrame(&cs,   getFrame(head));
+			input->read();
+		}
+		output->write(&cs, true);
+	}
+	while ((run = input->readBlock(&count)))
+		output->writeRun(run, count);
+}
+
 #if 0
 void mergeStreams(BufferedInputStream<Node> inputs[], int inputCount, BufferedOutputStream<BareNode>* output)
 {
@@ -1689,6 +2561,7 @@ class NullOutput
 public:
 	enum { WRITABLE = false };
 	void write(const CompressedState* cs, bool verify=false) {}
+	template<class NODE> void writeRun(const NODE* p, size_t n) {}
 };
 
 NullOutput nullOutput;
@@ -1703,6 +2576,12 @@ public:
 		B::write(cs, verify);
 	}
 
+	INLINE void writeRun(const NODE* p, size_t n)
+	{
+		A::writeRun(p, n);
+		B::writeRun(p, n);
+	}
+
 	INLINE A* a() { return this; }
 	INLINE B* b() { return this; }
 };
@@ -1716,7 +2595,7 @@ void filterStreams(CLOSED* closed, BufferedRewriteStream<NODE> open[], int openC
 		return;
 	}
 	
-	InputHeap<BufferedRewriteStream<NODE>, NODE> openHeap(open, openCount);
+	InputLoserTree<BufferedRewriteStream<NODE>, NODE> openHeap(open, openCount);
 	openHeap.next();
 
 	bool done = false;
@@ -1764,10 +2643,8 @@ size_t deduplicate(COMPRESSED_STATE* start, size_t records)
 		debug_assert(*read >= *(read-1));
 		if (*read == *(write-1)) // CompressedState::operator== does not compare subframe
 		{
-#ifdef GROUP_FRAMES
-			if (getFrame(write-1) > getFrame(read))
+			if (getFrame(write-1) > getFrame(read)) // in case of duplicate frames, pick the one from the smallest frame
 				setFrame(write-1,   getFrame(read));
-#endif
 		}
 		else
 		{
@@ -1796,919 +2673,869 @@ const char* formatFileName(const char* name, FRAME_GROUP g, unsigned chunk)
 	return formatProblemFileName(name, format(GROUP_FORMAT "-%u", g, chunk), "bin");
 }
 
-// ****************************************** Processing queue ******************************************
+// ******************************************** Thread pool *********************************************
 
 #ifdef MULTITHREADING
 
 # define WORKERS (THREADS-1)
-# define PROCESS_QUEUE_SIZE 0x100000
-Node processQueue[PROCESS_QUEUE_SIZE]; // circular buffer
-size_t processQueueHead=0, processQueueTail=0;
-MUTEX processQueueMutex; // for head/tail
-CONDITION processQueueReadCondition, processQueueWriteCondition, processQueueExitCondition;
-volatile int runningWorkers = 0;
-volatile bool stopWorkers = false;
-CONDITION specialWorkersExitCondition;
-volatile int runningSpecialWorkers = 0;
-volatile bool stopSpecialWorkers = false;
-
-# ifdef USE_TRANSFORM_INVARIANT_SORTING
-
+# ifndef THREAD_POOL_SIZE
+#  if defined(TIERED_CLOSED_SET) && defined(BACKGROUND_MERGE)
+#   define THREAD_POOL_SIZE (WORKERS*2+2) // every worker can have one expansion chunk write in flight, while chunks are merged in the background and closed runs are compacted
+#  elif defined(BACKGROUND_MERGE)
+#   define THREAD_POOL_SIZE (WORKERS*2+1) // every worker can have one expansion chunk write in flight, while chunks are merged in the background
+#  elif defined(TIERED_CLOSED_SET)
+#   define THREAD_POOL_SIZE (WORKERS*2+1) // every worker can have one expansion chunk write in flight, while closed runs are compacted
+#  else
+#   define THREAD_POOL_SIZE (WORKERS*2) // every worker can have one expansion chunk write in flight
+#  endif
 # endif
-
-# ifdef ENABLE_EXPANSION_SPILLOVER
-void expansionReadSpilloverThread();
+# if THREAD_POOL_SIZE < WORKERS+1
+#  error THREAD_POOL_SIZE must leave room for at least one task besides the workers
 # endif
-void expansionSortFinalRegions();
 
-void queueState(const Node* state)
+// Completion handle for a task submitted to the thread pool.
+class TaskFuture
 {
-	SCOPED_LOCK lock(processQueueMutex);
-
-	while (processQueueHead == processQueueTail+PROCESS_QUEUE_SIZE) // while full
-		CONDITION_WAIT(processQueueReadCondition, lock);
-	processQueue[processQueueHead++ % PROCESS_QUEUE_SIZE] = *state;
-	CONDITION_NOTIFY(processQueueWriteCondition, lock);
-}
+	MUTEX mutex;
+	CONDITION condition;
+	bool pending;
 
-bool dequeueState(Node* state)
-{
-	SCOPED_LOCK lock(processQueueMutex);
+public:
+	TaskFuture() : pending(false) {}
 
-	while (processQueueHead == processQueueTail) // while empty
+	void start()
 	{
-		if (stopWorkers)
-			return false;
-		CONDITION_WAIT(processQueueWriteCondition, lock);
+		SCOPED_LOCK lock(mutex);
+		debug_assert(!pending);
+		pending = true;
 	}
-	*state = processQueue[processQueueTail++ % PROCESS_QUEUE_SIZE];
-	CONDITION_NOTIFY(processQueueReadCondition, lock);
-	return true;
-}
-
-void doNothing() {}
 
-template<void (*STATE_HANDLER)(const Node*), void (*FINALIZATION_HANDLER)()>
-void worker()
-{
-	Node cs[QUEUE_CHUNK_SIZE];
-	for (;;)
+	void complete()
 	{
-		int n=0;
-		while (n<QUEUE_CHUNK_SIZE && dequeueState(&cs[n]))
-			n++;
-		if (n == 0)
-			break;
-		for (int i=0; i<n; i++)
-			STATE_HANDLER(&cs[i]);
+		SCOPED_LOCK lock(mutex);
+		pending = false;
+		CONDITION_NOTIFY(condition, lock);
 	}
 
-	FINALIZATION_HANDLER();
-
-    /* LOCK */
+	// Returns immediately if the task has already finished, or was never submitted.
+	void wait()
 	{
-		SCOPED_LOCK lock(processQueueMutex);
-		runningWorkers--;
-		CONDITION_NOTIFY(processQueueExitCondition, lock);
+		SCOPED_LOCK lock(mutex);
+		while (pending)
+			CONDITION_WAIT(condition, lock);
 	}
-}
+};
 
-template<void (*STATE_HANDLER)(const Node*), void (*FINALIZATION_HANDLER)()>
-void startWorkers()
+struct ThreadPoolTask
 {
-# ifdef ENABLE_EXPANSION_SPILLOVER
-	{
-		SCOPED_LOCK lock(processQueueMutex);
-		runningSpecialWorkers++;
-	}
-	THREAD_CREATE<expansionReadSpilloverThread>(0);
-# endif
+	void (*function)();
+	THREAD_ID threadID; // set in TLS while the task runs, as tasks index per-worker state with TLS_GET_THREAD_ID
+	TaskFuture* future;
+};
+
+// THREAD_POOL_SIZE threads are started once, and run all Expansion, chunk writing and exit tracing tasks.
+// The state is never freed, as the pool's threads are still waiting on it when the program exits.
+struct ThreadPool
+{
+	MUTEX mutex;
+	CONDITION condition;
+	std::queue<ThreadPoolTask> tasks;
+} *threadPool = NULL;
 
+void threadPoolThread()
+{
+	while (true)
 	{
-		SCOPED_LOCK lock(processQueueMutex);
-		runningWorkers += WORKERS;
+		ThreadPoolTask task;
+		{
+			SCOPED_LOCK lock(threadPool->mutex);
+			while (threadPool->tasks.empty())
+				CONDITION_WAIT(threadPool->condition, lock);
+			task = threadPool->tasks.front();
+			threadPool->tasks.pop();
+		}
+		TLS_SET_THREAD_ID(task.threadID);
+		task.function();
+		task.future->complete();
 	}
-	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
-		THREAD_CREATE<worker<STATE_HANDLER,FINALIZATION_HANDLER>>(threadID);
 }
 
-void flushProcessingQueue()
+void startThreadPool()
 {
-	SCOPED_LOCK lock(processQueueMutex);
-
-# ifdef ENABLE_EXPANSION_SPILLOVER
-	// finish expansionReadSpilloverThread
-	stopSpecialWorkers = true;
-	while (runningSpecialWorkers)
-		CONDITION_WAIT(specialWorkersExitCondition, lock);
-	stopSpecialWorkers = false;
-# endif
-
-	stopWorkers = true;
-	CONDITION_NOTIFY(processQueueWriteCondition, lock);
-	while (runningWorkers)
-		CONDITION_WAIT(processQueueExitCondition, lock);
-	stopWorkers = false;
+	threadPool = new ThreadPool;
+	for (THREAD_ID i=0; i<THREAD_POOL_SIZE; i++)
+		THREAD_CREATE<threadPoolThread>(i);
+}
 
-	// wait for expansionWriteChunkThread to finish
-	//stopSpecialWorkers = true;
-	while (runningSpecialWorkers)
-		CONDITION_WAIT(specialWorkersExitCondition, lock);
-	//stopSpecialWorkers = false;
+template<void (*TASK_FUNCTION)()>
+void submitTask(THREAD_ID threadID, TaskFuture* future)
+{
+	future->start();
+	ThreadPoolTask task;
+	task.function = TASK_FUNCTION;
+	task.threadID = threadID;
+	task.future = future;
+
+	SCOPED_LOCK lock(threadPool->mutex);
+	threadPool->tasks.push(task);
+	CONDITION_NOTIFY(threadPool->condition, lock);
 }
 
 #endif // MULTITHREADING
 
-// ************************************** Disk queue (open nodes) ***************************************
-
-#define MAX_FRAME_GROUPS (MAX_FRAMES/FRAMES_PER_GROUP)
-
-uint64_t closedNodesInCurrentFrameGroup;
-uint64_t combinedNodesTotal;
+// ****************************************** Processing queue ******************************************
 
-BufferedOutputStream<Node> closedNodeFile;
+#ifdef MULTITHREADING
 
+# define PROCESS_QUEUE_SIZE 0x100000
+# define PROCESS_QUEUE_BATCHES ((PROCESS_QUEUE_SIZE + QUEUE_CHUNK_SIZE-1) / QUEUE_CHUNK_SIZE)
 
-#ifdef ENABLE_EXPANSION_SPILLOVER
-bool expansionSpilloverLocked; // true if expansion spillover is currently being read or written to
+// Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's algorithm).
+// Every cell carries a sequence number which tells producers and consumers whether it is theirs to claim.
+template<class T, size_t SIZE>
+class LockFreeQueue
+{
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
 
-OutputStream<OpenNode> expansionSpilloverOut;
-bool expansionSpilloverOutOpen;
-unsigned expansionSpilloverChunkOut;
-size_t   expansionSpilloverChunkOutPos;
+	Cell cells[SIZE];
+	alignas(64) std::atomic<size_t> enqueuePos;
+	alignas(64) std::atomic<size_t> dequeuePos;
 
-InputStream<OpenNode> expansionSpilloverIn;
-bool expansionSpilloverInOpen;
-unsigned expansionSpilloverChunkIn;
-size_t   expansionSpilloverChunkInPos;
+public:
+	LockFreeQueue()
+	{
+		clear();
+	}
 
-size_t expansionSpilloverNodesQueued;
-#endif
+	// Not thread-safe; only call when no other threads are accessing the queue.
+	void clear()
+	{
+		for (size_t i=0; i<SIZE; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		enqueuePos.store(0, std::memory_order_relaxed);
+		dequeuePos.store(0, std::memory_order_relaxed);
+	}
 
+	bool push(const T& data)
+	{
+		Cell* cell;
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &cells[pos % SIZE];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0)
+			{
+				if (enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+					break;
+			}
+			else
+			if (dif < 0)
+				return false; // full
+			else
+				pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+		cell->data = data;
+		cell->sequence.store(pos+1, std::memory_order_release);
+		return true;
+	}
 
-#include "TimSort.cpp"
+	bool pop(T& data)
+	{
+		Cell* cell;
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &cells[pos % SIZE];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+			if (dif == 0)
+			{
+				if (dequeuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+					break;
+			}
+			else
+			if (dif < 0)
+				return false; // empty
+			else
+				pos = dequeuePos.load(std::memory_order_relaxed);
+		}
+		data = cell->data;
+		cell->sequence.store(pos+SIZE, std::memory_order_release);
+		return true;
+	}
 
-#define EXPANSION_BUFFER_SLOTS (OPENNODE_BUFFER_SIZE / EXPANSION_NODES_PER_QUEUE_ELEMENT)
-#define EXPANSION_BUFFER_SIZE (EXPANSION_BUFFER_SLOTS * EXPANSION_NODES_PER_QUEUE_ELEMENT)
+	// Approximate; only exact when there are no concurrent operations.
+	bool empty() const
+	{
+		return dequeuePos.load(std::memory_order_acquire) >= enqueuePos.load(std::memory_order_acquire);
+	}
+};
 
-const unsigned EXPANSION_BUFFER_FILL_THRESHOLD ((unsigned)(EXPANSION_BUFFER_SLOTS * EXPANSION_BUFFER_FILL_RATIO)  <=   EXPANSION_BUFFER_SLOTS - (WORKERS-1) ?
-                                                (unsigned)(EXPANSION_BUFFER_SLOTS * EXPANSION_BUFFER_FILL_RATIO)  >=   1                                    ?
-                                                (unsigned)(EXPANSION_BUFFER_SLOTS * EXPANSION_BUFFER_FILL_RATIO)     : 1
-                                                                                                                     : EXPANSION_BUFFER_SLOTS - (WORKERS-1));
-#ifdef ENABLE_EXPANSION_SPILLOVER
-const unsigned EXPANSION_SPILLOVER_WRITE_THRESHOLD  = EXPANSION_BUFFER_SLOTS - EXPANSION_BUFFER_FILL_THRESHOLD;
-const unsigned EXPANSION_SPILLOVER_READ_THRESHOLD   = EXPANSION_BUFFER_SLOTS - EXPANSION_BUFFER_FILL_THRESHOLD + 1;
+// The processing queue hands out nodes in batches of QUEUE_CHUNK_SIZE. The producer (a single thread) fills a
+// batch privately and publishes it with one lock-free push; workers pop whole batches and return them to the
+// free list once processed. The mutex and conditions are only touched when a worker runs out of work or the
+// producer runs out of free batches.
+// Batches hold copies of the nodes: the producers (exit tracing, and the Combining step with PIPELINED_EXPANSION) pick
+// nodes one by one or convert them, so there is no contiguous buffer to hand out. The Expanding step doesn't use the
+// queue; each worker reads its own slice of the closed file (see expandSlices).
+struct ProcessQueueBatch
+{
+	unsigned count;
+	Node nodes[QUEUE_CHUNK_SIZE];
+};
 
-const unsigned EXPANSION_SPILLOVER_SLACK = (0x200000 + EXPANSION_NODES_PER_QUEUE_ELEMENT-1) / EXPANSION_NODES_PER_QUEUE_ELEMENT;
-#endif
+ProcessQueueBatch processQueue[PROCESS_QUEUE_BATCHES];
+LockFreeQueue<unsigned, PROCESS_QUEUE_BATCHES> processQueueFull, processQueueFree;
+ProcessQueueBatch* processQueueProducerBatch = NULL; // batch currently being filled by queueState()
+unsigned processQueueProducerBatchIndex;
+std::atomic<int> processQueueIdleWorkers(0); // workers waiting for processQueueWriteCondition
+std::atomic<bool> processQueueProducerWaiting(false); // producer waiting for processQueueReadCondition
+MUTEX processQueueMutex; // for the slow (blocking) paths and stopWorkers
+CONDITION processQueueReadCondition, processQueueWriteCondition;
+volatile bool stopWorkers = false;
+TaskFuture workerFutures[WORKERS];
 
-OpenNode* const EXPANSION_BUFFER     = (OpenNode*)ram;
-OpenNode* const EXPANSION_BUFFER_END = (OpenNode*)ram + EXPANSION_BUFFER_SIZE;
+void expansionSortFinalRegions();
 
-MUTEX expansionMutex;
-unsigned expansionChunks;
-enum EXPANSION_BUFFER_REGION_TYPE
-{
-	EXPANSION_BUFFER_REGION_EMPTY,
-	EXPANSION_BUFFER_REGION_FILLING,  // threadID==0
-//	EXPANSION_BUFFER_REGION_FILLING+1 is threadID==1
-//	EXPANSION_BUFFER_REGION_FILLING+2 is threadID==2, etc...
-	EXPANSION_BUFFER_REGION_FILLED = EXPANSION_BUFFER_REGION_FILLING + WORKERS,
-	EXPANSION_BUFFER_REGION_READING,
-	EXPANSION_BUFFER_REGION_SORTING,
-	EXPANSION_BUFFER_REGION_WRITING,
-	EXPANSION_BUFFER_REGION_MERGING,
-};
-struct ExpansionBufferRegion
+void initProcessQueue()
 {
-	unsigned pos, length;
-	EXPANSION_BUFFER_REGION_TYPE type;
-};
-std::list<ExpansionBufferRegion> expansionBufferRegions;
-std::list<ExpansionBufferRegion>::iterator expansionThreadIter[WORKERS];
-struct ExpansionBufferSortedRegion
+	processQueueFull.clear();
+	processQueueFree.clear();
+	for (unsigned i=0; i<PROCESS_QUEUE_BATCHES; i++)
+		processQueueFree.push(i);
+	processQueueProducerBatch = NULL;
+}
+
+// Publish the producer's current batch, if it has any nodes.
+void queueFlushBatch()
 {
-	unsigned start, end;
-};
-unsigned expansionBufferQueueNodesToMerge;
-std::queue<ExpansionBufferSortedRegion> expansionBufferRegionsToMerge;
-//unsigned numSortsInProgress;
-volatile unsigned expansionChunkWriteInProgress[WORKERS];
-BufferedOutputStream<OpenNode> expansionWriteChunkThreadStream[WORKERS];
-#ifdef DEBUG_EXPANSION
-FILE *expansionDebug;
-#endif
+	if (!processQueueProducerBatch)
+		return;
+	if (processQueueProducerBatch->count == 0)
+		return;
+	processQueueFull.push(processQueueProducerBatchIndex); // can't fail - there are only as many batches as queue cells
+	processQueueProducerBatch = NULL;
+
+	std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in dequeueBatch
+	if (processQueueIdleWorkers.load(std::memory_order_relaxed))
+	{
+		SCOPED_LOCK lock(processQueueMutex);
+		CONDITION_NOTIFY(processQueueWriteCondition, lock);
+	}
+}
 
-struct
+INLINE void queueStartBatch()
 {
-	OpenNode* buffer;
-	int i;
-#ifdef ENABLE_EXPANSION_SPILLOVER
-	OpenNode* finalSortBufferEnd;
-#endif
-} expansionThread[WORKERS];
+	unsigned index;
+	if (!processQueueFree.pop(index))
+	{
+		SCOPED_LOCK lock(processQueueMutex);
+		processQueueProducerWaiting.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in releaseBatch
+		while (!processQueueFree.pop(index))
+			CONDITION_WAIT(processQueueReadCondition, lock);
+		processQueueProducerWaiting.store(false);
+	}
+	processQueueProducerBatchIndex = index;
+	processQueueProducerBatch = &processQueue[index];
+	processQueueProducerBatch->count = 0;
+}
 
-#ifdef DEBUG_EXPANSION
-void dumpExpansionDebug()
+// Must only be called from the producer thread.
+INLINE void queueState(const Node* state)
 {
-	timeb time1;
-	ftime(&time1);
-	fprintf(expansionDebug, "%9d.%03d: ", (int)time1.time, time1.millitm);
+	if (!processQueueProducerBatch)
+		queueStartBatch();
+	processQueueProducerBatch->nodes[processQueueProducerBatch->count++] = *state;
+	if (processQueueProducerBatch->count == QUEUE_CHUNK_SIZE)
+		queueFlushBatch();
+}
 
-	fputc('1'+(char)TLS_GET_THREAD_ID, expansionDebug);
-	fputc(':', expansionDebug);
-	fputc(' ', expansionDebug);
+// Returns false when the queue is empty and the workers are being stopped.
+bool dequeueBatch(unsigned* index)
+{
+	if (processQueueFull.pop(*index))
+		return true;
 
-	for (std::list<ExpansionBufferRegion>::iterator i=expansionBufferRegions.begin(); i!=expansionBufferRegions.end(); i++)
+	SCOPED_LOCK lock(processQueueMutex);
+	processQueueIdleWorkers++;
+	std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in queueFlushBatch
+	while (!processQueueFull.pop(*index))
 	{
-		debug_assert(!(i->type == EXPANSION_BUFFER_REGION_EMPTY && i->length==0));
-
-		for (unsigned x=0; x<i->length; x++)
+		if (stopWorkers)
 		{
-			switch (i->type)
-			{
-			case EXPANSION_BUFFER_REGION_EMPTY:   fputc('.', expansionDebug); break;
-			case EXPANSION_BUFFER_REGION_FILLED:  fputc('#', expansionDebug); break;
-			default: fputc('1'+i->type-EXPANSION_BUFFER_REGION_FILLING, expansionDebug); break;
-			case EXPANSION_BUFFER_REGION_READING: fputc(x==0?'R':'r', expansionDebug); break;
-			case EXPANSION_BUFFER_REGION_SORTING: fputc(x==0?'S':'s', expansionDebug); break;
-			case EXPANSION_BUFFER_REGION_WRITING: fputc(x==0?'W':'w', expansionDebug); break;
-			case EXPANSION_BUFFER_REGION_MERGING: fputc(x==0?'M':'m', expansionDebug); break;
-			}
+			processQueueIdleWorkers--;
+			return false;
 		}
+		CONDITION_WAIT(processQueueWriteCondition, lock);
 	}
-	fputc('\n', expansionDebug);
-	fflush(expansionDebug);
+	processQueueIdleWorkers--;
+	return true;
 }
-#endif
 
-void initExpansion()
+void releaseBatch(unsigned index)
 {
-#ifdef ENABLE_EXPANSION_SPILLOVER
-	expansionSpilloverLocked = false;
-	expansionSpilloverOutOpen = false;
-	expansionSpilloverChunkOut = 0;
-	expansionSpilloverChunkOutPos = 0;
-	expansionSpilloverInOpen = false;
-	expansionSpilloverChunkIn = 0;
-	expansionSpilloverChunkInPos = 0;
-	expansionSpilloverNodesQueued = 0;
-#endif
+	processQueueFree.push(index);
 
-	//numSortsInProgress = 0;
-
-	expansionBufferRegions.clear();
-	expansionBufferQueueNodesToMerge = 0;
-	expansionBufferRegionsToMerge = std::queue<ExpansionBufferSortedRegion>();
-	OpenNode* slot = EXPANSION_BUFFER;
-	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+	std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in queueStartBatch
+	if (processQueueProducerWaiting.load(std::memory_order_relaxed))
 	{
-		expansionChunkWriteInProgress[threadID] = false;
-		expansionWriteChunkThreadStream[threadID].setWriteBufferSize(64*1024*1024 / sizeof(OpenNode) / WORKERS);
+		SCOPED_LOCK lock(processQueueMutex);
+		CONDITION_NOTIFY(processQueueReadCondition, lock);
+	}
+}
 
-		expansionThread[threadID].buffer = slot;
-		slot += EXPANSION_NODES_PER_QUEUE_ELEMENT;
-		expansionThread[threadID].i = 0;
+void doNothing() {}
 
-		ExpansionBufferRegion region;
-		region.pos = (unsigned)threadID;
-		region.length = 1;
-		region.type = (EXPANSION_BUFFER_REGION_TYPE)(EXPANSION_BUFFER_REGION_FILLING + threadID);
-		expansionBufferRegions.push_back(region);
-		expansionThreadIter[threadID] = expansionBufferRegions.end();
-		expansionThreadIter[threadID]--;
-	}
+template<void (*STATE_HANDLER)(const Node*), void (*FINALIZATION_HANDLER)()>
+void worker()
+{
+	unsigned index;
+	while (dequeueBatch(&index))
 	{
-		ExpansionBufferRegion region;
-		region.pos = WORKERS;
-		region.length = EXPANSION_BUFFER_SLOTS - WORKERS;
-		region.type = EXPANSION_BUFFER_REGION_EMPTY;
-		expansionBufferRegions.push_back(region);
+		const ProcessQueueBatch* batch = &processQueue[index];
+		for (unsigned i=0; i<batch->count; i++)
+			STATE_HANDLER(&batch->nodes[i]);
+		releaseBatch(index);
 	}
 
-	expansionChunks = 0;
-
-#ifdef DEBUG_EXPANSION
-	expansionDebug = fopen("debug.log", "at");
-	fprintf(expansionDebug, "Frame group %u\n", currentFrameGroup);
-	dumpExpansionDebug();
-#endif
+	FINALIZATION_HANDLER();
 }
 
-void expansionRegionMarkFilled(std::list<ExpansionBufferRegion>::iterator& regionToFill)
+template<void (*STATE_HANDLER)(const Node*), void (*FINALIZATION_HANDLER)()>
+void startWorkers()
 {
-	std::list<ExpansionBufferRegion>::iterator before = regionToFill;
-	std::list<ExpansionBufferRegion>::iterator after  = regionToFill; ++after;
-	if (before != expansionBufferRegions.begin() && (--before)->type == EXPANSION_BUFFER_REGION_FILLED)
-	{
-		if (after != expansionBufferRegions.end() && after->type == EXPANSION_BUFFER_REGION_FILLED)
-		{
-			before->length += regionToFill->length + after->length;
-			expansionBufferRegions.erase(regionToFill, ++after);
-		}
-		else
-		{
-			before->length += regionToFill->length;
-			expansionBufferRegions.erase(regionToFill);
-		}
-	}
-	else
-	if (after != expansionBufferRegions.end() && after->type == EXPANSION_BUFFER_REGION_FILLED)
-	{
-		after->pos    -= regionToFill->length;
-		after->length += regionToFill->length;
-		expansionBufferRegions.erase(regionToFill);
-	}
-	else
-		regionToFill->type = EXPANSION_BUFFER_REGION_FILLED;
-
-	regionToFill = expansionBufferRegions.end();
+	initProcessQueue();
 
-#ifdef DEBUG_EXPANSION
-	dumpExpansionDebug();
-#endif
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+		submitTask<worker<STATE_HANDLER,FINALIZATION_HANDLER>>(threadID, &workerFutures[threadID]);
 }
 
-void expansionRegionMarkEmpty(std::list<ExpansionBufferRegion>::iterator& regionToEmpty)
+void flushProcessingQueue()
 {
-	std::list<ExpansionBufferRegion>::iterator before = regionToEmpty;
-	std::list<ExpansionBufferRegion>::iterator after  = regionToEmpty; ++after;
-	if (before != expansionBufferRegions.begin() && (--before)->type == EXPANSION_BUFFER_REGION_EMPTY)
+	queueFlushBatch();
+
 	{
-		if (after != expansionBufferRegions.end() && after->type == EXPANSION_BUFFER_REGION_EMPTY)
-		{
-			before->length += regionToEmpty->length + after->length;
-			expansionBufferRegions.erase(regionToEmpty, ++after);
-		}
-		else
-		{
-			before->length += regionToEmpty->length;
-			expansionBufferRegions.erase(regionToEmpty);
-		}
+		SCOPED_LOCK lock(processQueueMutex);
+		stopWorkers = true;
+		CONDITION_NOTIFY(processQueueWriteCondition, lock);
 	}
-	else
-	if (after != expansionBufferRegions.end() && after->type == EXPANSION_BUFFER_REGION_EMPTY)
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+		workerFutures[threadID].wait();
 	{
-		after->pos    -= regionToEmpty->length;
-		after->length += regionToEmpty->length;
-		expansionBufferRegions.erase(regionToEmpty);
+		SCOPED_LOCK lock(processQueueMutex);
+		stopWorkers = false;
 	}
-	else
-		regionToEmpty->type = EXPANSION_BUFFER_REGION_EMPTY;
 }
 
-//OutputStream<OpenNode> expansionWriteChunkThreadStream;
-OpenNode* expansionWriteChunkThreadBuffer[WORKERS];
-unsigned expansionWriteChunkThreadCount[WORKERS];
-std::list<ExpansionBufferRegion>::iterator expansionWriteChunkThreadRegion[WORKERS];
-void expansionWriteChunkThread()
-{
-	//expansionWriteChunkThreadStream.write(expansionWriteChunkThreadBuffer, expansionWriteChunkThreadCount);
-	//expansionWriteChunkThreadStream.close();
-	THREAD_ID threadID = TLS_GET_THREAD_ID;
-	mergeChunks<OpenNode, EXPANSION_NODES_PER_QUEUE_ELEMENT>(expansionWriteChunkThreadBuffer[threadID], expansionWriteChunkThreadCount[threadID], &expansionWriteChunkThreadStream[threadID]);
-	expansionWriteChunkThreadStream[threadID].close();
+#endif // MULTITHREADING
 
-	{
-		SCOPED_LOCK lock(expansionMutex);
+// ************************************** Disk queue (open nodes) ***************************************
 
-		expansionChunkWriteInProgress[threadID] = false;
+#define MAX_FRAME_GROUPS (MAX_FRAMES/FRAMES_PER_GROUP)
 
-		expansionRegionMarkEmpty(expansionWriteChunkThreadRegion[threadID]);
-#ifdef DEBUG_EXPANSION
-		dumpExpansionDebug();
-#endif
-	}
+uint64_t closedNodesInCurrentFrameGroup;
+uint64_t combinedNodesTotal;
 
-	{
-		SCOPED_LOCK lock(processQueueMutex);
-		runningSpecialWorkers--;
-		CONDITION_NOTIFY(specialWorkersExitCondition, lock);
-	}
-}
+BufferedOutputStream<Node> closedNodeFile;
 
-void sortExpansionRegion(std::list<ExpansionBufferRegion>::iterator& regionToSort, SCOPED_LOCK& lock)
-{
-	if (regionToSort->length > EXPANSION_BUFFER_FILL_THRESHOLD)
-	{
-		ExpansionBufferRegion region;
-		region.pos = regionToSort->pos + EXPANSION_BUFFER_FILL_THRESHOLD;
-		region.length = regionToSort->length - EXPANSION_BUFFER_FILL_THRESHOLD;
-		region.type = EXPANSION_BUFFER_REGION_FILLED;
-		std::list<ExpansionBufferRegion>::iterator insert = regionToSort;
-		expansionBufferRegions.insert(++insert, region);
-		regionToSort->length = EXPANSION_BUFFER_FILL_THRESHOLD;
-	}
 
-	regionToSort->type = EXPANSION_BUFFER_REGION_SORTING;
-	OpenNode *bufferToSort = EXPANSION_BUFFER + regionToSort->pos * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-	unsigned count = regionToSort->length * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-	
-#ifdef DEBUG_EXPANSION
-	dumpExpansionDebug();
+
+#include "TimSort.cpp"
+#ifdef USE_RADIX_SORT
+# include "RadixSort.cpp"
+template<class NODE> using NodeSort = RadixSort<NODE>;
+#else
+template<class NODE> using NodeSort = TimSort<NODE>;
 #endif
 
-	regionToSort->type = EXPANSION_BUFFER_REGION_WRITING;
-	std::list<ExpansionBufferRegion>::iterator nextRegion = regionToSort; ++nextRegion;
-	/*if (nextRegion != expansionBufferRegions.end() && nextRegion->type == EXPANSION_BUFFER_REGION_EMPTY)
-	{
-		nextRegion->pos    -= oldLength - newLength;
-		nextRegion->length += oldLength - newLength;
-	}
-	else
-	if (oldLength > regionToSort->length)
-	{
-		ExpansionBufferRegion region;
-		region.pos = regionToSort->pos + regionToSort->length;
-		region.length = oldLength - regionToSort->length;
-		region.type = EXPANSION_BUFFER_REGION_EMPTY;
-		expansionBufferRegions.insert(nextRegion, region);
-	}*/
+#define EXPANSION_BUFFER_SLOTS (OPENNODE_BUFFER_SIZE / EXPANSION_NODES_PER_QUEUE_ELEMENT)
+#define EXPANSION_BUFFER_SIZE (EXPANSION_BUFFER_SLOTS * EXPANSION_NODES_PER_QUEUE_ELEMENT)
 
-#ifdef DEBUG_EXPANSION
-	dumpExpansionDebug();
-#endif
+const unsigned EXPANSION_BUFFER_FILL_THRESHOLD ((unsigned)(EXPANSION_BUFFER_SLOTS * EXPANSION_BUFFER_FILL_RATIO)  <=   EXPANSION_BUFFER_SLOTS - (WORKERS-1) ?
+                                                (unsigned)(EXPANSION_BUFFER_SLOTS * EXPANSION_BUFFER_FILL_RATIO)  >=   1                                    ?
+                                                (unsigned)(EXPANSION_BUFFER_SLOTS * EXPANSION_BUFFER_FILL_RATIO)     : 1
+                                                                                                                     : EXPANSION_BUFFER_SLOTS - (WORKERS-1));
 
-	THREAD_ID threadID = TLS_GET_THREAD_ID;
-	while (expansionChunkWriteInProgress[threadID])
-	{
-		lock.unlock();
-		SLEEP(1);
-		lock.lock();
-	}
+OpenNode* const EXPANSION_BUFFER     = (OpenNode*)ram;
+OpenNode* const EXPANSION_BUFFER_END = (OpenNode*)ram + EXPANSION_BUFFER_SIZE;
 
-	unsigned chunk = expansionChunks++;
+// The expansion buffer is split into EXPANSION_BUFFER_SLOTS slots of EXPANSION_NODES_PER_QUEUE_ELEMENT nodes each.
+// A slot is always in one of these states:
+//  - empty:   its bit is set in expansionSlotsEmpty;
+//  - filling: owned by one worker (expansionThread[threadID].slot);
+//  - filled:  sorted and waiting to be written; its bit is set in expansionSlotsFilled;
+//  - writing: claimed by a chunk writer, returned to expansionSlotsEmpty once the chunk is on disk.
+// Slots are claimed and released with atomic bit operations, so filling the buffer doesn't need a lock.
+// Filled slots don't need to be adjacent - they are merged through a list of runs (see mergeChunks).
 
-	expansionWriteChunkThreadStream[threadID].open(formatFileName("expanded", currentFrameGroup, chunk), false);
-#ifdef PREALLOCATE_EXPANDED
-	expansionWriteChunkThreadStream[threadID].preallocate(
-#ifdef USE_UNBUFFERED_DISK_IO
-		(PREALLOCATE_EXPANDED + 0x1FF) & -0x200
+INLINE unsigned lowestSetBit(uint64_t v)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, v);
+	return (unsigned)index;
 #else
-		PREALLOCATE_EXPANDED
-#endif
-		);
+	return (unsigned)__builtin_ctzll(v);
 #endif
-	expansionWriteChunkThreadBuffer[threadID] = bufferToSort;
-	expansionWriteChunkThreadCount [threadID] = count;
-	expansionWriteChunkThreadRegion[threadID] = regionToSort;
-
-	expansionChunkWriteInProgress[threadID] = true;
-
-	{
-		SCOPED_LOCK lock(processQueueMutex);
-		runningSpecialWorkers++;
-	}
-	THREAD_CREATE<expansionWriteChunkThread>(threadID);
 }
 
-#ifdef ENABLE_EXPANSION_SPILLOVER
-
-void sortExpansionSpilloverThread()
+template<size_t BITS>
+class AtomicBitmap
 {
-	threadID = TLS_GET_THREAD_ID;
+	enum { WORDS = (BITS + 63) / 64 };
+	std::atomic<uint64_t> words[WORDS];
 
-	ExpansionBufferSortedRegion region;
-	region.start = expansionThread[threadID].buffer;
-	region.end = expansionThread[threadID].finalSortBufferEnd;
+public:
+	static const size_t NONE = (size_t)-1;
 
-	std::sort(region.start, region.end);
+	void clear()
+	{
+		for (size_t w=0; w<WORDS; w++)
+			words[w].store(0, std::memory_order_relaxed);
+	}
 
+	void set(size_t bit)
 	{
-		SCOPED_LOCK lock(expansionMutex);
-		expansionBufferRegionsToMerge.push(region);
+		words[bit/64].fetch_or((uint64_t)1 << (bit%64), std::memory_order_release);
 	}
 
+	bool test(size_t bit) const
 	{
-		SCOPED_LOCK lock(processQueueMutex);
-		runningSpecialWorkers--;
-		CONDITION_NOTIFY(specialWorkersExitCondition, lock);
+		return (words[bit/64].load(std::memory_order_relaxed) >> (bit%64)) & 1;
 	}
-}
 
-void expansionWriteSpillover(OpenNode *bufferToWrite, size_t count)
-{
-	while (true)
+	// Atomically clear one set bit and return its index, or NONE if no bits are set.
+	// The search starts at the word containing "hint", so that threads starting at different hints rarely contend.
+	size_t claim(size_t hint)
 	{
-		if (!expansionSpilloverOutOpen)
+		size_t first = (hint / 64) % WORDS;
+		for (size_t n=0; n<WORDS; n++)
 		{
-			expansionSpilloverOut.open(formatFileName("expansionSpillover", currentFrameGroup, expansionSpilloverChunkOut));
-			expansionSpilloverChunkOutPos = 0;
-			expansionSpilloverOutOpen = true;
+			size_t w = first + n;
+			if (w >= WORDS)
+				w -= WORDS;
+			uint64_t v = words[w].load(std::memory_order_relaxed);
+			while (v)
+			{
+				uint64_t mask = (uint64_t)1 << lowestSetBit(v);
+				uint64_t old = words[w].fetch_and(~mask, std::memory_order_acquire);
+				if (old & mask)
+					return w*64 + lowestSetBit(mask);
+				v = old & ~mask;
+			}
 		}
+		return NONE;
+	}
+};
 
-		fpos_t spilloverToNextChunk = expansionSpilloverChunkOutPos + count - SPILLOVER_CHUNK_SIZE * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-		if (spilloverToNextChunk > 0)
-			count -= spilloverToNextChunk;
-
-		expansionSpilloverOut.write(bufferToWrite, count);
+AtomicBitmap<EXPANSION_BUFFER_SLOTS> expansionSlotsEmpty, expansionSlotsFilled;
+unsigned expansionSlotNodes[EXPANSION_BUFFER_SLOTS]; // number of nodes in each filled slot, after deduplication
 
-		expansionSpilloverChunkOutPos += count;
-		expansionSpilloverNodesQueued += count;
+// A filled slot is sorted and deduplicated. If that frees at least this many nodes, the worker keeps filling it.
+const unsigned EXPANSION_SLOT_MIN_REFILL = EXPANSION_NODES_PER_QUEUE_ELEMENT / 8;
+std::atomic<unsigned> expansionSlotsFilledCount; // incremented after a bit is set in expansionSlotsFilled, reserved before bits are claimed from it
 
-		if (spilloverToNextChunk >= 0)
-		{
-			expansionSpilloverOut.close();
-			expansionSpilloverChunkOut++;
-			expansionSpilloverChunkOutPos = 0;
-			expansionSpilloverOutOpen = false;
-		}
-		if (spilloverToNextChunk <= 0)
-			break;
+MUTEX expansionMutex; // protects expansionChunks; expansionSlotFreedCondition is used with it
+CONDITION expansionSlotFreedCondition; // notified when slots are emptied or filled, if there are expansionSlotWaiters
+std::atomic<int> expansionSlotWaiters(0);
+unsigned expansionChunks;
+unsigned expansionFirstChunk; // the chunks are numbered from this on; moves up when intermediate merge passes replace them
+FRAME_GROUP expansionFrameGroup; // currentFrameGroup, or the next one while its expansion overlaps Combining (see PIPELINED_EXPANSION)
 
-		count = spilloverToNextChunk;
-	}
+const char* formatExpandedChunkName(unsigned chunk)
+{
+	return formatFileName("expanded", expansionFrameGroup, expansionFirstChunk + chunk);
 }
 
-void expansionReadSpillover(OpenNode *bufferToRead, size_t count)
-{
-	while (true)
-	{
-		debug_assert(!(expansionSpilloverChunkIn >  expansionSpilloverChunkOut ||
-		               expansionSpilloverChunkIn == expansionSpilloverChunkOut && expansionSpilloverChunkInPos + count > expansionSpilloverChunkOutPos));
+TaskFuture expansionWriteChunkFutures[WORKERS];
+BufferedOutputStream<OpenNode> expansionWriteChunkThreadStream[WORKERS];
+unsigned expansionWriteChunkThreadChunk[WORKERS];
+HeapNode* expansionWriteChunkThreadInputs[WORKERS]; // ownership passes to mergeChunks
+unsigned* expansionWriteChunkThreadSlots[WORKERS];
+#ifdef DEBUG_EXPANSION
+FILE *expansionDebug;
+#endif
 
-		bool reopen = false;
-		if (expansionSpilloverOutOpen && expansionSpilloverChunkIn == expansionSpilloverChunkOut)
-		{
-			expansionSpilloverOut.close();
-			reopen = true;
-		}
-
-		if (!expansionSpilloverInOpen)
-		{
-			expansionSpilloverIn.open(formatFileName("expansionSpillover", currentFrameGroup, expansionSpilloverChunkIn));
-			if (expansionSpilloverChunkInPos)
-				expansionSpilloverIn.seek(expansionSpilloverChunkInPos);
-			expansionSpilloverInOpen = true;
-		}
+struct alignas(64) ExpansionThreadContext // one cache line (or more) per worker, to avoid false sharing
+{
+	OpenNode* buffer; // start of the slot being filled, or NULL
+	unsigned i;       // nodes in buffer
+	unsigned slot;
+	size_t slotHint;  // where to start looking for the next empty slot
+	uint64_t blockedTime; // nanoseconds spent waiting for a chunk write or an empty slot in this frame
+	uint64_t duplicates;  // nodes removed from slots by deduplication in this frame
+	NodeSort<OpenNode> sort; // kept between slots, as it may hold scratch space
+};
+ExpansionThreadContext expansionThread[WORKERS];
 
-		fpos_t spilloverToNextChunk = expansionSpilloverChunkInPos + count - SPILLOVER_CHUNK_SIZE * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-		if (spilloverToNextChunk > 0)
-			count -= spilloverToNextChunk;
+// Adds the time until it goes out of scope to a worker's blockedTime.
+class ExpansionBlockedTimer
+{
+	std::chrono::steady_clock::time_point start;
+	uint64_t* total;
 
-		expansionSpilloverIn.read(bufferToRead, count);
+public:
+	ExpansionBlockedTimer(uint64_t* total) : start(std::chrono::steady_clock::now()), total(total) {}
+	~ExpansionBlockedTimer()
+	{
+		*total += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+};
 
-		expansionSpilloverChunkInPos  += count;
-		expansionSpilloverNodesQueued -= count;
+// Total time all workers spent blocked during the last Expansion.
+double expansionBlockedSeconds()
+{
+	uint64_t total = 0;
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+		total += expansionThread[threadID].blockedTime;
+	return total / 1e9;
+}
 
-		assert(expansionSpilloverNodesQueued >= 0);
+// Total number of duplicate nodes dropped from slots during the last Expansion.
+uint64_t expansionDuplicates()
+{
+	uint64_t total = 0;
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+		total += expansionThread[threadID].duplicates;
+	return total;
+}
 
-		if (expansionSpilloverNodesQueued == 0)
-		{
-			expansionSpilloverIn.close();
-			deleteFile(formatFileName("expansionSpillover", currentFrameGroup, expansionSpilloverChunkIn));
-			expansionSpilloverOutOpen = false;
-			expansionSpilloverChunkOut = 0;
-			expansionSpilloverChunkOutPos = 0;
-			expansionSpilloverInOpen = false;
-			expansionSpilloverChunkIn = 0;
-			expansionSpilloverChunkInPos = 0;
-			break;
-		}
+#if defined(BACKGROUND_MERGE) && !defined(MULTITHREADING)
+# undef BACKGROUND_MERGE
+#endif
 
-		if (spilloverToNextChunk >= 0)
-		{
-			expansionSpilloverIn.close();
-			deleteFile(formatFileName("expansionSpillover", currentFrameGroup, expansionSpilloverChunkIn));
-			expansionSpilloverChunkIn++;
-			expansionSpilloverChunkInPos = 0;
-			expansionSpilloverInOpen = false;
-		}
-		else
-		if (reopen)
-		{
-			if (expansionSpilloverInOpen)
-			{
-				expansionSpilloverIn.close();
-				expansionSpilloverInOpen = false;
-			}
-			expansionSpilloverOut.open(formatFileName("expansionSpillover", currentFrameGroup, expansionSpilloverChunkOut), true);
-		}
+#ifdef BACKGROUND_MERGE
 
-		if (spilloverToNextChunk <= 0)
-			break;
+// Chunks are merged in tiers: BACKGROUND_MERGE finished chunks of one tier are merged into one chunk of the next tier.
+// Merged chunks take their numbers from expansionChunks, like the chunks written from the expansion buffer, so the
+// numbers of the chunks left at the end have gaps; expansionRenumberChunks closes them before the Merging step.
+// At most one background merge runs at a time, so that it only takes bandwidth the chunk writers leave unused.
 
-		count = spilloverToNextChunk;
-	}
-}
+std::vector<std::vector<unsigned> > backgroundMergeTiers; // [tier]: finished chunks not being merged; protected by expansionMutex
+bool backgroundMergeRunning, backgroundMergeStopping;     // protected by expansionMutex
+unsigned backgroundMergeInputs[BACKGROUND_MERGE], backgroundMergeTier, backgroundMergeOutput;
+unsigned backgroundMergedChunks; // chunks consumed by background merges in this frame
+TaskFuture backgroundMergeFuture;
 
-struct
+void initBackgroundMerge()
 {
-	OpenNode *buffer;
-	size_t    count;
-	std::list<ExpansionBufferRegion>::iterator region;
-} expansionSpilloverThreadBuffer[2];
+	backgroundMergeTiers.clear();
+	backgroundMergeRunning = backgroundMergeStopping = false;
+	backgroundMergedChunks = 0;
+}
 
-void expansionWriteSpilloverThread()
+// Picks the chunks for the next background merge. Call with expansionMutex locked.
+bool backgroundMergeFindInputs()
 {
-	expansionWriteSpillover(expansionSpilloverThreadBuffer[0].buffer, expansionSpilloverThreadBuffer[0].count);
-	if (expansionSpilloverThreadBuffer[1].buffer)
-		expansionWriteSpillover(expansionSpilloverThreadBuffer[1].buffer, expansionSpilloverThreadBuffer[1].count);
-	
+	if (backgroundMergeStopping)
+		return false;
+	for (unsigned tier=0; tier<backgroundMergeTiers.size(); tier++)
 	{
-		SCOPED_LOCK lock(expansionMutex);
-
-		expansionSpilloverLocked = false;
-
-		expansionRegionMarkEmpty(expansionSpilloverThreadBuffer[0].region);
-		if (expansionSpilloverThreadBuffer[1].buffer)
-			expansionRegionMarkEmpty(expansionSpilloverThreadBuffer[1].region);
-#ifdef DEBUG_EXPANSION
-		dumpExpansionDebug();
-#endif
+		std::vector<unsigned>& chunks = backgroundMergeTiers[tier];
+		if (chunks.size() < BACKGROUND_MERGE)
+			continue;
+		std::copy(chunks.begin(), chunks.begin() + BACKGROUND_MERGE, backgroundMergeInputs);
+		chunks.erase(chunks.begin(), chunks.begin() + BACKGROUND_MERGE);
+		backgroundMergeTier = tier;
+		backgroundMergeOutput = expansionChunks++;
+		return true;
 	}
+	return false;
 }
 
-void expansionReadSpilloverThread()
+void backgroundMergeThread()
 {
-	SCOPED_LOCK lock(expansionMutex);
-
 	while (true)
 	{
 		{
-			SCOPED_LOCK lock(processQueueMutex);
-			if (stopSpecialWorkers)
-			{
-				runningSpecialWorkers--;
-				CONDITION_NOTIFY(specialWorkersExitCondition, lock);
-				return;
-			}
+			BufferedOutputStream<OpenNode> output; // allocate buffers outside of "ram"; reserve "ram" exclusively for expansion
+			output.openSorted(formatFileName("expanded", expansionFrameGroup, backgroundMergeOutput));
+			BufferedInputStream<OpenNode> inputs[BACKGROUND_MERGE];
+			for (unsigned i=0; i<BACKGROUND_MERGE; i++)
+				inputs[i].open(formatFileName("expanded", expansionFrameGroup, backgroundMergeInputs[i]));
+			mergeStreams<OpenNode>(inputs, BACKGROUND_MERGE, &output);
 		}
-		if (expansionSpilloverNodesQueued && !expansionSpilloverLocked && expansionChunkWritesInProgress==0)
-		{
-			std::list<ExpansionBufferRegion>::iterator firstEmptyRegionToFill;
-			bool foundEmptyRegionToFill = false;
-
-			for (std::list<ExpansionBufferRegion>::iterator i=expansionBufferRegions.begin(); i != expansionBufferRegions.end(); i++)
-			{
-				if (i->type == EXPANSION_BUFFER_REGION_EMPTY)
-				{
-					if (!foundEmptyRegionToFill)
-					{
-						foundEmptyRegionToFill = true;
-						firstEmptyRegionToFill = i;
-						break;
-					}
-				}
-			}
+		// the merged chunks are always deleted, even with KEEP_PAST_FILES, as renumbering the remaining ones may reuse their names
+		for (unsigned i=0; i<BACKGROUND_MERGE; i++)
+			deleteNodeFile(formatFileName("expanded", expansionFrameGroup, backgroundMergeInputs[i]));
 
-			if (foundEmptyRegionToFill && firstEmptyRegionToFill->length >= EXPANSION_SPILLOVER_READ_THRESHOLD)
-			{
-				size_t expansionSpilloverPresented = expansionSpilloverNodesQueued;
-				if (expansionSpilloverPresented > EXPANSION_SPILLOVER_READ_THRESHOLD * EXPANSION_NODES_PER_QUEUE_ELEMENT)
-					expansionSpilloverPresented = EXPANSION_SPILLOVER_READ_THRESHOLD * EXPANSION_NODES_PER_QUEUE_ELEMENT;
+		SCOPED_LOCK lock(expansionMutex);
+		backgroundMergedChunks += BACKGROUND_MERGE;
+		if (backgroundMergeTiers.size() <= backgroundMergeTier+1)
+			backgroundMergeTiers.resize(backgroundMergeTier+2);
+		backgroundMergeTiers[backgroundMergeTier+1].push_back(backgroundMergeOutput);
+		if (!backgroundMergeFindInputs())
+		{
+			backgroundMergeRunning = false;
+			return;
+		}
+	}
+}
 
-				size_t count = firstEmptyRegionToFill->length * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-				
-				if (count <= expansionSpilloverPresented)
-					firstEmptyRegionToFill->type = EXPANSION_BUFFER_REGION_READING;
-				else
-				{
-					count = expansionSpilloverPresented;
-					ExpansionBufferRegion region;
-					region.pos = firstEmptyRegionToFill->pos;
-					assert(count % EXPANSION_NODES_PER_QUEUE_ELEMENT == 0);
-					region.length = (unsigned)(count / EXPANSION_NODES_PER_QUEUE_ELEMENT);
-					region.type = EXPANSION_BUFFER_REGION_READING;
-					firstEmptyRegionToFill->pos    += region.length;
-					firstEmptyRegionToFill->length -= region.length;
-					firstEmptyRegionToFill = expansionBufferRegions.insert(firstEmptyRegionToFill, region);
-				}
-	#ifdef DEBUG_EXPANSION
-				dumpExpansionDebug();
-	#endif
+// Called when a chunk is completely on disk; starts a background merge if there are enough chunks of one tier.
+void backgroundMergeAddChunk(unsigned chunk)
+{
+	SCOPED_LOCK lock(expansionMutex);
+	if (backgroundMergeTiers.empty())
+		backgroundMergeTiers.resize(1);
+	backgroundMergeTiers[0].push_back(chunk);
+	if (!backgroundMergeRunning && backgroundMergeFindInputs())
+	{
+		backgroundMergeRunning = true;
+		backgroundMergeFuture.wait(); // the previous task may not have returned yet
+		submitTask<backgroundMergeThread>(WORKERS, &backgroundMergeFuture);
+	}
+}
 
-				OpenNode *buffer = EXPANSION_BUFFER + firstEmptyRegionToFill->pos * EXPANSION_NODES_PER_QUEUE_ELEMENT;
+// Lets the running background merge (if any) finish, and starts no more.
+void backgroundMergeStop()
+{
+	{
+		SCOPED_LOCK lock(expansionMutex);
+		backgroundMergeStopping = true;
+	}
+	backgroundMergeFuture.wait();
+}
 
-				expansionSpilloverLocked = true;
-				lock.unlock();
+// Renames the remaining chunks to 0..expansionChunks-1, as the Merging step (and resuming it) expects.
+void expansionRenumberChunks()
+{
+	std::vector<unsigned> chunks;
+	for (unsigned tier=0; tier<backgroundMergeTiers.size(); tier++)
+		chunks.insert(chunks.end(), backgroundMergeTiers[tier].begin(), backgroundMergeTiers[tier].end());
+	std::sort(chunks.begin(), chunks.end());
+	// chunks[i] >= i, and the names below chunks[i] are free by the time it is renamed
+	for (unsigned i=0; i<chunks.size(); i++)
+		if (chunks[i] != i)
+			renameNodeFile(formatFileName("expanded", expansionFrameGroup, chunks[i]), formatFileName("expanded", expansionFrameGroup, i));
+	expansionChunks = (unsigned)chunks.size();
+}
 
-				expansionReadSpillover(buffer, count);
-		
-				lock.lock();
-				expansionSpilloverLocked = false;
+#endif // BACKGROUND_MERGE
 
-				expansionRegionMarkFilled(firstEmptyRegionToFill);
+#ifdef DEBUG_EXPANSION
+void dumpExpansionDebug()
+{
+	timeb time1;
+	ftime(&time1);
+	fprintf(expansionDebug, "%9d.%03d: ", (int)time1.time, time1.millitm);
 
-				continue;
-			}
-		}
+	fputc('1'+(char)TLS_GET_THREAD_ID, expansionDebug);
+	fputc(':', expansionDebug);
+	fputc(' ', expansionDebug);
 
-		lock.unlock();
-		SLEEP(1);
-		lock.lock();
+	for (unsigned slot=0; slot<EXPANSION_BUFFER_SLOTS; slot++)
+	{
+		char c = 'w';
+		if (expansionSlotsEmpty.test(slot))
+			c = '.';
+		else
+		if (expansionSlotsFilled.test(slot))
+			c = '#';
+		else
+			for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+				if (expansionThread[threadID].buffer && expansionThread[threadID].slot == slot)
+					c = '1'+(char)threadID;
+		fputc(c, expansionDebug);
 	}
+	fputc('\n', expansionDebug);
+	fflush(expansionDebug);
 }
-
 #endif
 
-void expansionHandleFilledQueueElement()
+void initExpansion(FRAME_GROUP group)
 {
-	SCOPED_LOCK lock(expansionMutex);
-	THREAD_ID threadID = TLS_GET_THREAD_ID;
+	expansionFrameGroup = group;
 
-	expansionRegionMarkFilled(expansionThreadIter[threadID]);
+	expansionSlotsEmpty.clear();
+	expansionSlotsFilled.clear();
+	expansionSlotsFilledCount = 0;
+	for (unsigned slot=WORKERS; slot<EXPANSION_BUFFER_SLOTS; slot++)
+		expansionSlotsEmpty.set(slot);
 
-	lock.unlock();
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
 	{
-		TimSort<OpenNode> sort;
-		sort.sort(expansionThread[threadID].buffer, EXPANSION_NODES_PER_QUEUE_ELEMENT);
-	}
-	lock.lock();
+		expansionWriteChunkThreadStream[threadID].setWriteBufferSize(64*1024*1024 / sizeof(OpenNode) / WORKERS);
+		if (!expansionWriteChunkThreadSlots[threadID])
+			expansionWriteChunkThreadSlots[threadID] = new unsigned[EXPANSION_BUFFER_FILL_THRESHOLD];
 
-	expansionThread[threadID].buffer = NULL;
+		ExpansionThreadContext& context = expansionThread[threadID];
+		context.slot = (unsigned)threadID;
+		context.buffer = EXPANSION_BUFFER + context.slot * EXPANSION_NODES_PER_QUEUE_ELEMENT;
+		context.i = 0;
+		context.slotHint = (size_t)threadID * EXPANSION_BUFFER_SLOTS / WORKERS;
+		context.blockedTime = 0;
+		context.duplicates = 0;
+	}
 
-	while (true)
-	{
-		std::list<ExpansionBufferRegion>::iterator firstEmptyRegionToFill;
-		bool foundEmptyRegionToFill = false;
-		bool regionToFillAdjacentToFilledAdjacentToSortingBoundary = false;
-		bool regionToFillAdjacentToSortingBoundary = false;
-		bool lastRegionAdjacentToSortingBoundary = true;
-		bool regionToFillAdjacentToFilled = false;
-		bool lastRegionWasFilled = false;
-		unsigned totalEmptyLength = 0;
-
-		std::list<ExpansionBufferRegion>::iterator longestFilledRegionToSort;
-		unsigned longestFilledLength = 0;
-		
-#ifdef ENABLE_EXPANSION_SPILLOVER
-		std::list<ExpansionBufferRegion>::iterator rightmostFilledRegionToSpillover;
-		std::list<ExpansionBufferRegion>::iterator secondRightmostFilledRegionToSpillover;
-		bool foundRightmostFilledRegion = false;
-		bool foundSecondRightmostFilledRegion = false;
+	expansionChunks = 0;
+	expansionFirstChunk = 0;
+#ifdef BACKGROUND_MERGE
+	initBackgroundMerge();
 #endif
 
-		for (std::list<ExpansionBufferRegion>::iterator i=expansionBufferRegions.begin(); i != expansionBufferRegions.end(); i++)
-		{
-			if (i->type == EXPANSION_BUFFER_REGION_EMPTY)
-			{
-				if (!foundEmptyRegionToFill ||
-					!regionToFillAdjacentToFilledAdjacentToSortingBoundary && lastRegionAdjacentToSortingBoundary ||
-					!regionToFillAdjacentToFilledAdjacentToSortingBoundary && !regionToFillAdjacentToFilled && lastRegionWasFilled ||
-					(!regionToFillAdjacentToFilledAdjacentToSortingBoundary || !regionToFillAdjacentToFilled) && lastRegionAdjacentToSortingBoundary && lastRegionWasFilled)
-				{
-					foundEmptyRegionToFill = true;
-					firstEmptyRegionToFill = i;
-					regionToFillAdjacentToFilledAdjacentToSortingBoundary = lastRegionAdjacentToSortingBoundary;
-					regionToFillAdjacentToFilled = lastRegionWasFilled;
-				}
-				lastRegionAdjacentToSortingBoundary = false;
-				lastRegionWasFilled = false;
-				totalEmptyLength += i->length;
-			}
-			else
-			if (i->type == EXPANSION_BUFFER_REGION_FILLED)
-			{
-				if (longestFilledLength < i->length)
-				{
-					longestFilledLength = i->length;
-					longestFilledRegionToSort = i;
-				}
-#ifdef ENABLE_EXPANSION_SPILLOVER
-				if (foundRightmostFilledRegion)
-				{
-					secondRightmostFilledRegionToSpillover = rightmostFilledRegionToSpillover;
-					foundSecondRightmostFilledRegion = true;
-				}
-				rightmostFilledRegionToSpillover = i;
-				foundRightmostFilledRegion = true;
+#ifdef DEBUG_EXPANSION
+	expansionDebug = fopen("debug.log", "at");
+	fprintf(expansionDebug, "Frame group %u\n", expansionFrameGroup);
+	dumpExpansionDebug();
 #endif
-				lastRegionAdjacentToSortingBoundary = lastRegionAdjacentToSortingBoundary || (i->pos % EXPANSION_BUFFER_FILL_THRESHOLD == 0);
-				lastRegionWasFilled = true;
-			}
-			else
-			if (INRANGEX(i->type, EXPANSION_BUFFER_REGION_FILLING, EXPANSION_BUFFER_REGION_FILLING+WORKERS))
-			{
-				lastRegionWasFilled = true;
-			}
-			else
-			{
-				lastRegionAdjacentToSortingBoundary = false;
-				lastRegionWasFilled = false;
-			}
-		}
-
-		if (longestFilledLength >= EXPANSION_BUFFER_FILL_THRESHOLD)
-		{
-			sortExpansionRegion(longestFilledRegionToSort, lock);
-			continue;
-		}
-
-#ifdef ENABLE_EXPANSION_SPILLOVER
-		if (totalEmptyLength <= EXPANSION_SPILLOVER_SLACK && longestFilledLength + EXPANSION_SPILLOVER_SLACK < EXPANSION_BUFFER_FILL_THRESHOLD
-			&& !expansionSpilloverLocked && expansionChunkWritesInProgress==0 && foundRightmostFilledRegion)
-		{
-			std::list<ExpansionBufferRegion>::iterator& regionToWrite = rightmostFilledRegionToSpillover;
-			debug_assert(regionToWrite->length != 0);
+}
 
-			if (regionToWrite->length <= EXPANSION_SPILLOVER_WRITE_THRESHOLD)
-				regionToWrite->type = EXPANSION_BUFFER_REGION_WRITING;
-			else
-			{
-				ExpansionBufferRegion region;
-				region.pos = regionToWrite->pos + regionToWrite->length - EXPANSION_SPILLOVER_WRITE_THRESHOLD;
-				region.length = EXPANSION_SPILLOVER_WRITE_THRESHOLD;
-				region.type = EXPANSION_BUFFER_REGION_WRITING;
+// Call after setting bits in expansionSlotsEmpty or expansionSlotsFilled.
+void expansionNotifySlotWaiters()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fences before waiting on expansionSlotFreedCondition
+	if (expansionSlotWaiters.load(std::memory_order_relaxed))
+	{
+		SCOPED_LOCK lock(expansionMutex);
+		CONDITION_NOTIFY(expansionSlotFreedCondition, lock);
+	}
+}
 
-				regionToWrite->length -= EXPANSION_SPILLOVER_WRITE_THRESHOLD;
+void expansionWriteChunkThread()
+{
+	THREAD_ID threadID = TLS_GET_THREAD_ID;
+	mergeChunks<OpenNode, EXPANSION_NODES_PER_QUEUE_ELEMENT>(EXPANSION_BUFFER, expansionWriteChunkThreadInputs[threadID], EXPANSION_BUFFER_FILL_THRESHOLD, &expansionWriteChunkThreadStream[threadID]);
+	expansionWriteChunkThreadStream[threadID].close();
+#ifdef BACKGROUND_MERGE
+	backgroundMergeAddChunk(expansionWriteChunkThreadChunk[threadID]);
+#endif
 
-				if (++regionToWrite == expansionBufferRegions.end())
-				{
-					expansionBufferRegions.push_back(region);
-					regionToWrite = expansionBufferRegions.end();
-					regionToWrite--;
-				}
-				else
-					regionToWrite = expansionBufferRegions.insert(regionToWrite, region);
-			}
+	for (unsigned n=0; n<EXPANSION_BUFFER_FILL_THRESHOLD; n++)
+		expansionSlotsEmpty.set(expansionWriteChunkThreadSlots[threadID][n]);
 
-			expansionSpilloverThreadBuffer[0].buffer = EXPANSION_BUFFER + regionToWrite->pos * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-			expansionSpilloverThreadBuffer[0].count  = regionToWrite->length * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-			expansionSpilloverThreadBuffer[0].region = regionToWrite;
-			expansionSpilloverThreadBuffer[1].buffer = NULL;
+	expansionNotifySlotWaiters();
+#ifdef DEBUG_EXPANSION
+	SCOPED_LOCK lock(expansionMutex);
+	dumpExpansionDebug();
+#endif
+}
 
-			if (foundSecondRightmostFilledRegion && regionToWrite->length < EXPANSION_SPILLOVER_WRITE_THRESHOLD)
-			{
-				std::list<ExpansionBufferRegion>::iterator& secondRegionToWrite = secondRightmostFilledRegionToSpillover;
+// If enough slots are filled, claim EXPANSION_BUFFER_FILL_THRESHOLD of them and start writing them to a new chunk.
+bool expansionTryWriteChunk()
+{
+	unsigned filled = expansionSlotsFilledCount.load();
+	do
+		if (filled < EXPANSION_BUFFER_FILL_THRESHOLD)
+			return false;
+	while (!expansionSlotsFilledCount.compare_exchange_weak(filled, filled - EXPANSION_BUFFER_FILL_THRESHOLD));
 
-				if (secondRegionToWrite->length + regionToWrite->length <= EXPANSION_SPILLOVER_WRITE_THRESHOLD)
-					secondRegionToWrite->type = EXPANSION_BUFFER_REGION_WRITING;
-				else
-				{
-					ExpansionBufferRegion region;
-					region.pos = secondRegionToWrite->pos + secondRegionToWrite->length + regionToWrite->length - EXPANSION_SPILLOVER_WRITE_THRESHOLD;
-					region.length = EXPANSION_SPILLOVER_WRITE_THRESHOLD - regionToWrite->length;
-					region.type = EXPANSION_BUFFER_REGION_WRITING;
-
-					secondRegionToWrite->length -= EXPANSION_SPILLOVER_WRITE_THRESHOLD - regionToWrite->length;
-
-					if (++secondRegionToWrite == expansionBufferRegions.end())
-					{
-						expansionBufferRegions.push_back(region);
-						secondRegionToWrite = expansionBufferRegions.end();
-						secondRegionToWrite--;
-					}
-					else
-						secondRegionToWrite = expansionBufferRegions.insert(regionToWrite, region);
-				}
+	THREAD_ID threadID = TLS_GET_THREAD_ID;
+	{
+		ExpansionBlockedTimer timer(&expansionThread[threadID].blockedTime);
+		expansionWriteChunkFutures[threadID].wait(); // the stream and slot list are per-worker
+	}
 
-				expansionSpilloverThreadBuffer[1].buffer = EXPANSION_BUFFER + secondRegionToWrite->pos * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-				expansionSpilloverThreadBuffer[1].count  = secondRegionToWrite->length * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-				expansionSpilloverThreadBuffer[1].region = secondRegionToWrite;
-			}
+	// The reservation above guarantees that enough bits are (or are about to be) set, though other writers may be claiming them too.
+	unsigned* slots = expansionWriteChunkThreadSlots[threadID];
+	HeapNode* inputs = new HeapNode[EXPANSION_BUFFER_FILL_THRESHOLD];
+	size_t hint = 0;
+	for (unsigned n=0; n<EXPANSION_BUFFER_FILL_THRESHOLD; )
+	{
+		size_t slot = expansionSlotsFilled.claim(hint);
+		if (slot == expansionSlotsFilled.NONE)
+		{
+			// a reserved slot isn't visible yet; wait for it instead of spinning
+			ExpansionBlockedTimer timer(&expansionThread[threadID].blockedTime);
+			SCOPED_LOCK lock(expansionMutex);
+			expansionSlotWaiters++;
+			std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in expansionNotifySlotWaiters
+			while ((slot = expansionSlotsFilled.claim(hint)) == expansionSlotsFilled.NONE)
+				CONDITION_WAIT(expansionSlotFreedCondition, lock);
+			expansionSlotWaiters--;
+		}
+		slots[n] = (unsigned)slot;
+		inputs[n].pos = (unsigned)slot * EXPANSION_NODES_PER_QUEUE_ELEMENT;
+		inputs[n].end = (unsigned)slot * EXPANSION_NODES_PER_QUEUE_ELEMENT + expansionSlotNodes[slot];
+		n++;
+		hint = slot;
+	}
 
+	unsigned chunk;
+	{
+		SCOPED_LOCK lock(expansionMutex);
+		chunk = expansionChunks++;
 #ifdef DEBUG_EXPANSION
-			dumpExpansionDebug(threadID);
+		dumpExpansionDebug();
 #endif
+	}
 
-			expansionSpilloverLocked = true;
+	expansionWriteChunkThreadChunk[threadID] = chunk;
+	expansionWriteChunkThreadStream[threadID].openSorted(formatFileName("expanded", expansionFrameGroup, chunk));
+#ifdef PREALLOCATE_EXPANDED
+	expansionWriteChunkThreadStream[threadID].preallocate(
+#ifdef USE_UNBUFFERED_DISK_IO
+		(PREALLOCATE_EXPANDED + 0x1FF) & -0x200
+#else
+		PREALLOCATE_EXPANDED
+#endif
+		);
+#endif
+	expansionWriteChunkThreadInputs[threadID] = inputs;
 
-			THREAD_CREATE<expansionWriteSpilloverThread>(0);
+	submitTask<expansionWriteChunkThread>(threadID, &expansionWriteChunkFutures[threadID]);
+	return true;
+}
 
-			continue;
-		}
-#endif
+void expansionHandleFilledQueueElement()
+{
+	THREAD_ID threadID = TLS_GET_THREAD_ID;
+	ExpansionThreadContext& context = expansionThread[threadID];
 
-		if (foundEmptyRegionToFill)
-		{
-			ExpansionBufferRegion region;
-			region.length = 1;
-			region.type = (EXPANSION_BUFFER_REGION_TYPE)(EXPANSION_BUFFER_REGION_FILLING + threadID);
+	// Sort before publishing the slot, so that a chunk writer never sees unsorted data.
+	// The sorted part of a refilled slot is a natural run for TimSort; the radix sort doesn't care.
+	context.sort.sort(context.buffer, EXPANSION_NODES_PER_QUEUE_ELEMENT);
+	unsigned count = (unsigned)deduplicate(context.buffer, EXPANSION_NODES_PER_QUEUE_ELEMENT);
+	context.duplicates += EXPANSION_NODES_PER_QUEUE_ELEMENT - count;
+	if (EXPANSION_NODES_PER_QUEUE_ELEMENT - count >= EXPANSION_SLOT_MIN_REFILL)
+	{
+		context.i = count;
+		return;
+	}
 
-			region.pos = firstEmptyRegionToFill->pos;
-			if (firstEmptyRegionToFill->length == 1)
-			{
-				firstEmptyRegionToFill->type = region.type;
-				expansionThreadIter[threadID] = firstEmptyRegionToFill;
-			}
-			else
-			{
-				expansionThreadIter[threadID] = expansionBufferRegions.insert(firstEmptyRegionToFill, region);
-				firstEmptyRegionToFill->pos++;
-				firstEmptyRegionToFill->length--;
-			}
+	expansionSlotNodes[context.slot] = count;
+	expansionSlotsFilled.set(context.slot);
+	expansionSlotsFilledCount++;
+	context.buffer = NULL;
+	expansionNotifySlotWaiters();
 
-			expansionThread[threadID].i = 0;
+	expansionTryWriteChunk();
 
-			debug_assert(expansionThread[threadID].buffer == NULL);
-			expansionThread[threadID].buffer = EXPANSION_BUFFER + region.pos * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-	#ifdef DEBUG_EXPANSION
-			dumpExpansionDebug();
-	#endif
-			break;
-		}
+	// At most WORKERS-1 slots are owned by other workers and EXPANSION_BUFFER_FILL_THRESHOLD <= EXPANSION_BUFFER_SLOTS-(WORKERS-1),
+	// so if there are no empty slots, either a chunk is being written or there are enough filled slots to write one.
+	size_t slot;
+	while ((slot = expansionSlotsEmpty.claim(context.slotHint)) == expansionSlotsEmpty.NONE)
+	{
+		if (expansionTryWriteChunk())
+			continue;
 
-		{
-			SCOPED_LOCK lock(processQueueMutex);
-			if (processQueueHead == processQueueTail && stopWorkers)
-				return;
-		}
-		// wait until another thread empties queue element(s)
-		lock.unlock();
-		SLEEP(1);
-		lock.lock();
+		// wait until a chunk writer empties some slots (or enough are filled to write a chunk ourselves)
+		ExpansionBlockedTimer timer(&context.blockedTime);
+		SCOPED_LOCK lock(expansionMutex);
+		expansionSlotWaiters++;
+		std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in expansionNotifySlotWaiters
+		while ((slot = expansionSlotsEmpty.claim(context.slotHint)) == expansionSlotsEmpty.NONE && expansionSlotsFilledCount < EXPANSION_BUFFER_FILL_THRESHOLD)
+			CONDITION_WAIT(expansionSlotFreedCondition, lock);
+		expansionSlotWaiters--;
+		if (slot != expansionSlotsEmpty.NONE)
+			break;
 	}
+
+	context.slot = (unsigned)slot;
+	context.slotHint = slot;
+	context.i = 0;
+	context.buffer = EXPANSION_BUFFER + slot * EXPANSION_NODES_PER_QUEUE_ELEMENT;
+#ifdef DEBUG_EXPANSION
+	SCOPED_LOCK lock(expansionMutex);
+	dumpExpansionDebug();
+#endif
 }
 
 #ifdef USE_TRANSFORM_INVARIANT_SORTING
@@ -2723,236 +3550,484 @@ void writeOpenState(const NODE* state, FRAME frame)
 	if (frame > MAX_FRAMES)
 		return;
 	FRAME_GROUP group = frame/FRAMES_PER_GROUP;
-	THREAD_ID threadID = TLS_GET_THREAD_ID;
+	ExpansionThreadContext& context = expansionThread[TLS_GET_THREAD_ID];
 
-	expansionThread[threadID].buffer[expansionThread[threadID].i].state = *state;
-	expansionThread[threadID].buffer[expansionThread[threadID].i].frame = (PACKED_FRAME)frame;
-	expansionThread[threadID].i++;
-	if (expansionThread[threadID].i == EXPANSION_NODES_PER_QUEUE_ELEMENT)
+	context.buffer[context.i].state = *state;
+	context.buffer[context.i].frame = (PACKED_FRAME)frame;
+	context.i++;
+	if (context.i == EXPANSION_NODES_PER_QUEUE_ELEMENT)
 		expansionHandleFilledQueueElement();
 }
 
+// Called by each worker when it finishes; the partial slot is left in place and picked up by expansionMergeRegionsToDisk.
 void expansionSortFinalRegions()
 {
 	THREAD_ID threadID = TLS_GET_THREAD_ID;
-	if (expansionThread[threadID].buffer && expansionThread[threadID].i != 0)
 	{
-		TimSort<OpenNode> sort;
-		sort.sort(expansionThread[threadID].buffer, expansionThread[threadID].i);
-
-		{
-			SCOPED_LOCK lock(expansionMutex);
+		ExpansionBlockedTimer timer(&expansionThread[threadID].blockedTime);
+		expansionWriteChunkFutures[threadID].wait();
+	}
 
-			ExpansionBufferSortedRegion region;
-			region.start = (unsigned)(expansionThread[threadID].buffer - EXPANSION_BUFFER);
-			region.end   = (unsigned)(expansionThread[threadID].buffer - EXPANSION_BUFFER) + expansionThread[threadID].i;
-			expansionBufferRegionsToMerge.push(region);
-			expansionBufferQueueNodesToMerge++;
-		}
+	ExpansionThreadContext& context = expansionThread[threadID];
+	if (context.buffer && context.i != 0)
+	{
+		context.sort.sort(context.buffer, context.i);
+		unsigned count = (unsigned)deduplicate(context.buffer, context.i);
+		context.duplicates += context.i - count;
+		context.i = count;
 	}
 }
 
 void expansionMergeRegionsToDisk()
 {
-	for (std::list<ExpansionBufferRegion>::iterator i=expansionBufferRegions.begin(); i!=expansionBufferRegions.end(); i++)
+	unsigned numInputs = 0;
+	HeapNode *inputs = new HeapNode [expansionSlotsFilledCount + WORKERS];
+	for (size_t slot; (slot = expansionSlotsFilled.claim(0)) != expansionSlotsFilled.NONE; )
 	{
-		if (i->type != EXPANSION_BUFFER_REGION_FILLED)
-			continue;
-
-		i->type = EXPANSION_BUFFER_REGION_MERGING;
-#ifdef DEBUG_EXPANSION
-		dumpExpansionDebug();
-#endif
-
-		ExpansionBufferSortedRegion region;
-		region.start =  i->pos              * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-		region.end   = (i->pos + i->length) * EXPANSION_NODES_PER_QUEUE_ELEMENT;
-		expansionBufferRegionsToMerge.push(region);
-		expansionBufferQueueNodesToMerge += i->length;
+		inputs[numInputs].pos = (unsigned)slot * EXPANSION_NODES_PER_QUEUE_ELEMENT;
+		inputs[numInputs].end = (unsigned)slot * EXPANSION_NODES_PER_QUEUE_ELEMENT + expansionSlotNodes[slot];
+		numInputs++;
 	}
-
-	expansionBufferRegions.clear();
-
-	unsigned numInputs = 0;
-	HeapNode *inputs = new HeapNode [expansionBufferQueueNodesToMerge];
-	while (!expansionBufferRegionsToMerge.empty())
+	debug_assert(numInputs == expansionSlotsFilledCount);
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
 	{
-		std::queue<ExpansionBufferSortedRegion>::reference region = expansionBufferRegionsToMerge.front();
-		for (unsigned pos=region.start;;)
+		ExpansionThreadContext& context = expansionThread[threadID];
+		if (context.buffer && context.i != 0)
 		{
-			inputs[numInputs].pos = pos;
-			pos += EXPANSION_NODES_PER_QUEUE_ELEMENT;
-			if (pos >= region.end)
-			{
-				inputs[numInputs++].end = region.end;
-				break;
-			}
-			inputs[numInputs++].end = pos;
+			inputs[numInputs].pos = context.slot * EXPANSION_NODES_PER_QUEUE_ELEMENT;
+			inputs[numInputs].end = context.slot * EXPANSION_NODES_PER_QUEUE_ELEMENT + context.i;
+			numInputs++;
 		}
-		expansionBufferRegionsToMerge.pop();
+		context.buffer = NULL;
+	}
+	expansionSlotsFilledCount = 0;
+
+	if (numInputs == 0)
+	{
+		delete[] inputs;
+		return;
 	}
-	debug_assert(numInputs == expansionBufferQueueNodesToMerge);
 
 	BufferedOutputStream<OpenNode> output(64*1024*1024 / sizeof(OpenNode)); // allocate buffer outside of "ram"; reserve "ram" exclusively for expansion
-	output.open(formatFileName("expanded", currentFrameGroup, expansionChunks));
-	expansionChunks++;
+	unsigned chunk = expansionChunks++;
+	output.openSorted(formatFileName("expanded", expansionFrameGroup, chunk));
 
 	mergeChunks<OpenNode, EXPANSION_NODES_PER_QUEUE_ELEMENT>(EXPANSION_BUFFER, inputs, numInputs, &output);
+#ifdef BACKGROUND_MERGE
+	output.close();
+	backgroundMergeAddChunk(chunk);
+#endif
 }
 
 void expansionWriteFinalChunk()
 {
-/*#ifdef DEBUG_EXPANSION
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+		expansionWriteChunkThreadStream[threadID].deallocateBuffer();
+
+#ifdef BACKGROUND_MERGE
+	backgroundMergeStop();
+#endif
+	expansionMergeRegionsToDisk();
+#ifdef BACKGROUND_MERGE
+	expansionRenumberChunks();
+#endif
+
+#ifdef DEBUG_EXPANSION
 	{
 		timeb time1;
 		ftime(&time1);
-		fprintf(expansionDebug, "Merging sorted region(s) to disk.\n", time1.time, time1.millitm, WORKERS);
+		fprintf(expansionDebug, "%9d.%03d: Finished writing final expansion chunk.\n", (int)time1.time, time1.millitm);
 		fflush(expansionDebug);
 	}
-#endif*/
+#endif
 
-	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
-		expansionWriteChunkThreadStream[threadID].deallocateBuffer();
+#ifdef DEBUG_EXPANSION
+	fclose(expansionDebug);
+#endif
+}
+
+// Splits buf between the merge inputs and the output, which gets a bigger share to make up for the inputs that shrink when merged.
+// If the inputs get no buffer of their own, they allocate the standard buffer size outside of "ram".
+template<class INPUT>
+void setMergeBuffers(INPUT* inputs, unsigned count, BufferedOutputStream<OpenNode>* output, OpenNode* buf, size_t size)
+{
+	double outbuf_inbuf_ratio = sqrt(EXPECTED_MERGING_RATIO * count);
+	uint32_t bufferSize = (uint32_t)floor(size / (count + outbuf_inbuf_ratio));
+	
+	if (count <= size && bufferSize && (count+1)*bufferSize <= size)
+	{
+		output->setWriteBuffer(buf + count*bufferSize, (uint32_t)(size - count*bufferSize));
+		for (unsigned i=0; i<count; i++)
+			inputs[i].setReadBuffer(buf + i*bufferSize, bufferSize);
+	}
+	else
+		output->setWriteBuffer(buf, (uint32_t)size);
+}
+
+// Merges chunks [first, first+count) into one file. outputName is copied, as naming the inputs reuses the temporary strings.
+void mergeChunkFiles(unsigned first, unsigned count, std::string outputName)
+{
+	BufferedOutputStream<OpenNode>* output = new BufferedOutputStream<OpenNode>;
+	BufferedInputStream<OpenNode>* inputs = new BufferedInputStream<OpenNode>[count];
+	setMergeBuffers(inputs, count, output, (OpenNode*)ram, OPENNODE_BUFFER_SIZE);
+
+#ifdef PREALLOCATE_COMBINING
+	uint64_t size = 0;
+#endif
+	for (unsigned i=0; i<count; i++)
+	{
+		inputs[i].open(formatExpandedChunkName(first + i));
+#ifdef PREALLOCATE_COMBINING
+		size += inputs[i].size();
+#endif
+	}
+	
+	output->openSorted(outputName.c_str());
+#ifdef PREALLOCATE_COMBINING
+	// We could multiply this by EXPECTED_MERGING_RATIO, but there's no point really, as nothing else is consuming space during this step
+	size = (size * sizeof(OpenNode) + 0x1FF) & -0x200;
+	if (size)
+		output->preallocate(size);
+#endif
+
+	mergeStreams<OpenNode>(inputs, count, output);
+	
+	delete[] inputs;
+	delete output;
+}
+
+#if defined(PARALLEL_MERGE) && !defined(MULTITHREADING)
+# undef PARALLEL_MERGE
+#endif
+
+#ifdef PARALLEL_MERGE
+
+// The key space is split at MERGE_PARTS-1 splitter states, picked from samples of the chunks so that the parts are about
+// equally big. Each part is merged from all chunks by its own thread pool task into a segment file ("merging-<g>-<part>").
+// All copies of a state fall into the same part, so the segments are simply appended to each other.
 
-	if (expansionBufferQueueNodesToMerge)
-		expansionMergeRegionsToDisk();
+#define MERGE_PARTS WORKERS
+#define MERGE_SAMPLES_PER_CHUNK 64
+#define MERGE_PART_BUFFER_SIZE (OPENNODE_BUFFER_SIZE / MERGE_PARTS)
 
-#ifdef ENABLE_EXPANSION_SPILLOVER
-	if (expansionSpilloverOutOpen)
-		expansionSpilloverOut.close();
+struct MergeSample
+{
+	OpenNode node;
+	uint64_t weight; // how many nodes of its chunk the sample stands for
+
+	INLINE bool operator<(const MergeSample& b) const { return node < b.node; }
+};
+
+uint64_t (*mergePartStarts)[MERGE_PARTS+1]; // [chunk][part]: position of the part's first node in the chunk; [chunk][MERGE_PARTS] is the chunk's size
+TaskFuture mergePartFutures[MERGE_PARTS];
+
+// Position of the first node in [lo, hi) of a sorted file which is not less than key, or hi if there is none.
+uint64_t findFirstNotLess(NodeInputStream<OpenNode>* input, const char* filename, uint64_t lo, uint64_t hi, const OpenNode* key)
+{
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi-lo)/2;
+		OpenNode node;
+		input->seek(mid);
+		if (input->read(&node, 1) != 1)
+			error(format("Read error in %s", filename));
+		if (node < *key)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-	while (expansionSpilloverNodesQueued)
+// Splits sorted files into MERGE_PARTS key ranges: fills starts (as mergePartStarts) for the given files.
+// Returns false if there are too few nodes to be worth splitting.
+bool splitSortedFiles(const std::vector<std::string>& filenames, uint64_t (*starts)[MERGE_PARTS+1])
+{
+	unsigned count = (unsigned)filenames.size();
+	NodeInputStream<OpenNode>* inputs = new NodeInputStream<OpenNode>[count];
+	NodeIndex<OpenNode>* indexes = new NodeIndex<OpenNode>[count]; // narrow the binary searches, if the files have them
+	std::vector<MergeSample> samples;
+	uint64_t total = 0;
+	for (unsigned i=0; i<count; i++)
 	{
-		size_t count = OPENNODE_BUFFER_SIZE;
-		if (count > expansionSpilloverNodesQueued)
-			count = expansionSpilloverNodesQueued;
-# ifdef DEBUG_EXPANSION
+		inputs[i].open(filenames[i].c_str());
+		indexes[i].load(filenames[i].c_str());
+		uint64_t size = inputs[i].size();
+		starts[i][MERGE_PARTS] = size;
+		total += size;
+
+		unsigned sampleCount = size < MERGE_SAMPLES_PER_CHUNK ? (unsigned)size : MERGE_SAMPLES_PER_CHUNK;
+		for (unsigned n=0; n<sampleCount; n++)
 		{
-			timeb time1;
-			ftime(&time1);
-			fprintf(expansionDebug, "%9d.%03d: Reading %llu nodes of spillover...\n", (int)time1.time, time1.millitm, count);
-			fflush(expansionDebug);
+			MergeSample sample;
+			uint64_t pos = size * n / sampleCount;
+			inputs[i].seek(pos);
+			if (inputs[i].read(&sample.node, 1) != 1)
+				error(format("Read error in %s", filenames[i].c_str()));
+			sample.weight = size * (n+1) / sampleCount - pos;
+			samples.push_back(sample);
 		}
-# endif
+	}
 
-		expansionReadSpillover(EXPANSION_BUFFER, count);
+	bool split = total >= MERGE_PARTS * MERGE_SAMPLES_PER_CHUNK;
+	if (split)
+	{
+		std::sort(samples.begin(), samples.end());
+		for (unsigned i=0; i<count; i++)
+			starts[i][0] = 0;
 
-		size_t numerator = 0;
-		for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+		uint64_t weight = 0;
+		size_t sample = 0;
+		for (unsigned part=1; part<MERGE_PARTS; part++)
 		{
-			expansionThread[threadID].buffer             = EXPANSION_BUFFER + numerator/WORKERS;
-			numerator += count;
-			expansionThread[threadID].finalSortBufferEnd = EXPANSION_BUFFER + numerator/WORKERS;
+			while (weight < total * part / MERGE_PARTS)
+				weight += samples[sample++].weight;
+			const OpenNode* splitter = &samples[sample ? sample-1 : 0].node;
+			for (unsigned i=0; i<count; i++)
+			{
+				uint64_t lo = starts[i][part-1], hi = starts[i][MERGE_PARTS];
+				indexes[i].narrow(splitter, &lo, &hi);
+				starts[i][part] = findFirstNotLess(&inputs[i], filenames[i].c_str(), lo, hi, splitter);
+			}
 		}
+	}
+
+	delete[] indexes;
+	delete[] inputs;
+	return split;
+}
 
-# ifdef DEBUG_EXPANSION
+// Appends the segment files "<name>-<g>-<part>" to each other into "<name>-<g>", and deletes them.
+// Delta-coded segments are appended block by block, without decoding them.
+template<class NODE>
+void concatenateParts(const char* name, FRAME_GROUP g, bool deltaCoded=false)
+{
+	if (deltaCoded)
+	{
+#ifdef DELTA_CODED_FILES
+		NodeOutputStream<NODE> output;
+		output.open(formatFileName(name, g), false, true);
+		for (unsigned part=0; part<MERGE_PARTS; part++)
 		{
-			timeb time1;
-			ftime(&time1);
-			fprintf(expansionDebug, "%9d.%03d: Sorting spillover with %u threads...\n", (int)time1.time, time1.millitm, WORKERS);
-			fflush(expansionDebug);
+			{
+				NodeInputStream<NODE> input(formatFileName(name, g, part));
+				output.append(&input);
+			}
+			deleteNodeFile(formatFileName(name, g, part));
 		}
-# endif
+		return;
+#endif
+	}
 
+#ifdef NODE_INDEX
+	{
+		// the parts' indexes, one after the other
+		NodeIndexWriter<NODE> index;
+		index.open(formatFileName(name, g));
+		bool indexed = true;
+		for (unsigned part=0; part<MERGE_PARTS && indexed; part++)
+			indexed = index.append(formatFileName(name, g, part));
+		if (indexed)
+			index.close();
+	}
+#endif
+	renameFile(formatFileName(name, g, 0), formatFileName(name, g));
+	deleteNodeIndex(formatFileName(name, g, 0));
+	OutputStream<NODE> output(formatFileName(name, g), true);
+	for (unsigned part=1; part<MERGE_PARTS; part++)
+	{
 		{
-			SCOPED_LOCK lock(processQueueMutex);
-			runningSpecialWorkers += WORKERS;
+			InputStream<NODE> input(formatFileName(name, g, part));
+			size_t records;
+			while ((records = input.read((NODE*)ram, OPENNODE_BUFFER_SIZE * sizeof(OpenNode) / sizeof(NODE))))
+				output.write((NODE*)ram, records);
 		}
-		for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
-			THREAD_CREATE<sortExpansionSpilloverThread>(threadID);
+		deleteNodeFile(formatFileName(name, g, part));
+	}
+}
+
+void mergeExpandedPartThread()
+{
+	unsigned part = (unsigned)TLS_GET_THREAD_ID;
+	BufferedOutputStream<OpenNode>* output = new BufferedOutputStream<OpenNode>;
+	BufferedSplitInputStream<OpenNode>* inputs = new BufferedSplitInputStream<OpenNode>[expansionChunks];
+	setMergeBuffers(inputs, expansionChunks, output, (OpenNode*)ram + part * MERGE_PART_BUFFER_SIZE, MERGE_PART_BUFFER_SIZE);
+
+	uint64_t size = 0;
+	for (unsigned i=0; i<expansionChunks; i++)
+		if (mergePartStarts[i][part] < mergePartStarts[i][part+1]) // the merger skips unopened inputs
 		{
-			SCOPED_LOCK lock(processQueueMutex);
-			while (runningSpecialWorkers)
-				CONDITION_WAIT(specialWorkersExitCondition, lock);
+			inputs[i].open(formatExpandedChunkName(i), mergePartStarts[i][part], mergePartStarts[i][part+1]);
+			size += inputs[i].size();
 		}
 
-# ifdef DEBUG_EXPANSION
+	output->openSorted(formatFileName("merging", currentFrameGroup, part));
+#ifdef PREALLOCATE_COMBINING
+	if (size)
+		output->preallocate((size * sizeof(OpenNode) + 0x1FF) & -0x200);
+#endif
+
+	if (size)
+		mergeStreams<OpenNode>(inputs, expansionChunks, output);
+
+	delete[] inputs;
+	delete output;
+}
+
+// Returns false if the chunks were left for mergeExpandedSequential.
+bool mergeExpandedParallel()
+{
+	std::vector<std::string> filenames;
+	for (unsigned i=0; i<expansionChunks; i++)
+		filenames.push_back(formatExpandedChunkName(i));
+	mergePartStarts = new uint64_t[expansionChunks][MERGE_PARTS+1];
+	bool split = splitSortedFiles(filenames, mergePartStarts);
+	if (split)
+	{
+		for (unsigned part=0; part<MERGE_PARTS; part++)
+			submitTask<mergeExpandedPartThread>(part, &mergePartFutures[part]);
+		for (unsigned part=0; part<MERGE_PARTS; part++)
+			mergePartFutures[part].wait();
+
+		concatenateParts<OpenNode>("merging", currentFrameGroup);
+	}
+	delete[] mergePartStarts;
+	return split;
+}
+
+#endif // PARALLEL_MERGE
+
+#ifndef PARALLEL_MERGE
+# define MERGE_PARTS 1
+#endif
+
+#ifdef MERGE_WHILE_COMBINING
+# define MERGE_FINAL_PARTS 1 // the Combining step does the final merge, on one thread
+#else
+# define MERGE_FINAL_PARTS MERGE_PARTS
+#endif
+
+// Estimated time of a merge pass over the given amount of data, count chunks at a time. Each of the parts of a parallel merge
+// reads every chunk through its own buffers, and every buffer refill costs a seek on top of the sequential transfer.
+double mergePassTime(double bytes, unsigned count, unsigned parts)
+{
+	double outbuf_inbuf_ratio = sqrt(EXPECTED_MERGING_RATIO * count);
+	double inputBufferBytes = (double)OPENNODE_BUFFER_SIZE * sizeof(OpenNode) / parts / (count + outbuf_inbuf_ratio);
+	double outputBufferBytes = inputBufferBytes * outbuf_inbuf_ratio;
+	double seeks = bytes / inputBufferBytes + bytes * EXPECTED_MERGING_RATIO / outputBufferBytes;
+	return seeks * DISK_SEEK_TIME + bytes * (1 + EXPECTED_MERGING_RATIO) / DISK_TRANSFER_RATE;
+}
+
+// Returns how many chunks to merge at a time in the next pass; expansionChunks if the next pass should be the final one.
+// Merging all chunks at once needs the fewest passes, but the fewest seeks come with a few large buffers per merge.
+unsigned planMergePass()
+{
+	double bytes = 0;
+	for (unsigned i=0; i<expansionChunks; i++)
+		bytes += (double)getFileSize(formatExpandedChunkName(i));
+
+	unsigned bestFanIn = 0;
+	double bestTime = 0;
+	for (unsigned passes=1; ; passes++)
+	{
+		unsigned fanIn = (unsigned)ceil(pow((double)expansionChunks, 1.0 / passes) - 1e-9);
+		if (fanIn < 2)
+			break;
+		// the last pass merges what's left (at most fanIn chunks) in parallel, the ones before merge fanIn chunks at a time
+		if (fanIn * MERGE_FINAL_PARTS <= MAX_MERGE_INPUTS)
 		{
-			timeb time1;
-			ftime(&time1);
-			fprintf(expansionDebug, "%9d.%03d: Merging sorted spillover to disk...\n", (int)time1.time, time1.millitm);
-			fflush(expansionDebug);
+			double time = (passes-1) * mergePassTime(bytes, fanIn, 1) + mergePassTime(bytes, fanIn, MERGE_FINAL_PARTS);
+			if (bestFanIn == 0 || time < bestTime)
+			{
+				bestFanIn = passes==1 ? expansionChunks : fanIn;
+				bestTime = time;
+			}
 		}
-# endif
+		if (fanIn == 2)
+			break;
+	}
+	if (bestFanIn == 0)
+		bestFanIn = MAX_MERGE_INPUTS / MERGE_FINAL_PARTS >= 2 ? MAX_MERGE_INPUTS / MERGE_FINAL_PARTS : 2;
+	return bestFanIn;
+}
 
-		expansionMergeRegionsToDisk();
+// Replaces the chunks with fewer, bigger ones, each merged from up to fanIn chunks.
+void mergeExpandedPass(unsigned fanIn)
+{
+	unsigned runs = (expansionChunks + fanIn-1) / fanIn;
+	unsigned firstRun = expansionFirstChunk + expansionChunks; // numbered after the chunks, which are still needed if we are interrupted
+	for (unsigned run=0; run<runs; run++)
+	{
+		unsigned first = (unsigned)((uint64_t)expansionChunks *  run    / runs);
+		unsigned end   = (unsigned)((uint64_t)expansionChunks * (run+1) / runs);
+		mergeChunkFiles(first, end - first, formatExpandedChunkName(expansionChunks + run));
 	}
-#endif // ENABLE_EXPANSION_SPILLOVER
 
-#ifdef DEBUG_EXPANSION
 	{
-		timeb time1;
-		ftime(&time1);
-		fprintf(expansionDebug, "%9d.%03d: Finished writing final expansion chunk.\n", (int)time1.time, time1.millitm);
-		fflush(expansionDebug);
+		unsigned resumeInfo[2] = { runs, firstRun };
+		OutputStream<unsigned>(formatFileName("expandedcount", expansionFrameGroup), false).write(resumeInfo, 2);
 	}
+#ifndef KEEP_PAST_FILES
+	for (unsigned i=0; i<expansionChunks; i++)
+		deleteNodeFile(formatExpandedChunkName(i));
 #endif
+	expansionFirstChunk = firstRun;
+	expansionChunks = runs;
+}
 
-#ifdef DEBUG_EXPANSION
-	fclose(expansionDebug);
-#endif
+// Runs the merge passes which come before the final one.
+void mergeExpandedPasses()
+{
+	unsigned fanIn;
+	while (expansionChunks>1 && (fanIn = planMergePass()) < expansionChunks)
+		mergeExpandedPass(fanIn);
 }
 
+#ifdef MERGE_WHILE_COMBINING
+
+// Number of nodes in the chunks, before removing the duplicates between them.
+uint64_t expandedChunkNodes()
+{
+	uint64_t nodes = 0;
+	for (unsigned i=0; i<expansionChunks; i++)
+		nodes += getFileSize(formatExpandedChunkName(i)) / sizeof(OpenNode);
+	return nodes;
+}
+
+#else
+
 void mergeExpanded()
 {
 	if (expansionChunks>1)
 	{
-		BufferedOutputStream<OpenNode>* output = new BufferedOutputStream<OpenNode>;
-		BufferedInputStream<OpenNode>* inputs = new BufferedInputStream<OpenNode>[expansionChunks];
-		
-		double outbuf_inbuf_ratio = sqrt(EXPECTED_MERGING_RATIO * expansionChunks);
-		uint32_t bufferSize = (uint32_t)floor(OPENNODE_BUFFER_SIZE / (expansionChunks + outbuf_inbuf_ratio));
-		
-		if (expansionChunks <= OPENNODE_BUFFER_SIZE && bufferSize && (expansionChunks+1)*bufferSize <= OPENNODE_BUFFER_SIZE)
-		{
-			output->setWriteBuffer((OpenNode*)ram + expansionChunks*bufferSize, (uint32_t)OPENNODE_BUFFER_SIZE - expansionChunks*bufferSize);
-			for (unsigned i=0; i<expansionChunks; i++)
-				inputs[i].setReadBuffer((OpenNode*)ram + i*bufferSize, (uint32_t)bufferSize);
-		}
-		else
-			output->setWriteBuffer((OpenNode*)ram, (uint32_t)OPENNODE_BUFFER_SIZE);
+		mergeExpandedPasses();
 
-#ifdef PREALLOCATE_COMBINING
-		uint64_t size = 0;
-#endif
-		for (unsigned i=0; i<expansionChunks; i++)
-		{
-			inputs[i].open(formatFileName("expanded", currentFrameGroup, i));
-#ifdef PREALLOCATE_COMBINING
-			size += inputs[i].size();
-#endif
-		}
-		
-		output->open(formatFileName("merging", currentFrameGroup));
-#ifdef PREALLOCATE_COMBINING
-		// We could multiply this by EXPECTED_MERGING_RATIO, but there's no point really, as nothing else is consuming space during this step
-		size = (size * sizeof(OpenNode) + 0x1FF) & -0x200;
-		output->preallocate(size);
+#ifdef PARALLEL_MERGE
+		if (!mergeExpandedParallel())
 #endif
+			mergeChunkFiles(0, expansionChunks, formatFileName("merging", expansionFrameGroup));
 
-		mergeStreams<OpenNode>(inputs, expansionChunks, output);
-		
-		delete[] inputs;
-		delete output;
-
-		renameFile(formatFileName("merging", currentFrameGroup), formatFileName("expanded", currentFrameGroup));
+		renameNodeFile(formatFileName("merging", expansionFrameGroup), formatFileName("expanded", expansionFrameGroup));
 #ifndef KEEP_PAST_FILES
 		for (unsigned i=0; i<expansionChunks; i++)
-			deleteFile(formatFileName("expanded", currentFrameGroup, i));
+			deleteNodeFile(formatExpandedChunkName(i));
 #endif
 	}
 	else
 	if (expansionChunks)
-		renameFile(formatFileName("expanded", currentFrameGroup, 0), formatFileName("expanded", currentFrameGroup));
+		renameNodeFile(formatExpandedChunkName(0), formatFileName("expanded", expansionFrameGroup));
 	else
-		OutputStream<OpenNode> output(formatFileName("expanded", currentFrameGroup), false); // create zero byte file
+		OutputStream<OpenNode> output(formatFileName("expanded", expansionFrameGroup), false); // create zero byte file
 
 	expansionChunks = 0;
 }
 
+#endif // MERGE_WHILE_COMBINING
+
 // *********************************************** Cache ************************************************
 
-#if 0
+#ifdef STATE_CACHE_SHARE
+
 INLINE uint32_t hashState(const CompressedState* state)
 {
 	// Based on MurmurHash ( http://murmurhash.googlepages.com/MurmurHash2.cpp )
@@ -2960,13 +4035,13 @@ INLINE uint32_t hashState(const CompressedState* state)
 	const uint32_t m = 0x5bd1e995;
 	const int r = 24;
 
-	uint32_t h = sizeof(CompressedState);
+	uint32_t h = COMPRESSED_BYTES;
 
-	const uint32_t* data = (const uint32_t*)state;
+	const uint8_t* data = (const uint8_t*)state;
 
-	for (int i=0; i<sizeof(CompressedState)/4; i++) // should unroll
+	for (int i=0; i<COMPRESSED_BYTES/4; i++) // should unroll
 	{
-		uint32_t k = *data;
+		uint32_t k = *(const uint32_t*)data;
 
 		k *= m; 
 		k ^= k >> r; 
@@ -2975,7 +4050,15 @@ INLINE uint32_t hashState(const CompressedState* state)
 		h *= m; 
 		h ^= k;
 
-		data ++;
+		data += 4;
+	}
+
+	switch (COMPRESSED_BYTES & 3) // only hash the bytes that the comparison operators look at
+	{
+	case 3: h ^= data[2] << 16;
+	case 2: h ^= data[1] << 8;
+	case 1: h ^= data[0];
+	        h *= m;
 	}
 	
 	h ^= h >> 13;
@@ -2984,10 +4067,93 @@ INLINE uint32_t hashState(const CompressedState* state)
 
 	return h;
 }
-#endif
+
+// A direct-mapped cache of recently generated children, one per worker so that it needs no locking.
+// A child is dropped if the cache holds the same state, added in this frame group or one of the previous two,
+// with the same or a smaller frame: that copy has been (or will be) written to the expansion buffer already.
+
+# ifdef MULTITHREADING
+#  define STATE_CACHE_PARTS WORKERS
+#  define STATE_CACHE_PART TLS_GET_THREAD_ID
+# else
+#  define STATE_CACHE_PARTS 1
+#  define STATE_CACHE_PART 0
+# endif
+
+const FRAME_GROUP STATE_CACHE_MAX_AGE = 2;
+
+struct StateCacheEntry
+{
+	FRAME_GROUP group;
+	OpenNode node;
+};
+
+struct alignas(64) StateCachePart
+{
+	StateCacheEntry* entries;
+	size_t size;
+	uint64_t lookups, hits; // in the current frame group
+} stateCache[STATE_CACHE_PARTS];
+
+void initStateCache()
+{
+	size_t size = STATE_CACHE_SIZE / sizeof(StateCacheEntry) / STATE_CACHE_PARTS;
+	enforce(size, "STATE_CACHE_SHARE too small");
+	StateCacheEntry* entries = (StateCacheEntry*)((char*)ram + RAM_SIZE - STATE_CACHE_SIZE);
+	for (size_t i=0; i<size * STATE_CACHE_PARTS; i++)
+		entries[i].group = -(STATE_CACHE_MAX_AGE+1); // older than any frame group's window
+	for (unsigned part=0; part<STATE_CACHE_PARTS; part++)
+	{
+		stateCache[part].entries = entries + part * size;
+		stateCache[part].size = size;
+		stateCache[part].lookups = stateCache[part].hits = 0;
+	}
+}
+
+void resetStateCacheStats()
+{
+	for (unsigned part=0; part<STATE_CACHE_PARTS; part++)
+		stateCache[part].lookups = stateCache[part].hits = 0;
+}
+
+double stateCacheHitRate()
+{
+	uint64_t lookups = 0, hits = 0;
+	for (unsigned part=0; part<STATE_CACHE_PARTS; part++)
+	{
+		lookups += stateCache[part].lookups;
+		hits    += stateCache[part].hits;
+	}
+	return lookups ? (double)hits / lookups : 0;
+}
+
+// Returns true if the child can be dropped; otherwise, remembers it.
+INLINE bool stateCacheSeen(const CompressedState* cs, FRAME frame)
+{
+	if (frame > MAX_FRAMES) // won't be written anyway, and might not fit in PACKED_FRAME
+		return false;
+	StateCachePart& cache = stateCache[STATE_CACHE_PART];
+	StateCacheEntry* entry = cache.entries + (size_t)(((uint64_t)hashState(cs) * cache.size) >> 32);
+	cache.lookups++;
+	if (expansionFrameGroup - entry->group <= STATE_CACHE_MAX_AGE && entry->node.getState() == *cs && entry->node.frame <= frame)
+	{
+		cache.hits++;
+		return true;
+	}
+	entry->group = expansionFrameGroup;
+	entry->node.state = *cs;
+	entry->node.frame = (PACKED_FRAME)frame;
+	return false;
+}
+
+#endif // STATE_CACHE_SHARE
 
 void addState(const CompressedState* cs, FRAME frame)
 {
+#ifdef STATE_CACHE_SHARE
+	if (stateCacheSeen(cs, frame))
+		return;
+#endif
 	writeOpenState(cs, frame);
 }
 
@@ -2998,6 +4164,113 @@ void addStateTransform(CompressedStateTransform transform, FRAME frame)
 }
 #endif
 
+// ********************************** Closed nodes from combined files **********************************
+
+#if defined(NO_CLOSED_FILES) && defined(TIERED_CLOSED_SET)
+# undef NO_CLOSED_FILES // the closed files are the runs of the closed set
+#endif
+
+#ifdef NO_CLOSED_FILES
+
+// Reads the nodes of one frame group from a combined file, as they would be in the closed file of that frame group. The
+// Combining step keeps the lowest frame of each state, so the combined file of a frame group holds the closed nodes of all
+// the frame groups up to it. INPUT can also be a BufferedSplitInputStream, for reading one slice of the file.
+template<class INPUT = BufferedInputStream<OpenNode>>
+class ClosedNodeFilterInput
+{
+	enum { BLOCK_NODES = 0x1000 };
+
+	INPUT input;
+	FRAME_GROUP group;
+	const OpenNode* pending; // the rest of the last block read from input
+	uint32_t pendingCount;
+	Node* nodes; // the nodes of group from pending, converted
+	uint32_t pos, end;
+
+	bool fill()
+	{
+		pos = end = 0;
+		while (end == 0)
+		{
+			if (pendingCount == 0)
+			{
+				pending = input.readBlock(&pendingCount);
+				if (pending == NULL)
+				{
+					pendingCount = 0;
+					return false;
+				}
+			}
+			for (; pendingCount && end < BLOCK_NODES; pending++, pendingCount--)
+				if (pending->frame / FRAMES_PER_GROUP == group)
+				{
+					Node* cs = &nodes[end++];
+					(PackedCompressedState&)*cs = pending->state;
+#ifdef GROUP_FRAMES
+					cs->subframe = pending->frame % FRAMES_PER_GROUP;
+#endif
+				}
+		}
+		return true;
+	}
+
+public:
+	ClosedNodeFilterInput(uint32_t size = STANDARD_BUFFER_SIZE) : input(size), pendingCount(0), pos(0), end(0) { nodes = new Node[BLOCK_NODES]; }
+	~ClosedNodeFilterInput() { delete[] nodes; }
+
+	void open(const char* filename, FRAME_GROUP group)
+	{
+		input.open(filename);
+		this->group = group;
+		pendingCount = pos = end = 0;
+	}
+
+	// The nodes of group among the nodes [start, end) of the file (see BufferedSplitInputStreamSet).
+	void open(const char* filename, uint64_t start, uint64_t end, FRAME_GROUP group)
+	{
+		input.open(filename, start, end);
+		this->group = group;
+		pendingCount = pos = this->end = 0;
+	}
+
+	void close() { input.close(); }
+
+	void setReadBufferSize(uint32_t size) { input.setReadBufferSize(size); }
+
+	const Node* read()
+	{
+		if (pos == end && !fill())
+			return NULL;
+		return &nodes[pos++];
+	}
+
+	// Like ReadBuffer::readBlock; the blocks have at most BLOCK_NODES nodes.
+	const Node* readBlock(uint32_t* count)
+	{
+		if (pos == end && !fill())
+			return NULL;
+		*count = end - pos;
+		const Node* block = &nodes[pos];
+		pos = end;
+		return block;
+	}
+
+#ifdef ASYNC_IO
+	double readStallSeconds() const { return input.readStallSeconds(); }
+#endif
+};
+
+// The last frame group with a combined file, or -1 if there is none.
+FRAME_GROUP findLastCombinedFrameGroup()
+{
+	for (FRAME_GROUP g=MAX_FRAME_GROUPS; g>=0; g--)
+		if (fileExists(formatFileName("combined", g)))
+			return g;
+	return -1;
+}
+
+#endif // NO_CLOSED_FILES
+
 // ******************************************** Exit tracing ********************************************
 
 CompressedState exitSearchCompressedState;
@@ -3080,6 +4353,9 @@ void traceExit(const State* exitState, FRAME exitFrame)
 {
 	Step steps[MAX_STEPS];
 	int stepNr = 0;
+#ifdef NO_CLOSED_FILES
+	FRAME_GROUP combinedFrameGroup = findLastCombinedFrameGroup(); // the frame group in which the exit was found
+#endif
 	
 	if (fileExists(formatFileName("solution")))
 	{
@@ -3119,7 +4395,11 @@ void traceExit(const State* exitState, FRAME exitFrame)
 		if (exitSearchFrameGroup < 0)
 			goto found;
 
+#ifdef NO_CLOSED_FILES
+		if (exitSearchFrameGroup <= combinedFrameGroup)
+#else
 		if (fileExists(formatFileName("closed", exitSearchFrameGroup)))
+#endif
 		{
 			saveExitTrace(steps, stepNr);
 
@@ -3133,7 +4413,12 @@ void traceExit(const State* exitState, FRAME exitFrame)
 			startWorkers<&processExitState,&doNothing>();
 #endif
 
+#ifdef NO_CLOSED_FILES
+			ClosedNodeFilterInput<> input;
+			input.open(formatFileName("combined", combinedFrameGroup), exitSearchFrameGroup);
+#else
 			BufferedInputStream<Node> input(formatFileName("closed", exitSearchFrameGroup));
+#endif
 			const Node *cs;
 			DEBUG_ONLY(statesQueued = statesDequeued = 0);
 			while ((cs = input.read()))
@@ -3331,20 +4616,387 @@ int doSortOpen(FRAME_GROUP firstFrameGroup, FRAME_GROUP maxFrameGroups);
 int filterOpen();
 void doFilterOpen(FRAME_GROUP firstFrameGroup, FRAME_GROUP maxFrameGroups);
 
-// *********************************************** Search ***********************************************
+// ***************************************** Tiered closed set ******************************************
 
-FRAME_GROUP firstFrameGroup, maxFrameGroups;
+#ifdef TIERED_CLOSED_SET
 
-bool exitFound;
-FRAME exitFrame;
-State exitState;
-#ifdef MULTITHREADING
-MUTEX finishMutex;
+#if defined(DELTA_CODED_FILES) && !defined(NODE_INDEX)
+# error TIERED_CLOSED_SET with DELTA_CODED_FILES needs NODE_INDEX, or every lookup decodes the runs from the start
 #endif
 
-INLINE bool finishCheck(const State* s, FRAME frame)
+#include "BloomFilter.cpp"
+
+#ifndef TIERED_FANOUT
+# define TIERED_FANOUT 4
+#endif
+#ifndef TIERED_MAX_RUNS
+# define TIERED_MAX_RUNS 32
+#endif
+
+// The closed set (the states of all closed nodes) is kept as sorted runs of closed nodes instead of in the combined file: the
+// closed files themselves, and runs compacted from consecutive ones ("closedrun-<first>-<last>", first and last being the frame
+// groups of the closed files they hold). The combined file only keeps the nodes which aren't closed, so that the Combining step
+// reads and writes about as many nodes as there are in the frontier, instead of all nodes seen so far.
+//
+// Each run has a Bloom filter and every NODE_INDEX_INTERVAL-th state of it in memory (outside of "ram"); together they reject
+// most states which aren't in the run, and narrow the others down to NODE_INDEX_INTERVAL nodes, which are read from the run.
+// Runs are compacted in size tiers: the newest TIERED_FANOUT consecutive runs of one tier (runs of TIERED_FANOUT^t up to
+// TIERED_FANOUT^(t+1) nodes) are merged into one run on a thread pool task, which works during the Expanding step and is
+// waited for by the next Combining step. So are the smallest consecutive runs if there are more than TIERED_MAX_RUNS runs.
+// The closed files stay, as exit tracing needs them.
+//
+// "closedruns-<g>" lists the runs as of frame group g. Without it (the first frame group, or a search started without
+// TIERED_CLOSED_SET), the closed files up to g are used. Compacted runs are deleted once a newer list leaves them out.
+
+struct ClosedRunRange
 {
-	if (s->isFinish())
+	FRAME_GROUP first, last;
+};
+
+const char* formatClosedRunName(FRAME_GROUP first, FRAME_GROUP last)
+{
+	return first == last ? formatFileName("closed", first) : formatFileName("closedrun", first, (unsigned)last);
+}
+
+INLINE uint64_t hashClosedState(const CompressedState* state)
+{
+	return hashBytes64(state, COMPRESSED_BYTES); // only the bytes that the comparison operators look at
+}
+
+class ClosedRun
+{
+	BloomFilter bloom;
+	std::vector<PackedCompressedState> keys; // every NODE_INDEX_INTERVAL-th state
+	NodeInputStream<Node>* input; // opened by the first lookup which gets past the filter
+	std::vector<Node> window;     // the nodes from keys[windowKey] up to the next key
+	size_t windowKey;
+
+	void readWindow(size_t key)
+	{
+		if (!input)
+		{
+			input = new NodeInputStream<Node>;
+			input->open(filename.c_str());
+		}
+		uint64_t start = (uint64_t)key * NODE_INDEX_INTERVAL;
+		size_t count = (size_t)(nodes - start < NODE_INDEX_INTERVAL ? nodes - start : NODE_INDEX_INTERVAL);
+		window.resize(count);
+		input->seek(start);
+		enforce(input->read(window.data(), count) == count, format("Truncated closed run (%s)", filename.c_str()));
+		windowKey = key;
+	}
+
+public:
+	ClosedRunRange range;
+	std::string filename;
+	uint64_t nodes;
+
+	ClosedRun(FRAME_GROUP first, FRAME_GROUP last) : input(NULL), windowKey((size_t)-1), filename(formatClosedRunName(first, last)), nodes(0)
+	{
+		range.first = first;
+		range.last = last;
+	}
+
+	~ClosedRun()
+	{
+		endLookups();
+	}
+
+	// Reads the run once, to build its filter and keys.
+	void load()
+	{
+		BufferedInputStream<Node> in(filename.c_str()); // allocate buffer outside of "ram"
+		nodes = in.size();
+		bloom.init(nodes);
+		keys.clear();
+		keys.reserve((size_t)(nodes / NODE_INDEX_INTERVAL + 1));
+		uint64_t n = 0;
+		const Node* block;
+		uint32_t count;
+		while ((block = in.readBlock(&count)))
+			for (uint32_t i=0; i<count; i++, n++)
+			{
+				bloom.add(hashClosedState(&block[i].getState()));
+				if (n % NODE_INDEX_INTERVAL == 0)
+					keys.push_back(block[i].state);
+			}
+		enforce(n == nodes, format("Truncated closed run (%s)", filename.c_str()));
+	}
+
+	// Lookups are fastest in increasing order of states, as each window of the run is then read only once.
+	INLINE bool contains(const CompressedState* state, uint64_t hash)
+	{
+		if (!bloom.mayContain(hash))
+			return false;
+
+		size_t a = 0, b = keys.size(); // find the last key which is not greater than state
+		while (a < b)
+		{
+			size_t mid = a + (b-a)/2;
+			if (*state < (const CompressedState&)keys[mid])
+				b = mid;
+			else
+				a = mid+1;
+		}
+		if (a == 0)
+			return false;
+		if (a-1 != windowKey)
+			readWindow(a-1);
+
+		a = 0, b = window.size();
+		while (a < b)
+		{
+			size_t mid = a + (b-a)/2;
+			if (window[mid].getState() < *state)
+				a = mid+1;
+			else
+				b = mid;
+		}
+		return a < window.size() && window[a].getState() == *state;
+	}
+
+	// Closes the run's file until the next lookup (e.g. so that it can be deleted).
+	void endLookups()
+	{
+		if (input)
+		{
+			input->close();
+			delete input;
+			input = NULL;
+		}
+		std::vector<Node>().swap(window);
+		windowKey = (size_t)-1;
+	}
+
+	// The size tier of the run, for compaction.
+	unsigned tier() const
+	{
+		unsigned t = 0;
+		for (uint64_t n = nodes; n >= TIERED_FANOUT; n /= TIERED_FANOUT)
+			t++;
+		return t;
+	}
+};
+
+std::vector<ClosedRun*> closedRuns; // oldest first
+bool closedRunsLoaded = false;
+std::vector<std::string> closedRunsObsolete; // compacted runs which were merged into a newer run
+
+ClosedRun* closedRunsCompactionOutput = NULL; // while a compaction is running
+size_t closedRunsCompactionFirst, closedRunsCompactionCount; // the merged runs, in closedRuns
+std::vector<std::string> closedRunsCompactionInputs; // their files, as closedRuns may change while the task runs
+#ifdef MULTITHREADING
+TaskFuture closedRunsCompactionFuture;
+#endif
+
+uint64_t closedSetNodes()
+{
+	uint64_t total = 0;
+	for (size_t i=0; i<closedRuns.size(); i++)
+		total += closedRuns[i]->nodes;
+	return total;
+}
+
+// Adds the run if it isn't empty.
+void closedSetAddRun(FRAME_GROUP first, FRAME_GROUP last)
+{
+	ClosedRun* run = new ClosedRun(first, last);
+	run->load();
+	if (run->nodes)
+		closedRuns.push_back(run);
+	else
+		delete run;
+}
+
+// Loads the closed set as of frame group g, once.
+void closedSetLoad(FRAME_GROUP g)
+{
+	if (closedRunsLoaded)
+		return;
+	closedRunsLoaded = true;
+
+	std::string manifest = formatFileName("closedruns", g);
+	if (fileExists(manifest.c_str()))
+	{
+		InputStream<ClosedRunRange> input(manifest.c_str());
+		std::vector<ClosedRunRange> ranges((size_t)input.size());
+		enforce(ranges.empty() || input.read(ranges.data(), ranges.size()) == ranges.size(), format("Truncated closed run list (%s)", manifest.c_str()));
+		for (size_t i=0; i<ranges.size(); i++)
+		{
+			enforce(fileExists(formatClosedRunName(ranges[i].first, ranges[i].last)), format("Closed run %s is missing", formatClosedRunName(ranges[i].first, ranges[i].last)));
+			closedSetAddRun(ranges[i].first, ranges[i].last);
+		}
+	}
+	else
+		for (FRAME_GROUP h=0; h<=g; h++)
+			if (fileExists(formatFileName("closed", h)))
+				closedSetAddRun(h, h);
+}
+
+INLINE bool closedSetContains(const CompressedState* state)
+{
+	uint64_t hash = hashClosedState(state);
+	for (size_t i=closedRuns.size(); i--; ) // newest first, as duplicates of recent nodes are the most common
+		if (closedRuns[i]->contains(state, hash))
+			return true;
+	return false;
+}
+
+void closedSetEndLookups()
+{
+	for (size_t i=0; i<closedRuns.size(); i++)
+		closedRuns[i]->endLookups();
+}
+
+void closedRunsCompactionThread()
+{
+	{
+		unsigned count = (unsigned)closedRunsCompactionInputs.size();
+		BufferedInputStream<Node>* inputs = new BufferedInputStream<Node>[count]; // allocate buffers outside of "ram"; reserve "ram" exclusively for expansion
+		for (unsigned i=0; i<count; i++)
+			inputs[i].open(closedRunsCompactionInputs[i].c_str());
+		BufferedOutputStream<Node>* output = new BufferedOutputStream<Node>;
+		output->openSorted(closedRunsCompactionOutput->filename.c_str(), true);
+		mergeStreams<Node>(inputs, count, output);
+		output->flush();
+		output->close();
+		delete output;
+		delete[] inputs;
+	}
+	closedRunsCompactionOutput->load();
+}
+
+// Picks the runs for the next compaction, see above.
+bool closedRunsFindCompaction()
+{
+	const size_t n = closedRuns.size();
+	if (n < TIERED_FANOUT)
+		return false;
+	for (size_t first = n - TIERED_FANOUT + 1; first--; )
+	{
+		unsigned tier = closedRuns[first]->tier();
+		size_t i;
+		for (i=1; i<TIERED_FANOUT && closedRuns[first+i]->tier() == tier; i++) {}
+		if (i == TIERED_FANOUT)
+		{
+			closedRunsCompactionFirst = first;
+			return true;
+		}
+	}
+	if (n <= TIERED_MAX_RUNS)
+		return false;
+	uint64_t best = 0;
+	for (size_t first=0; first + TIERED_FANOUT <= n; first++)
+	{
+		uint64_t total = 0;
+		for (size_t i=0; i<TIERED_FANOUT; i++)
+			total += closedRuns[first+i]->nodes;
+		if (first == 0 || total < best)
+		{
+			best = total;
+			closedRunsCompactionFirst = first;
+		}
+	}
+	return true;
+}
+
+void closedRunsStartCompaction()
+{
+	if (closedRunsCompactionOutput || !closedRunsFindCompaction())
+		return;
+	closedRunsCompactionCount = TIERED_FANOUT;
+	closedRunsCompactionInputs.clear();
+	for (size_t i=0; i<closedRunsCompactionCount; i++)
+		closedRunsCompactionInputs.push_back(closedRuns[closedRunsCompactionFirst + i]->filename);
+	closedRunsCompactionOutput = new ClosedRun(closedRuns[closedRunsCompactionFirst]->range.first, closedRuns[closedRunsCompactionFirst + closedRunsCompactionCount - 1]->range.last);
+#ifdef MULTITHREADING
+	submitTask<closedRunsCompactionThread>(WORKERS, &closedRunsCompactionFuture);
+#else
+	closedRunsCompactionThread();
+#endif
+}
+
+// Waits for the running compaction (if any), and replaces the merged runs with its output.
+void closedRunsFinishCompaction()
+{
+	if (!closedRunsCompactionOutput)
+		return;
+#ifdef MULTITHREADING
+	closedRunsCompactionFuture.wait();
+#endif
+	for (size_t i=0; i<closedRunsCompactionCount; i++)
+	{
+		ClosedRun* run = closedRuns[closedRunsCompactionFirst + i];
+		if (run->range.first != run->range.last) // closed files stay
+			closedRunsObsolete.push_back(run->filename);
+		delete run;
+	}
+	closedRuns.erase(closedRuns.begin() + closedRunsCompactionFirst, closedRuns.begin() + closedRunsCompactionFirst + closedRunsCompactionCount);
+	closedRuns.insert(closedRuns.begin() + closedRunsCompactionFirst, closedRunsCompactionOutput);
+	closedRunsCompactionOutput = NULL;
+}
+
+// Writes the list of runs as of frame group g, and deletes the runs which were merged into newer ones.
+void closedSetWriteRuns(FRAME_GROUP g)
+{
+	std::vector<ClosedRunRange> ranges;
+	for (size_t i=0; i<closedRuns.size(); i++)
+		ranges.push_back(closedRuns[i]->range);
+	{
+		OutputStream<ClosedRunRange> output(formatFileName("closingruns", g), false);
+		if (ranges.size())
+			output.write(ranges.data(), ranges.size());
+		output.flush();
+	}
+	renameFile(formatFileName("closingruns", g), formatFileName("closedruns", g), true);
+#ifndef KEEP_PAST_FILES
+	if (fileExists(formatFileName("closedruns", g-1)))
+		deleteFile(formatFileName("closedruns", g-1));
+	for (size_t i=0; i<closedRunsObsolete.size(); i++)
+		deleteNodeFile(closedRunsObsolete[i].c_str());
+#endif
+	closedRunsObsolete.clear();
+}
+
+// Called once the closed file of frame group g is in place: adds it to the closed set, and starts the next compaction.
+void closedSetCommit(FRAME_GROUP g)
+{
+	closedSetAddRun(g, g);
+	closedSetWriteRuns(g);
+	closedRunsStartCompaction();
+}
+
+// Called when the search stops: lists the output of the running compaction (if any), so that it isn't left behind unused.
+void closedSetFlush(FRAME_GROUP g)
+{
+	if (!closedRunsLoaded)
+		return;
+	closedRunsFinishCompaction();
+	closedSetWriteRuns(g);
+}
+
+#endif // TIERED_CLOSED_SET
+
+// *********************************************** Search ***********************************************
+
+FRAME_GROUP firstFrameGroup, maxFrameGroups;
+
+#ifdef PIPELINED_EXPANSION
+bool expansionPipelined; // the Combining step queues the nodes of the next frame group for expansion as it finds them
+#else
+const bool expansionPipelined = false;
+#endif
+
+bool exitFound;
+FRAME exitFrame;
+State exitState;
+#ifdef MULTITHREADING
+MUTEX finishMutex;
+#endif
+
+INLINE bool finishCheck(const State* s, FRAME frame)
+{
+	if (s->isFinish())
 	{
 #ifdef MULTITHREADING
 		SCOPED_LOCK lock(finishMutex);
@@ -3391,7 +5043,7 @@ void processState(const Node* cs)
 		error("Compression/decompression failed");
 	}
 #endif
-	FRAME currentFrame = GET_FRAME(currentFrameGroup, *cs);
+	FRAME currentFrame = GET_FRAME(expansionFrameGroup, *cs);
 	if (finishCheck(&s, currentFrame))
 		return;
 
@@ -3404,111 +5056,578 @@ void processState(const Node* cs)
 		enum { PREFERRED = PREFERRED_STATE_COMPRESSED };
 #endif
 
-#ifdef USE_TRANSFORM_INVARIANT_SORTING
-		static INLINE void handleChild(const State* parent, FRAME parentFrame, Step step, CompressedStateTransform transform, FRAME frame)
-		{
-			addStateTransform(transform, frame);
-		}
+#ifdef USE_TRANSFORM_INVARIANT_SORTING
+		static INLINE void handleChild(const State* parent, FRAME parentFrame, Step step, CompressedStateTransform transform, FRAME frame)
+		{
+			addStateTransform(transform, frame);
+		}
+#endif
+
+		static INLINE void handleChild(const State* parent, FRAME parentFrame, Step step, const CompressedState* cs, FRAME frame)
+		{
+			addState(cs, frame);
+		}
+
+		static INLINE void handleChild(const State* parent, FRAME parentFrame, Step step, const State* state, FRAME frame)
+		{
+			CompressedState cs;
+			state->compress(&cs);
+			addState(&cs, frame);
+		}
+	};
+
+	expandChildren<AddStateChildHandler>(currentFrame, &s);
+	assert(currentFrame/FRAMES_PER_GROUP == expansionFrameGroup, format("Run-away expansionFrameGroup: currentFrame=%u, expansionFrameGroup=%u", currentFrame, expansionFrameGroup));
+}
+
+INLINE void processFilteredState(const Node* state)
+{
+	//closedNodesInCurrentFrameGroup++;
+#ifdef MULTITHREADING
+	queueState(state);
+#else
+	processState(state, 0);
+#endif
+}
+
+class ProcessStateOutput
+{
+public:
+	INLINE static void write(const Node* state, bool verify=false)
+	{
+		processFilteredState(state);
+	}
+	INLINE static void write(const OpenNode* node, bool verify=false)
+	{
+		combinedNodesTotal++;
+		if (node->frame / FRAMES_PER_GROUP == currentFrameGroup+1)
+		{
+			Node cs;
+			(PackedCompressedState&)cs = node->state;
+#ifdef GROUP_FRAMES
+			cs.subframe = node->frame % FRAMES_PER_GROUP;
+#endif
+			write(&cs);
+		}
+	}
+	enum { WRITABLE = true };
+};
+
+#ifdef MULTITHREADING
+
+// The Expanding step splits the nodes of the frame group between the workers. Each worker reads its own slice of the file and
+// expands it, rather than one thread reading all of them and handing them out through the processing queue.
+#ifdef NO_CLOSED_FILES
+typedef BufferedSplitInputStreamSet<OpenNode, WORKERS, ClosedNodeFilterInput<BufferedSplitInputStream<OpenNode>>> ExpansionInput;
+#else
+typedef BufferedSplitInputStreamSet<Node, WORKERS> ExpansionInput;
+#endif
+
+ExpansionInput* expansionInput;
+TaskFuture expansionReadFutures[WORKERS];
+
+void expansionReadThread()
+{
+	THREAD_ID threadID = TLS_GET_THREAD_ID;
+	const Node* block;
+	uint32_t count;
+	while ((block = expansionInput->stream(threadID).readBlock(&count)))
+		for (uint32_t i=0; i<count; i++)
+			processState(&block[i]);
+	expansionSortFinalRegions();
+}
+
+void expandSlices(ExpansionInput* input)
+{
+	expansionInput = input;
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+		submitTask<expansionReadThread>(threadID, &expansionReadFutures[threadID]);
+	for (THREAD_ID threadID=0; threadID<WORKERS; threadID++)
+		expansionReadFutures[threadID].wait();
+}
+
+#endif
+
+// Counts the nodes itself, so that each part of a parallel Combining step has its own counters; they are added to
+// closedNodesInCurrentFrameGroup and combinedNodesTotal when the step is done.
+class ClosedNodeFilterOutput
+{
+public:
+	BufferedOutputStream<Node>* closed;
+	uint64_t closedNodes, combinedNodes;
+
+	ClosedNodeFilterOutput() : closed(&closedNodeFile), closedNodes(0), combinedNodes(0) {}
+
+	INLINE void write(const OpenNode* node, bool verify=false)
+	{
+		combinedNodes++;
+		if (node->frame / FRAMES_PER_GROUP == currentFrameGroup+1)
+			writeClosed(node);
+	}
+
+	// For nodes which are passed through unchanged (see mergeIntoStream).
+	INLINE void writeRun(const OpenNode* nodes, size_t count)
+	{
+		combinedNodes += count;
+		for (size_t i=0; i<count; i++)
+			if (nodes[i].frame / FRAMES_PER_GROUP == currentFrameGroup+1)
+				writeClosed(&nodes[i]);
+	}
+	enum { WRITABLE = true };
+
+	INLINE void writeClosed(const OpenNode* node)
+	{
+		Node cs;
+		(PackedCompressedState&)cs = node->state;
+#ifdef GROUP_FRAMES
+		cs.subframe = node->frame % FRAMES_PER_GROUP;
+#endif
+#ifndef NO_CLOSED_FILES // otherwise only counted; see ClosedNodeFilterInput
+		closed->write(&cs);
+#endif
+#ifdef PIPELINED_EXPANSION
+		if (expansionPipelined)
+			queueState(&cs);
+#endif
+		closedNodes++;
+	}
+
+	void addCounts()
+	{
+		closedNodesInCurrentFrameGroup += closedNodes;
+		combinedNodesTotal += combinedNodes;
+	}
+};
+
+void searchPrintHeader()
+{
+	printf("Frame" GROUP_STR " " GROUP_ALIGNED_FORMAT "/" GROUP_ALIGNED_FORMAT ": ", currentFrameGroup, maxFrameGroups);
+	fflush(stdout);
+}
+
+void searchPrintNodeCounts()
+{
+	printf("%11llu nodes, %12llu total", (unsigned long long)closedNodesInCurrentFrameGroup, (unsigned long long)combinedNodesTotal);
+	fflush(stdout);
+}
+
+void searchRecalculateNodeCounts()
+{
+#ifdef NO_CLOSED_FILES
+	{
+		ClosedNodeFilterInput<> input;
+		input.open(formatFileName("combined", currentFrameGroup), currentFrameGroup);
+		closedNodesInCurrentFrameGroup = 0;
+		uint32_t count;
+		while (input.readBlock(&count))
+			closedNodesInCurrentFrameGroup += count;
+	}
+#else
+	{
+		NodeInputStream<Node> getSize(formatFileName("closed", currentFrameGroup));
+		closedNodesInCurrentFrameGroup = getSize.size();
+	}
+#endif
+	{
+		NodeInputStream<OpenNode> getSize(formatFileName("combined", currentFrameGroup));
+		combinedNodesTotal = getSize.size();
+	}
+#ifdef TIERED_CLOSED_SET
+	closedSetLoad(currentFrameGroup);
+	combinedNodesTotal += closedSetNodes(); // the combined file only holds the nodes which aren't closed
+#endif
+}
+
+#ifdef NO_CLOSED_FILES
+const size_t RELATIVE_SIZE_CLOSING   =   0;
+#else
+const size_t RELATIVE_SIZE_CLOSING   =  20;
+#endif
+const size_t RELATIVE_SIZE_EXPANDED  = 142;
+const size_t RELATIVE_SIZE_COMBINED  = 189;
+const size_t RELATIVE_SIZE_COMBINING = 234;
+
+// How the Combining step divides a buffer between its streams.
+struct CombiningBufferSizes
+{
+	size_t closing, expanded, combined, combining;
+
+	CombiningBufferSizes(size_t size)
+	{
+		closing   = share(size                                , RELATIVE_SIZE_CLOSING  , RELATIVE_SIZE_CLOSING + RELATIVE_SIZE_EXPANDED + RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING);
+		expanded  = share(size - closing                      , RELATIVE_SIZE_EXPANDED ,                         RELATIVE_SIZE_EXPANDED + RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING);
+		combined  = share(size - closing - expanded           , RELATIVE_SIZE_COMBINED ,                                                  RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING);
+		combining = share(size - closing - expanded - combined, RELATIVE_SIZE_COMBINING,                                                                           RELATIVE_SIZE_COMBINING);
+	}
+
+	static size_t share(size_t size, size_t relativeSize, size_t relativeTotal)
+	{
+		size_t result = size * relativeSize / relativeTotal;
+		return result ? result : 1;
+	}
+};
+
+#ifdef ASYNC_IO
+double combiningReadStall, combiningWriteStall;
+#endif
+
+#ifdef PIPELINED_EXPANSION
+
+// Starts expanding the next frame group, with the nodes the Combining step queues (see ClosedNodeFilterOutput); the next
+// iteration of the search loop finishes it. Call after opening the expanded chunks, as initExpansion renumbers them.
+void startPipelinedExpansion()
+{
+	initExpansion(currentFrameGroup+1);
+#ifdef STATE_CACHE_SHARE
+	resetStateCacheStats();
+#endif
+	startWorkers<&processState,&expansionSortFinalRegions>();
+}
+
+#endif
+
+// The buffer for the Combining step's streams: "ram", unless it holds the next frame group's expansion buffer.
+OpenNode* combiningBuffer(size_t* size)
+{
+#ifdef PIPELINED_EXPANSION
+	if (expansionPipelined)
+	{
+		*size = PIPELINED_EXPANSION / sizeof(OpenNode);
+		return (OpenNode*)((char*)ram + RAM_SIZE);
+	}
+#endif
+	*size = OPENNODE_BUFFER_SIZE;
+	return (OpenNode*)ram;
+}
+
+// Merges the expanded nodes (the merged file, or the chunks) with the combined file into "combining", and writes the nodes
+// of the next frame group to "closing".
+void combineSequential(bool mergedExpanded, unsigned expandedInputs)
+{
+	size_t bufferSize;
+	OpenNode* buffer = combiningBuffer(&bufferSize);
+	const CombiningBufferSizes sizes(bufferSize);
+
+#ifndef NO_CLOSED_FILES
+	closedNodeFile.setWriteBuffer((Node*)buffer, sizes.closing * sizeof(OpenNode) / sizeof(Node));
+	closedNodeFile.openSorted(formatFileName("closing", currentFrameGroup+1), true);
+#ifdef ASYNC_IO
+	combiningWriteStall -= closedNodeFile.writeStallSeconds(); // closedNodeFile is reused
+#endif
+#ifdef PREALLOCATE_COMBINING
+	uint64_t previousClosedSize;
+	{
+		previousClosedSize = getFileSize(formatFileName("closed", currentFrameGroup));
+#ifdef USE_UNBUFFERED_DISK_IO
+		previousClosedSize = (previousClosedSize + 0x1FF) & -0x200;
+#endif
+	}
+	closedNodeFile.preallocate(previousClosedSize);
+#endif
+#endif // NO_CLOSED_FILES
+
+	{
+		BufferedInputStream<OpenNode>* inputs = new BufferedInputStream<OpenNode>[1 + expandedInputs];
+		DoubleOutput<OpenNode, ClosedNodeFilterOutput, BufferedOutputStream<OpenNode>> output;
+
+		if (mergedExpanded)
+		{
+			inputs[1].setReadBuffer(buffer + sizes.closing, sizes.expanded);
+			inputs[1].open(formatFileName("expanded", currentFrameGroup));
+		}
+		else
+		{
+			// if the share of each chunk is empty, the inputs allocate the standard buffer size outside of "ram"
+			size_t sizeChunk = expandedInputs ? sizes.expanded / expandedInputs : 0;
+			for (unsigned i=0; i<expandedInputs; i++)
+			{
+				if (sizeChunk)
+					inputs[1+i].setReadBuffer(buffer + sizes.closing + i*sizeChunk, (uint32_t)sizeChunk);
+				inputs[1+i].open(formatExpandedChunkName(i));
+			}
+		}
+
+		inputs[0].setReadBuffer(buffer + sizes.closing + sizes.expanded, sizes.combined);
+		inputs[0].open(formatFileName("combined", currentFrameGroup));
+
+		output.b()->setWriteBuffer(buffer + sizes.closing + sizes.expanded + sizes.combined, (uint32_t)sizes.combining);
+		output.b()->openSorted(formatFileName("combining", currentFrameGroup+1), true);
+#ifdef PREALLOCATE_COMBINING
+		uint64_t previousCombinedSize;
+		{
+			previousCombinedSize = getFileSize(formatFileName("combined", currentFrameGroup));
+#ifdef USE_UNBUFFERED_DISK_IO
+			previousCombinedSize = (previousCombinedSize + 0x1FF) & -0x200;
+#endif
+		}
+		output.b()->preallocate(previousCombinedSize);
+#endif
+
+#ifdef PIPELINED_EXPANSION
+		if (expansionPipelined)
+			startPipelinedExpansion();
+#endif
+		mergeIntoStream<OpenNode>(inputs, 1 + expandedInputs, &output);
+		output.a()->addCounts();
+#ifdef ASYNC_IO
+		for (unsigned i=0; i<1 + expandedInputs; i++)
+			combiningReadStall += inputs[i].readStallSeconds();
+		combiningWriteStall += output.b()->writeStallSeconds();
+#endif
+		delete[] inputs;
+	}
+
+#ifndef NO_CLOSED_FILES
+	closedNodeFile.close();
+#ifdef ASYNC_IO
+	combiningWriteStall += closedNodeFile.writeStallSeconds();
+#endif
+	closedNodeFile.clearBuffer(); // prevent bytes from Nodes from becoming junk inside OpenNode padding
+#endif
+}
+
+#if defined(PARALLEL_COMBINING) && (!defined(PARALLEL_MERGE) || defined(TIERED_CLOSED_SET))
+# undef PARALLEL_COMBINING
+#endif
+
+#ifdef PARALLEL_COMBINING
+
+// The Combining step is split into key ranges like the Merging step (see PARALLEL_MERGE): each part merges its range of the
+// combined file and of the expanded nodes on its own thread pool task, into segments of "closing" and "combining"
+// ("closing-<g>-<part>" and "combining-<g>-<part>"), which are appended to each other at the end. Each part counts its own
+// nodes, which are added up once all parts are done. The segments aren't preallocated, as their sizes aren't known.
+
+struct CombinePart
+{
+	uint64_t closedNodes, combinedNodes;
+#ifdef ASYNC_IO
+	double readStall, writeStall;
+#endif
+	TaskFuture future;
+};
+
+CombinePart combineParts[MERGE_PARTS];
+std::vector<std::string> combineInputNames; // the combined file, then the expanded file or chunks
+
+void combinePartThread()
+{
+	unsigned part = (unsigned)TLS_GET_THREAD_ID;
+	unsigned inputCount = (unsigned)combineInputNames.size();
+	const CombiningBufferSizes sizes(MERGE_PART_BUFFER_SIZE);
+	OpenNode* buffer = (OpenNode*)ram + part * MERGE_PART_BUFFER_SIZE;
+
+#ifndef NO_CLOSED_FILES
+	BufferedOutputStream<Node>* closed = new BufferedOutputStream<Node>;
+	closed->setWriteBuffer((Node*)buffer, sizes.closing * sizeof(OpenNode) / sizeof(Node));
+	closed->openSorted(formatFileName("closing", currentFrameGroup+1, part), true);
 #endif
 
-		static INLINE void handleChild(const State* parent, FRAME parentFrame, Step step, const CompressedState* cs, FRAME frame)
+	BufferedSplitInputStream<OpenNode>* inputs = new BufferedSplitInputStream<OpenNode>[inputCount];
+	inputs[0].setReadBuffer(buffer + sizes.closing + sizes.expanded, (uint32_t)sizes.combined);
+	size_t sizeChunk = sizes.expanded / (inputCount-1); // not empty, see combineParallel
+	for (unsigned i=1; i<inputCount; i++)
+		inputs[i].setReadBuffer(buffer + sizes.closing + (i-1)*sizeChunk, (uint32_t)sizeChunk);
+	uint64_t size = 0;
+	for (unsigned i=0; i<inputCount; i++)
+		if (mergePartStarts[i][part] < mergePartStarts[i][part+1]) // the merger skips unopened inputs
 		{
-			addState(cs, frame);
+			inputs[i].open(combineInputNames[i].c_str(), mergePartStarts[i][part], mergePartStarts[i][part+1]);
+			size += inputs[i].size();
 		}
 
-		static INLINE void handleChild(const State* parent, FRAME parentFrame, Step step, const State* state, FRAME frame)
-		{
-			CompressedState cs;
-			state->compress(&cs);
-			addState(&cs, frame);
-		}
-	};
+	DoubleOutput<OpenNode, ClosedNodeFilterOutput, BufferedOutputStream<OpenNode>>* output = new DoubleOutput<OpenNode, ClosedNodeFilterOutput, BufferedOutputStream<OpenNode>>;
+#ifndef NO_CLOSED_FILES
+	output->a()->closed = closed;
+#endif
+	output->b()->setWriteBuffer(buffer + sizes.closing + sizes.expanded + sizes.combined, (uint32_t)sizes.combining);
+	output->b()->openSorted(formatFileName("combining", currentFrameGroup+1, part), true);
+
+	if (size)
+		mergeIntoStream<OpenNode>(inputs, inputCount, output);
+
+	CombinePart* result = &combineParts[part];
+	result->closedNodes = output->a()->closedNodes;
+	result->combinedNodes = output->a()->combinedNodes;
+	output->b()->close();
+#ifdef ASYNC_IO
+	result->readStall = 0;
+	for (unsigned i=0; i<inputCount; i++)
+		result->readStall += inputs[i].readStallSeconds();
+	result->writeStall = output->b()->writeStallSeconds();
+#endif
+#ifndef NO_CLOSED_FILES
+	closed->close();
+# ifdef ASYNC_IO
+	result->writeStall += closed->writeStallSeconds();
+# endif
+	closed->clearBuffer(); // prevent bytes from Nodes from becoming junk inside OpenNode padding
+	delete closed;
+#endif
 
-	expandChildren<AddStateChildHandler>(currentFrame, &s);
-	assert(currentFrame/FRAMES_PER_GROUP == currentFrameGroup, format("Run-away currentFrameGroup: currentFrame=%u, currentFrameGroup=%u", currentFrame, currentFrameGroup));
+	delete[] inputs;
+	delete output;
 }
 
-INLINE void processFilteredState(const Node* state)
+// Returns false if the Combining step was left for combineSequential.
+bool combineParallel(bool mergedExpanded, unsigned expandedInputs)
 {
-	//closedNodesInCurrentFrameGroup++;
-#ifdef MULTITHREADING
-	queueState(state);
-#else
-	processState(state, 0);
-#endif
-}
+	if (expandedInputs == 0)
+		return false; // nothing was expanded; combinePartThread splits its buffer between the chunks
+	if (CombiningBufferSizes(MERGE_PART_BUFFER_SIZE).expanded < expandedInputs)
+		return false; // each part would need a buffer per chunk outside of "ram"
+
+	combineInputNames.clear();
+	combineInputNames.push_back(formatFileName("combined", currentFrameGroup));
+	if (mergedExpanded)
+		combineInputNames.push_back(formatFileName("expanded", currentFrameGroup));
+	else
+		for (unsigned i=0; i<expandedInputs; i++)
+			combineInputNames.push_back(formatExpandedChunkName(i));
 
-class ProcessStateOutput
-{
-public:
-	INLINE static void write(const Node* state, bool verify=false)
-	{
-		processFilteredState(state);
-	}
-	INLINE static void write(const OpenNode* node, bool verify=false)
+	mergePartStarts = new uint64_t[combineInputNames.size()][MERGE_PARTS+1];
+	bool split = splitSortedFiles(combineInputNames, mergePartStarts);
+	if (split)
 	{
-		combinedNodesTotal++;
-		if (node->frame / FRAMES_PER_GROUP == currentFrameGroup+1)
+		for (unsigned part=0; part<MERGE_PARTS; part++)
+			submitTask<combinePartThread>(part, &combineParts[part].future);
+		for (unsigned part=0; part<MERGE_PARTS; part++)
 		{
-			Node cs;
-			(PackedCompressedState&)cs = node->state;
-#ifdef GROUP_FRAMES
-			cs.subframe = node->frame % FRAMES_PER_GROUP;
+			combineParts[part].future.wait();
+			closedNodesInCurrentFrameGroup += combineParts[part].closedNodes;
+			combinedNodesTotal += combineParts[part].combinedNodes;
+#ifdef ASYNC_IO
+			combiningReadStall += combineParts[part].readStall;
+			combiningWriteStall += combineParts[part].writeStall;
 #endif
-			write(&cs);
 		}
+
+#ifndef NO_CLOSED_FILES
+		concatenateParts<Node>("closing", currentFrameGroup+1, true);
+#endif
+		concatenateParts<OpenNode>("combining", currentFrameGroup+1, true);
 	}
-	enum { WRITABLE = true };
-};
+	delete[] mergePartStarts;
+	return split;
+}
 
-class ClosedNodeFilterOutput
+#endif // PARALLEL_COMBINING
+
+#ifdef TIERED_CLOSED_SET
+
+// Drops the nodes whose states are in the closed set; of the others, writes those of the next frame group to "closing"
+// (see ClosedNodeFilterOutput), and the rest to "combining".
+class ClosedSetFilterOutput : public ClosedNodeFilterOutput
 {
 public:
-	INLINE static void write(const OpenNode* node, bool verify=false)
+	BufferedOutputStream<OpenNode> combining;
+
+	INLINE void write(const OpenNode* node, bool verify=false)
 	{
-		combinedNodesTotal++;
-		if (node->frame / FRAMES_PER_GROUP == currentFrameGroup+1)
-		{
-			Node cs;
-			(PackedCompressedState&)cs = node->state;
-#ifdef GROUP_FRAMES
-			cs.subframe = node->frame % FRAMES_PER_GROUP;
-#endif
-			closedNodeFile.write(&cs);
-			closedNodesInCurrentFrameGroup++;
-		}
+		if (closedSetContains(&node->getState()))
+			return;
+		ClosedNodeFilterOutput::write(node, verify);
+		if (node->frame / FRAMES_PER_GROUP != currentFrameGroup+1)
+			combining.write(node, verify);
+	}
+
+	INLINE void writeRun(const OpenNode* nodes, size_t count)
+	{
+		for (size_t i=0; i<count; i++)
+			write(&nodes[i]);
 	}
 	enum { WRITABLE = true };
 };
 
-void searchPrintHeader()
+// Like combineSequential, against the closed set (see Tiered closed set); the combined file only holds the nodes which
+// aren't closed.
+void combineTiered(bool mergedExpanded, unsigned expandedInputs)
 {
-	printf("Frame" GROUP_STR " " GROUP_ALIGNED_FORMAT "/" GROUP_ALIGNED_FORMAT ": ", currentFrameGroup, maxFrameGroups);
-	fflush(stdout);
-}
+	closedSetLoad(currentFrameGroup);
+	closedRunsFinishCompaction();
 
-void searchPrintNodeCounts()
-{
-	printf("%11llu nodes, %12llu total", (unsigned long long)closedNodesInCurrentFrameGroup, (unsigned long long)combinedNodesTotal);
-	fflush(stdout);
-}
+	size_t bufferSize;
+	OpenNode* buffer = combiningBuffer(&bufferSize);
+	const CombiningBufferSizes sizes(bufferSize);
 
-void searchRecalculateNodeCounts()
-{
+	closedNodeFile.setWriteBuffer((Node*)buffer, sizes.closing * sizeof(OpenNode) / sizeof(Node));
+	closedNodeFile.openSorted(formatFileName("closing", currentFrameGroup+1), true);
+#ifdef ASYNC_IO
+	combiningWriteStall -= closedNodeFile.writeStallSeconds(); // closedNodeFile is reused
+#endif
+#ifdef PREALLOCATE_COMBINING
+	uint64_t previousClosedSize;
 	{
-		InputStream<Node> getSize(formatFileName("closed", currentFrameGroup));
-		closedNodesInCurrentFrameGroup = getSize.size();
+		previousClosedSize = getFileSize(formatFileName("closed", currentFrameGroup));
+#ifdef USE_UNBUFFERED_DISK_IO
+		previousClosedSize = (previousClosedSize + 0x1FF) & -0x200;
+#endif
 	}
+	closedNodeFile.preallocate(previousClosedSize);
+#endif
+
 	{
-		InputStream<OpenNode> getSize(formatFileName("combined", currentFrameGroup));
-		combinedNodesTotal = getSize.size();
+		BufferedInputStream<OpenNode>* inputs = new BufferedInputStream<OpenNode>[1 + expandedInputs];
+		ClosedSetFilterOutput* output = new ClosedSetFilterOutput;
+
+		if (mergedExpanded)
+		{
+			inputs[1].setReadBuffer(buffer + sizes.closing, sizes.expanded);
+			inputs[1].open(formatFileName("expanded", currentFrameGroup));
+		}
+		else
+		{
+			// if the share of each chunk is empty, the inputs allocate the standard buffer size outside of "ram"
+			size_t sizeChunk = expandedInputs ? sizes.expanded / expandedInputs : 0;
+			for (unsigned i=0; i<expandedInputs; i++)
+			{
+				if (sizeChunk)
+					inputs[1+i].setReadBuffer(buffer + sizes.closing + i*sizeChunk, (uint32_t)sizeChunk);
+				inputs[1+i].open(formatExpandedChunkName(i));
+			}
+		}
+
+		inputs[0].setReadBuffer(buffer + sizes.closing + sizes.expanded, sizes.combined);
+		inputs[0].open(formatFileName("combined", currentFrameGroup));
+
+		output->combining.setWriteBuffer(buffer + sizes.closing + sizes.expanded + sizes.combined, (uint32_t)sizes.combining);
+		output->combining.openSorted(formatFileName("combining", currentFrameGroup+1), true);
+#ifdef PREALLOCATE_COMBINING
+		uint64_t previousCombinedSize;
+		{
+			previousCombinedSize = getFileSize(formatFileName("combined", currentFrameGroup));
+#ifdef USE_UNBUFFERED_DISK_IO
+			previousCombinedSize = (previousCombinedSize + 0x1FF) & -0x200;
+#endif
+		}
+		output->combining.preallocate(previousCombinedSize);
+#endif
+
+#ifdef PIPELINED_EXPANSION
+		if (expansionPipelined)
+			startPipelinedExpansion();
+#endif
+		mergeIntoStream<OpenNode>(inputs, 1 + expandedInputs, output);
+		output->addCounts();
+		combinedNodesTotal += closedSetNodes();
+		output->combining.close();
+#ifdef ASYNC_IO
+		for (unsigned i=0; i<1 + expandedInputs; i++)
+			combiningReadStall += inputs[i].readStallSeconds();
+		combiningWriteStall += output->combining.writeStallSeconds();
+#endif
+		delete[] inputs;
+		delete output;
 	}
+	closedSetEndLookups();
+
+	closedNodeFile.close();
+#ifdef ASYNC_IO
+	combiningWriteStall += closedNodeFile.writeStallSeconds();
+#endif
+	closedNodeFile.clearBuffer(); // prevent bytes from Nodes from becoming junk inside OpenNode padding
 }
 
-const size_t RELATIVE_SIZE_CLOSING   =  20;
-const size_t RELATIVE_SIZE_EXPANDED  = 142;
-const size_t RELATIVE_SIZE_COMBINED  = 189;
-const size_t RELATIVE_SIZE_COMBINING = 234;
+#endif // TIERED_CLOSED_SET
 
 int search()
 {
@@ -3533,6 +5652,14 @@ int search()
 			break;
 	    }
 
+#ifdef STATE_CACHE_SHARE
+	initStateCache();
+#endif
+
+#ifdef TIERED_CLOSED_SET
+	struct ClosedSetFlush { ~ClosedSetFlush() { closedSetFlush(currentFrameGroup); } } closedSetFlushOnReturn;
+#endif
+
 	timeb time0;
 	ftime(&time0);
 
@@ -3560,6 +5687,9 @@ int search()
 			OutputStream<OpenNode> output(formatFileName("combining", currentFrameGroup), false);
 			output.write(initialCompressedStates, combinedNodesTotal);
 		}
+#ifdef NO_CLOSED_FILES
+		closedNodesInCurrentFrameGroup = combinedNodesTotal;
+#else
 		{
 			Node* initialCompressedStates = (Node*)ram;
 			for (int i=0; i<initialStateCount; i++)
@@ -3575,8 +5705,11 @@ int search()
 			OutputStream<Node> output(formatFileName("closing", currentFrameGroup), false);
 			output.write(initialCompressedStates, closedNodesInCurrentFrameGroup);
 		}
-		renameFile(formatFileName("combining", currentFrameGroup), formatFileName("combined", currentFrameGroup));
-		renameFile(formatFileName("closing", currentFrameGroup), formatFileName("closed", currentFrameGroup));
+#endif
+		renameNodeFile(formatFileName("combining", currentFrameGroup), formatFileName("combined", currentFrameGroup));
+#ifndef NO_CLOSED_FILES
+		renameNodeFile(formatFileName("closing", currentFrameGroup), formatFileName("closed", currentFrameGroup));
+#endif
 	}
 	else
 	if (fileExists(formatFileName("expanded", currentFrameGroup)))
@@ -3604,16 +5737,22 @@ int search()
 
 		InputStream<unsigned> resumeInfo(formatFileName("expandedcount", currentFrameGroup));
 		resumeInfo.read(&expansionChunks, 1);
+		if (resumeInfo.read(&expansionFirstChunk, 1) != 1) // only written by intermediate merge passes
+			expansionFirstChunk = 0;
+		expansionFrameGroup = currentFrameGroup;
 
 		time2 = time1;
 
 		goto skipToMerging;
 	}
-	else	
+	else
+#ifndef NO_CLOSED_FILES
 	if (fileExists(formatFileName("closed", currentFrameGroup)))
+#endif
 	{
 		searchRecalculateNodeCounts();
 	}
+#ifndef NO_CLOSED_FILES
 	else
 	{
 		searchPrintHeader();
@@ -3629,7 +5768,7 @@ int search()
 		                             (OPENNODE_BUFFER_SIZE - sizeClosing) * RELATIVE_SIZE_COMBINING / (                        RELATIVE_SIZE_COMBINING) : 1;
 
 		closedNodeFile.setWriteBuffer((Node*)ram, sizeClosing * sizeof(OpenNode) / sizeof(Node));
-		closedNodeFile.open(formatFileName("closing", currentFrameGroup), false);
+		closedNodeFile.openSorted(formatFileName("closing", currentFrameGroup), true);
 
 		ClosedNodeFilterOutput output;
 
@@ -3638,14 +5777,16 @@ int search()
 		input.open(formatFileName("combined", currentFrameGroup));
 
 		copyStream<OpenNode>(&input, &output);
+		output.addCounts();
 
 		closedNodeFile.flush();
 		closedNodeFile.close();
 		closedNodeFile.clearBuffer(); // prevent bytes from Nodes from becoming junk inside OpenNode padding
-		renameFile(formatFileName("closing", currentFrameGroup), formatFileName("closed", currentFrameGroup));
+		renameNodeFile(formatFileName("closing", currentFrameGroup), formatFileName("closed", currentFrameGroup));
 
 		putchar('\n');
 	}
+#endif
 
 	for (;; currentFrameGroup++)
 	{
@@ -3655,28 +5796,62 @@ int search()
 		if (currentFrameGroup >= maxFrameGroups)
 			break;
 
-		if (checkStop(true))
+		if (!expansionPipelined && checkStop(true)) // a pipelined expansion is finished first
 			return EXIT_STOP;
 
 		printf("; Expanding..."); fflush(stdout);
+#ifdef ASYNC_IO
+		double expansionReadStall;
+#endif
 
+#ifdef PIPELINED_EXPANSION
+		if (expansionPipelined)
 		{
+			flushProcessingQueue();
+			expansionWriteFinalChunk();
+			expansionPipelined = false;
+# ifdef ASYNC_IO
+			expansionReadStall = 0; // the Combining step's reads are counted there
+# endif
+		}
+		else
+#endif
+		{
+#ifdef MULTITHREADING
+			ExpansionInput input; // allocate buffers outside of "ram"; reserve "ram" exclusively for expansion
+# ifdef NO_CLOSED_FILES
+			input.setReadBufferSize(CLOSED_IN_BUFFER_SIZE * sizeof(Node) / sizeof(OpenNode));
+			input.open(formatFileName("combined", currentFrameGroup), currentFrameGroup);
+# else
+			input.setReadBufferSize(CLOSED_IN_BUFFER_SIZE);
+			input.open(formatFileName("closed", currentFrameGroup));
+# endif
+#else
+# ifdef NO_CLOSED_FILES
+			ClosedNodeFilterInput<> input(CLOSED_IN_BUFFER_SIZE * sizeof(Node) / sizeof(OpenNode)); // allocate buffer outside of "ram"; reserve "ram" exclusively for expansion
+			input.open(formatFileName("combined", currentFrameGroup), currentFrameGroup);
+# else
 			BufferedInputStream<Node> input(CLOSED_IN_BUFFER_SIZE); // allocate buffer outside of "ram"; reserve "ram" exclusively for expansion
 			input.open(formatFileName("closed", currentFrameGroup));
+# endif
+#endif
 
-			ProcessStateOutput output;
-
-			initExpansion();
+			initExpansion(currentFrameGroup);
+#ifdef STATE_CACHE_SHARE
+			resetStateCacheStats();
+#endif
 
 #ifdef MULTITHREADING
-			startWorkers<&processState,&expansionSortFinalRegions>();
-#endif
+			expandSlices(&input);
+#else
+			ProcessStateOutput output;
 			copyStream<Node>(&input, &output);
-#ifdef MULTITHREADING
-			flushProcessingQueue();
 #endif
 
 			expansionWriteFinalChunk();
+#ifdef ASYNC_IO
+			expansionReadStall = input.readStallSeconds();
+#endif
 
 			//input.clearBuffer(); // prevent bytes from Nodes from becoming junk inside OpenNode padding
 		}
@@ -3685,8 +5860,10 @@ int search()
 			OutputStream<unsigned> resumeInfo(formatFileName("expandedcount", currentFrameGroup), false);
 			resumeInfo.write(&expansionChunks, 1);
 		}
+#ifndef NO_CLOSED_FILES
 		if (closedNodesInCurrentFrameGroup==0)
-			deleteFile(formatFileName("closed", currentFrameGroup));
+			deleteNodeFile(formatFileName("closed", currentFrameGroup));
+#endif
 
 		if (exitFound)
 		{
@@ -3702,6 +5879,19 @@ int search()
 		{
 			int ms = (int)((time2.time - time1.time)*1000 + (time2.millitm - time1.millitm));
 			printf("%4d.%03d s", ms/1000, ms%1000);
+#ifdef MULTITHREADING
+			printf(" (%.3f s blocked, %llu duplicates dropped", expansionBlockedSeconds(), (unsigned long long)expansionDuplicates());
+# ifdef BACKGROUND_MERGE
+			printf(", %u chunks merged in background", backgroundMergedChunks);
+# endif
+# ifdef ASYNC_IO
+			printf(", %.3f s waiting for reads", expansionReadStall);
+# endif
+# ifdef STATE_CACHE_SHARE
+			printf(", %.1f%% cache hits", stateCacheHitRate() * 100);
+# endif
+			printf(")");
+#endif
 		}
 
 		if (checkStop(true))
@@ -3712,16 +5902,24 @@ int search()
 	skipToMerging:
 
 		printf("Merging..."); fflush(stdout);
+#ifdef MERGE_WHILE_COMBINING
+		mergeExpandedPasses(); // the chunks (and expandedcount, for resuming) stay until Combining is done
+#else
 		mergeExpanded();
 
 #ifndef KEEP_PAST_FILES
 		deleteFile(formatFileName("expandedcount", currentFrameGroup));
+#endif
 #endif
 
 		ftime(&time3);
 		{
+#ifdef MERGE_WHILE_COMBINING
+			uint64_t expandedNodes = expandedChunkNodes();
+#else
 			InputStream<OpenNode> getSize(formatFileName("expanded", currentFrameGroup));
 			uint64_t expandedNodes = getSize.size();
+#endif
 
 			int ms = (int)((time3.time - time2.time)*1000 + (time3.millitm - time2.millitm));
 			printf("%4d.%03d s, %12llu nodes", ms/1000, ms%1000, (unsigned long long)expandedNodes);
@@ -3739,63 +5937,52 @@ int search()
 		
 		printf("Combining..."); fflush(stdout);
 
-		const size_t sizeClosing  =    (OPENNODE_BUFFER_SIZE                                            ) * RELATIVE_SIZE_CLOSING   / (RELATIVE_SIZE_CLOSING + RELATIVE_SIZE_EXPANDED + RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING) ?
-		                               (OPENNODE_BUFFER_SIZE                                            ) * RELATIVE_SIZE_CLOSING   / (RELATIVE_SIZE_CLOSING + RELATIVE_SIZE_EXPANDED + RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING) : 1;
-		const size_t sizeExpanded =    (OPENNODE_BUFFER_SIZE - sizeClosing                              ) * RELATIVE_SIZE_EXPANDED  / (                        RELATIVE_SIZE_EXPANDED + RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING) ?
-		                               (OPENNODE_BUFFER_SIZE - sizeClosing                              ) * RELATIVE_SIZE_EXPANDED  / (                        RELATIVE_SIZE_EXPANDED + RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING) : 1;
-		const size_t sizeCombined =    (OPENNODE_BUFFER_SIZE - sizeClosing - sizeExpanded               ) * RELATIVE_SIZE_COMBINED  / (                                                 RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING) ?
-		                               (OPENNODE_BUFFER_SIZE - sizeClosing - sizeExpanded               ) * RELATIVE_SIZE_COMBINED  / (                                                 RELATIVE_SIZE_COMBINED + RELATIVE_SIZE_COMBINING) : 1;
-		const size_t sizeCombinedNew = (OPENNODE_BUFFER_SIZE - sizeClosing - sizeExpanded - sizeCombined) * RELATIVE_SIZE_COMBINING / (                                                                          RELATIVE_SIZE_COMBINING) ?
-		                               (OPENNODE_BUFFER_SIZE - sizeClosing - sizeExpanded - sizeCombined) * RELATIVE_SIZE_COMBINING / (                                                                          RELATIVE_SIZE_COMBINING) : 1;
-
-		closedNodeFile.setWriteBuffer((Node*)ram, sizeClosing * sizeof(OpenNode) / sizeof(Node));
-		closedNodeFile.open(formatFileName("closing", currentFrameGroup+1), false);
-#ifdef PREALLOCATE_COMBINING
-		uint64_t previousClosedSize;
-		{
-			previousClosedSize = getFileSize(formatFileName("closed", currentFrameGroup));
-#ifdef USE_UNBUFFERED_DISK_IO
-			previousClosedSize = (previousClosedSize + 0x1FF) & -0x200;
+#ifdef MERGE_WHILE_COMBINING
+		// Resuming a frame group whose chunks were already merged (by a build without MERGE_WHILE_COMBINING) also works.
+		bool mergedExpanded = fileExists(formatFileName("expanded", currentFrameGroup));
+		unsigned expandedInputs = mergedExpanded ? 1 : expansionChunks;
+		unsigned expandedFirstChunk = expansionFirstChunk; // a pipelined expansion renumbers the chunks while they are combined
+#else
+		const bool mergedExpanded = true;
+		const unsigned expandedInputs = 1;
 #endif
-		}
-		closedNodeFile.preallocate(previousClosedSize);
+#ifdef ASYNC_IO
+		combiningReadStall = combiningWriteStall = 0;
+#endif
+#ifdef PIPELINED_EXPANSION
+		expansionPipelined = currentFrameGroup+1 < maxFrameGroups;
 #endif
 
-		{
-			BufferedInputStream<OpenNode> inputs[2];
-			DoubleOutput<OpenNode, ClosedNodeFilterOutput, BufferedOutputStream<OpenNode>> output;
-
-			inputs[1].setReadBuffer((OpenNode*)ram + sizeClosing, sizeExpanded);
-			inputs[1].open(formatFileName("expanded", currentFrameGroup));
-
-			inputs[0].setReadBuffer((OpenNode*)ram + sizeClosing + sizeExpanded, sizeCombined);
-			inputs[0].open(formatFileName("combined", currentFrameGroup));
+#ifdef TIERED_CLOSED_SET
+		combineTiered(mergedExpanded, expandedInputs);
+#else
+# ifdef PARALLEL_COMBINING
+		if (expansionPipelined || !combineParallel(mergedExpanded, expandedInputs)) // only the main thread can queue nodes
+# endif
+			combineSequential(mergedExpanded, expandedInputs);
+#endif
 
-			output.b()->setWriteBuffer((OpenNode*)ram + sizeClosing + sizeExpanded + sizeCombined, (uint32_t)sizeCombinedNew);
-			output.b()->open(formatFileName("combining", currentFrameGroup+1), false);
-#ifdef PREALLOCATE_COMBINING
-			uint64_t previousCombinedSize;
-			{
-				previousCombinedSize = getFileSize(formatFileName("combined", currentFrameGroup));
-#ifdef USE_UNBUFFERED_DISK_IO
-				previousCombinedSize = (previousCombinedSize + 0x1FF) & -0x200;
+#ifndef NO_CLOSED_FILES
+		renameNodeFile(formatFileName("closing", currentFrameGroup+1), formatFileName("closed", currentFrameGroup+1));
 #endif
-			}
-			output.b()->preallocate(previousCombinedSize);
+#ifdef TIERED_CLOSED_SET
+		closedSetCommit(currentFrameGroup+1);
 #endif
-
-			mergeStreams<OpenNode>(inputs, 2, &output);
-		}
-
-		closedNodeFile.close();
-		closedNodeFile.clearBuffer(); // prevent bytes from Nodes from becoming junk inside OpenNode padding
-		renameFile(formatFileName("closing", currentFrameGroup+1), formatFileName("closed", currentFrameGroup+1));
 #ifndef KEEP_PAST_FILES
-		deleteFile(formatFileName("combined", currentFrameGroup));
+		deleteNodeFile(formatFileName("combined", currentFrameGroup));
 #endif
-		renameFile(formatFileName("combining", currentFrameGroup+1), formatFileName("combined", currentFrameGroup+1));
+		renameNodeFile(formatFileName("combining", currentFrameGroup+1), formatFileName("combined", currentFrameGroup+1));
 #ifndef KEEP_PAST_FILES
-		deleteFile(formatFileName("expanded", currentFrameGroup));
+		if (mergedExpanded)
+			deleteNodeFile(formatFileName("expanded", currentFrameGroup));
+# ifdef MERGE_WHILE_COMBINING
+		else
+		{
+			for (unsigned i=0; i<expandedInputs; i++)
+				deleteNodeFile(formatFileName("expanded", currentFrameGroup, expandedFirstChunk + i));
+			deleteFile(formatFileName("expandedcount", currentFrameGroup));
+		}
+# endif
 #endif
 
 		timeb time4;
@@ -3808,6 +5995,9 @@ int search()
 			printf("%4d.%03d s (%4d.%03d s, %6d.%03d s)", ms/1000, ms%1000, ms_total/1000, ms_total%1000, ms_running/1000, ms_running%1000);
 #else
 			printf("%4d.%03d s (%4d.%03d s)", ms/1000, ms%1000, ms_total/1000, ms_total%1000);
+#endif
+#ifdef ASYNC_IO
+			printf(" (%.3f s waiting for reads, %.3f s for writes)", combiningReadStall, combiningWriteStall);
 #endif
 		}
 		time1 = time4;
@@ -4053,7 +6243,7 @@ int sample(FRAME_GROUP g, unsigned count)
 	if (!fileExists(fn))
 		error(format("Can't find neither open nor closed node file for frame" GROUP_STR " " GROUP_FORMAT, g));
 	
-	InputStream<Node> in(fn);
+	NodeInputStream<Node> in(fn);
 	srand((unsigned)time(NULL));
 	for (unsigned i=0; i<count; i++)
 	{
@@ -4573,6 +6763,179 @@ int writePartialSolution()
 	return EXIT_OK;
 }
 
+// ****************************************** Benchmark-merge *******************************************
+
+class CountingOutput
+{
+public:
+	enum { WRITABLE = true };
+	uint64_t count;
+
+	CountingOutput() : count(0) {}
+
+	template<class NODE>
+	INLINE void write(const NODE*, bool=false) { count++; }
+
+	template<class NODE>
+	INLINE void writeRun(const NODE* nodes, size_t n) { count += n; }
+};
+
+double benchmarkSeconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - start).count();
+}
+
+template<class MERGER>
+double benchmarkMergeRuns(OpenNode* runs, const HeapNode* runRanges, unsigned count, uint64_t* written)
+{
+	HeapNode* ranges = new HeapNode[count]; // owned by the merger
+	memcpy(ranges, runRanges, count * sizeof(HeapNode));
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	CountingOutput output;
+	{
+		MERGER merger(runs, ranges, count);
+		mergeDeduplicated<OpenNode>(&merger, &output);
+	}
+	*written = output.count;
+	return benchmarkSeconds(start);
+}
+
+template<class MERGER>
+double benchmarkMergeFiles(unsigned count, uint64_t* written)
+{
+	BufferedInputStream<OpenNode>* inputs = new BufferedInputStream<OpenNode>[count];
+	uint32_t bufferSize = (uint32_t)(OPENNODE_BUFFER_SIZE / count);
+	for (unsigned i=0; i<count; i++)
+	{
+		inputs[i].setReadBuffer((OpenNode*)ram + i*bufferSize, bufferSize);
+		inputs[i].open(formatFileName("benchmark", i));
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	CountingOutput output;
+	{
+		MERGER merger(inputs, count);
+		mergeDeduplicated<OpenNode>(&merger, &output);
+	}
+	double seconds = benchmarkSeconds(start);
+	delete[] inputs;
+	*written = output.count;
+	return seconds;
+}
+
+// Merges the benchmark files into another file, node by node (mergeDeduplicated) or galloping (mergeStreams).
+double benchmarkMergeFilesToFile(unsigned count, bool galloping, uint64_t* written)
+{
+	BufferedInputStream<OpenNode>* inputs = new BufferedInputStream<OpenNode>[count];
+	uint32_t bufferSize = (uint32_t)(OPENNODE_BUFFER_SIZE / count);
+	for (unsigned i=0; i<count; i++)
+	{
+		inputs[i].setReadBuffer((OpenNode*)ram + i*bufferSize, bufferSize);
+		inputs[i].open(formatFileName("benchmark", i));
+	}
+	BufferedOutputStream<OpenNode>* output = new BufferedOutputStream<OpenNode>(formatFileName("benchmarkout")); // allocate buffer outside of "ram"
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (galloping)
+		mergeStreams<OpenNode>(inputs, count, output);
+	else
+	{
+		InputLoserTree<BufferedInputStream<OpenNode>, OpenNode> tree(inputs, count);
+		mergeDeduplicated<OpenNode>(&tree, output);
+	}
+	*written = output->size();
+	output->close();
+	double seconds = benchmarkSeconds(start);
+	delete output;
+	delete[] inputs;
+	deleteFile(formatFileName("benchmarkout"));
+	return seconds;
+}
+
+// Fills run with random nodes, sorts them and drops duplicates (files must not contain any). Returns the number of nodes left.
+unsigned benchmarkMakeRun(OpenNode* run, unsigned size, uint64_t* seed)
+{
+	for (unsigned n=0; n<size; n++)
+		for (unsigned b=0; b<sizeof(OpenNode); b++)
+		{
+			*seed ^= *seed << 13; *seed ^= *seed >> 7; *seed ^= *seed << 17; // xorshift64
+			((uint8_t*)&run[n])[b] = (uint8_t)*seed;
+		}
+	std::sort(run, run + size);
+	return (unsigned)(std::unique(run, run + size) - run);
+}
+
+// Times the binary heaps against the loser trees on random sorted runs, first merged in RAM (as when writing expanded
+// chunks), then from files (as in the Merging and Combining steps; the files are most likely still in the OS cache).
+// Then times galloping merges against node-by-node ones, on files where one input is much bigger than the others
+// (as the combined file in the Combining step of late frames).
+int benchmarkMerge()
+{
+	const unsigned inputCounts[] = { 2, 16, 256 };
+	uint64_t total = OPENNODE_BUFFER_SIZE < 0x1000000 ? OPENNODE_BUFFER_SIZE : 0x1000000;
+	OpenNode* runs = (OpenNode*)ram;
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+	for (unsigned c=0; c<sizeof(inputCounts)/sizeof(inputCounts[0]); c++)
+	{
+		unsigned count = inputCounts[c];
+		unsigned runSize = (unsigned)(total / count);
+		HeapNode* ranges = new HeapNode[count];
+		for (unsigned i=0; i<count; i++)
+		{
+			OpenNode* run = runs + i*runSize;
+			ranges[i].pos = i*runSize;
+			ranges[i].end = i*runSize + benchmarkMakeRun(run, runSize, &seed);
+			OutputStream<OpenNode>(formatFileName("benchmark", i)).write(run, ranges[i].end - ranges[i].pos);
+		}
+
+		uint64_t heapWritten, treeWritten;
+		printf("%3u inputs of %u nodes: in RAM: ", count, runSize);
+		double heapSeconds = benchmarkMergeRuns<InputHeapChunked<OpenNode, 1> >(runs, ranges, count, &heapWritten);
+		double treeSeconds = benchmarkMergeRuns<InputLoserTreeChunked<OpenNode, 1> >(runs, ranges, count, &treeWritten);
+		delete[] ranges;
+		if (heapWritten != treeWritten)
+			error("Merge results differ");
+		printf("heap %.3f s, loser tree %.3f s (%.2fx); ", heapSeconds, treeSeconds, heapSeconds / treeSeconds);
+		fflush(stdout);
+
+		heapSeconds = benchmarkMergeFiles<InputHeap<BufferedInputStream<OpenNode>, OpenNode> >(count, &heapWritten);
+		treeSeconds = benchmarkMergeFiles<InputLoserTree<BufferedInputStream<OpenNode>, OpenNode> >(count, &treeWritten);
+		if (heapWritten != treeWritten)
+			error("Merge results differ");
+		printf("from files: heap %.3f s, loser tree %.3f s (%.2fx)\n", heapSeconds, treeSeconds, heapSeconds / treeSeconds);
+
+		for (unsigned i=0; i<count; i++)
+			deleteFile(formatFileName("benchmark", i));
+	}
+
+	const unsigned skews[] = { 10, 1000 };
+	const unsigned skewedInputCounts[] = { 2, 16 };
+	for (unsigned k=0; k<sizeof(skews)/sizeof(skews[0]); k++)
+		for (unsigned c=0; c<sizeof(skewedInputCounts)/sizeof(skewedInputCounts[0]); c++)
+		{
+			unsigned count = skewedInputCounts[c];
+			unsigned smallSize = (unsigned)(total / skews[k] / (count-1));
+			unsigned bigSize = (unsigned)(total - smallSize * (count-1));
+			for (unsigned i=0; i<count; i++)
+			{
+				unsigned n = benchmarkMakeRun(runs, i ? smallSize : bigSize, &seed);
+				OutputStream<OpenNode>(formatFileName("benchmark", i)).write(runs, n);
+			}
+
+			uint64_t nodeWritten, gallopWritten;
+			printf("  1 input of %u nodes and %u of %u nodes, from files: ", bigSize, count-1, smallSize);
+			fflush(stdout);
+			double nodeSeconds   = benchmarkMergeFilesToFile(count, false, &nodeWritten);
+			double gallopSeconds = benchmarkMergeFilesToFile(count, true, &gallopWritten);
+			if (nodeWritten != gallopWritten)
+				error("Merge results differ");
+			printf("node by node %.3f s, galloping %.3f s (%.2fx)\n", nodeSeconds, gallopSeconds, nodeSeconds / gallopSeconds);
+
+			for (unsigned i=0; i<count; i++)
+				deleteFile(formatFileName("benchmark", i));
+		}
+	return EXIT_OK;
+}
+
 // ***************************************** Win32 idle watcher *****************************************
 
 // use background CPU and I/O priority when PC is not idle
@@ -4789,6 +7152,10 @@ where <mode> is one of:\n\
 		solution file. Allows exit tracing inspection. Warning: uses\n\
 		the same code as when writing the full solution, and may\n\
 		overwrite an existing solution.\n\
+	benchmark-merge\n\
+		Times merging 2, 16 and 256 sorted runs of random nodes with\n\
+		binary heaps and with loser trees, and merging one big run with\n\
+		small ones node by node and galloping.\n\
 A [frame" GROUP_STR "-range] is a space-delimited list of zero, one or two frame" GROUP_STR "\n\
 numbers. If zero numbers are specified, the range is assumed to be all\n\
 frame" GROUP_STR "s. If one number is specified, the range is set to only that\n\
@@ -4812,12 +7179,16 @@ int run(int argc, const char* argv[])
 #endif
 
 #ifdef MULTITHREADING
-	printf("Using %u " PLUGIN_THREAD " threads (with %u node chunks) with " PLUGIN_SYNC " sync and " PLUGIN_TLS " TLS\n", THREADS, QUEUE_CHUNK_SIZE);
+	printf("Using %u " PLUGIN_THREAD " threads (with %u node chunks, %u pooled) with " PLUGIN_SYNC " sync and " PLUGIN_TLS " TLS\n", THREADS, QUEUE_CHUNK_SIZE, (unsigned)THREAD_POOL_SIZE);
+	startThreadPool();
 #endif
 	
 	printf("Compressed state is %u bits (%u bytes data, %u bytes per closed node, %u bytes per open node)\n", COMPRESSED_BITS, COMPRESSED_BYTES, (unsigned)sizeof(Node), (unsigned)sizeof(OpenNode));
 #ifdef SLOW_COMPARE
 	printf("Using memcmp for CompressedState comparison\n");
+#endif
+#ifdef USE_RADIX_SORT
+	printf("Using radix sort for expanded nodes\n");
 #endif
 	testCompressedState();
 
@@ -4832,11 +7203,30 @@ int run(int argc, const char* argv[])
 	printf(" with Windows disk I/O buffering\n");
 # endif
 #elif defined(DISK_POSIX)
-	printf("Using POSIX files\n");
+	printf("Using POSIX files");
+# ifdef USE_UNBUFFERED_DISK_IO
+	printf(" with unbuffered disk I/O (O_DIRECT)\n");
+# else
+	printf("\n");
+# endif
 #elif defined(DISK_C)
 	printf("Using C files\n");
+#elif defined(DISK_URING)
+	printf("Using io_uring files (queue depth %u", URING_QUEUE_DEPTH);
+# ifdef URING_REGISTER_RAM
+	printf(", registered buffers");
+# endif
+	printf(")\n");
+#elif defined(DISK_MMAP)
+	printf("Using memory-mapped files\n");
 #else
 # error Disk plugin not set
+#endif
+#ifdef DELTA_CODED_FILES
+	printf("Using delta-coded closed and combined node files (%u nodes per block)\n", DELTA_BLOCK_NODES);
+#endif
+#ifdef NODE_INDEX
+	printf("Using key indexes of sorted node files (every %u nodes)\n", NODE_INDEX_INTERVAL);
 #endif
 
 	if (fileExists(formatProblemFileName("stop", NULL, "txt")))
@@ -4971,6 +7361,11 @@ int run(int argc, const char* argv[])
 		return writePartialSolution();
 	}
 	else
+	if (argc>1 && strcmp(argv[1], "benchmark-merge")==0)
+	{
+		return benchmarkMerge();
+	}
+	else
 	{
 		printf("%s", usage);
 		return EXIT_OK;
@@ -1,28 +1,32 @@
+// Condition for the spinlock-based plugins. Waiters block on the notification counter with WaitOnAddress
+// (requires Windows 8+), so they wake up as soon as they are notified instead of polling.
+
+#pragma comment(lib, "Synchronization.lib")
+
 class Condition
 {
 private:
-	volatile int x;
+	volatile LONG x;
 public:
 	Condition() : x(0) {}
 
-	void wait(ScopedLock<false>& lock)
+	void wait(SCOPED_LOCK& lock)
 	{
-		int old = x;
-		do
-		{
-			lock.unlock();
-			SLEEP(1);
-			lock.lock();
-		} while (old == x);
+		LONG old = x;
+		lock.unlock();
+		while (x == old)
+			WaitOnAddress(&x, &old, sizeof(x), INFINITE);
+		lock.lock();
 	}
 	
-	void notify(ScopedLock<false>& lock) // must be synchronized
+	void notify(SCOPED_LOCK& lock) // must be synchronized
 	{
 #ifdef DEBUG
 		if (!lock.locked)
 			throw "Unsynchronized notify";
 #endif
-		x++;
+		InterlockedIncrement(&x);
+		WakeByAddressAll((PVOID)&x);
 	}
 };
 
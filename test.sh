@@ -8,12 +8,11 @@ for USE_MEMCMP                 in false true ; do
 for THREAD                     in THREAD_{STD,BOOST,WINAPI} ; do
 for SYNC                       in SYNC_{STD,BOOST,WINAPI,WINAPI_SPIN,INTEL_SPIN} ; do
 for TLS                        in TLS_{COMPILER,WINAPI,BOOST} ; do
-for DISK                       in DISK_{WINFILES,POSIX,C} ; do
+for DISK                       in DISK_{WINFILES,POSIX,C,URING,MMAP} ; do
 for USE_UNBUFFERED_DISK_IO     in false true ; do
 for MULTITHREADING             in false true ; do
 for PREALLOCATE_COMBINING      in false true ; do
 for DEBUG_EXPANSION            in false true ; do
-# for ENABLE_EXPANSION_SPILLOVER in false true ; do
 for USE_ALL                    in false true ; do
 
 	echo "=============================================================="
@@ -29,7 +28,6 @@ for USE_ALL                    in false true ; do
 		printf -- 'MULTITHREADING=%-5s ' "$MULTITHREADING"
 		printf -- 'PREALLOCATE_COMBINING=%-5s ' "$PREALLOCATE_COMBINING"
 		printf -- 'DEBUG_EXPANSION=%-5s ' "$DEBUG_EXPANSION"
-		# printf -- 'ENABLE_EXPANSION_SPILLOVER=%-5s ' "$ENABLE_EXPANSION_SPILLOVER"
 		printf -- 'USE_ALL=%-5s ' "$USE_ALL"
 	)
 	echo "$line"
@@ -44,7 +42,17 @@ for USE_ALL                    in false true ; do
 		echo "$line: Skipped" >> report.txt
 		continue
 	fi
-	if [[ "$DISK" == DISK_C ]] && $USE_UNBUFFERED_DISK_IO ; then
+	if [[ "$DISK" == DISK_MMAP && "$OS" == windows-* ]] ; then
+		echo "Skipping (OS incompatibility)"
+		echo "$line: Skipped" >> report.txt
+		continue
+	fi
+	if [[ "$DISK" == DISK_URING && ( "$OS" == windows-* || "$OS" == macos-* ) ]] ; then
+		echo "Skipping (OS incompatibility)"
+		echo "$line: Skipped" >> report.txt
+		continue
+	fi
+	if [[ "$DISK" == DISK_C || "$DISK" == DISK_URING || "$DISK" == DISK_MMAP ]] && $USE_UNBUFFERED_DISK_IO ; then
 		echo "Skipping (unsupported configuration)"
 		echo "$line: Skipped" >> report.txt
 		continue
@@ -73,12 +81,6 @@ for USE_ALL                    in false true ; do
 		echo "$line: TODO!" >> report.txt
 		continue
 	fi
-	if [[ "$DISK" == DISK_POSIX ]] && $USE_UNBUFFERED_DISK_IO ; then
-		# disk_file_posix.cpp:71:2: error: Unfinished, TODO
-		echo "Skipping (TODO)"
-		echo "$line: TODO!" >> report.txt
-		continue
-	fi
 	if [[ "$line" == *_BOOST* && "$OS" == windows-* ]] ; then
 		# https://github.com/CyberShadow/DDD/issues/3
 		echo "Skipping (TODO)"
@@ -114,12 +116,11 @@ for USE_ALL                    in false true ; do
 		-e '#define THREAD_\(STD\|BOOST\|WINAPI\)\b'
 		-e '#define SYNC_\(STD\|BOOST\|WINAPI\|WINAPI_SPIN\|INTEL_SPIN\)\b'
 		-e '#define TLS_\(COMPILER\|WINAPI\|BOOST\)\b'
-		-e '#define DISK_\(WINFILES\|POSIX\|C\)\b'
+		-e '#define DISK_\(WINFILES\|POSIX\|C\|URING\|MMAP\)\b'
 		-e '#define USE_UNBUFFERED_DISK_IO\b'
 		-e '#define MULTITHREADING\b'
 		-e '#define PREALLOCATE_COMBINING\b'
 		-e '#define DEBUG_EXPANSION\b'
-		# -e '#define ENABLE_EXPANSION_SPILLOVER\b'
 		-e '#define USE_ALL\b'
 	)
 	(
@@ -135,7 +136,6 @@ for USE_ALL                    in false true ; do
 		if $MULTITHREADING             ; then echo "#define MULTITHREADING"             ; fi
 		if $PREALLOCATE_COMBINING      ; then echo "#define PREALLOCATE_COMBINING"      ; fi
 		if $DEBUG_EXPANSION            ; then echo "#define DEBUG_EXPANSION"            ; fi
-		# if $ENABLE_EXPANSION_SPILLOVER ; then echo "#define ENABLE_EXPANSION_SPILLOVER" ; fi
 		if $USE_ALL                    ; then echo "#define USE_ALL"                    ; fi
 	) > config.h
 
@@ -187,7 +187,6 @@ for USE_ALL                    in false true ; do
 	echo OK
 	echo "$line: OK" >> report.txt
 done
-# done
 done
 done
 done
@@ -199,6 +198,166 @@ done
 done
 done
 
+# SampleGrid's exit can't be reached, so the search ends by running out of nodes, and its frame groups are big enough
+# to be split between workers. The small RAM_SIZE and expansion slots make each frame group's expansion write several
+# chunks, so that the Merging step has something to split; some frame groups expand to nothing. Every run must go
+# through the same nodes as the first one, and not find the exit.
+
+reference=
+
+# Builds and runs SampleGrid with the given defines (besides those below), and checks that it goes through the same nodes
+# as the first run.
+function sampleGrid() {
+	local line=$1
+	shift
+
+	args=(grep -v
+		-e '#define PROBLEM\b'
+		-e '#define DISK_\(WINFILES\|POSIX\|C\|URING\|MMAP\)\b'
+		-e '#define PREALLOCATE_COMBINING\b'
+		-e '#define SYNC_INTEL_SPIN\b'
+		-e '#define RAM_SIZE\b'
+		-e '#define EXPANSION_NODES_PER_QUEUE_ELEMENT\b'
+		-e '#define EXPANSION_BUFFER_FILL_RATIO\b'
+	)
+	local define
+	for define in "$@" ; do
+		args+=(-e "#define ${define%% *}\\b")
+	done
+	(
+		"${args[@]}" < config-sample.h
+		echo "#define PROBLEM SampleGrid"
+		echo "#define RAM_SIZE (256*1024)"
+		echo "#define EXPANSION_NODES_PER_QUEUE_ELEMENT 0x10"
+		echo "#define EXPANSION_BUFFER_FILL_RATIO 0.01"
+		echo "#define SYNC_STD"
+		for define in "$@" ; do
+			echo "#define $define"
+		done
+	) > config.h
+
+	args=(
+		"$COMPILER"
+	)
+	if [[ "$COMPILER" == cl ]] ; then
+		args+=(
+			-nologo
+		)
+	else
+		args+=(
+			-o search
+		)
+	fi
+
+	if ! "${args[@]}" search.cpp ; then
+		echo "Compilation failed!"
+		ok=false
+		echo "$line: Compilation failed" >> report.txt
+		return
+	fi
+
+	find . \( -name '*.bin' -o -name '*.bin.idx' \) -delete # NODE_INDEX leaves .idx files next to them
+	local status=0
+	./search search > output.txt || status=$?
+	if [[ $status -ne 2 ]] || ! grep -q 'Exit not found' output.txt ; then # EXIT_NOTFOUND
+		echo "Execution failed!"
+		echo "$line: Execution failed" >> report.txt
+		ok=false
+		return
+	fi
+
+	local counts
+	counts=$(grep -o 'Frame[^;]*total' output.txt)
+	if [[ -z "$reference" ]] ; then
+		reference=$counts
+	elif [[ "$counts" != "$reference" ]] ; then
+		echo "Node counts differ!"
+		echo "$line: Node counts differ" >> report.txt
+		ok=false
+		return
+	fi
+
+	echo OK
+	echo "$line: OK" >> report.txt
+}
+
+for DISK                       in DISK_{POSIX,C,URING,MMAP} ; do
+for PARALLEL_MERGE             in false true ; do
+for PARALLEL_COMBINING         in false true ; do
+for MERGE_WHILE_COMBINING      in false true ; do
+
+	echo "=============================================================="
+
+	line=$(
+		printf -- 'SampleGrid '
+		printf -- '%-20s ' "$DISK"
+		printf -- 'PARALLEL_MERGE=%-5s ' "$PARALLEL_MERGE"
+		printf -- 'PARALLEL_COMBINING=%-5s ' "$PARALLEL_COMBINING"
+		printf -- 'MERGE_WHILE_COMBINING=%-5s ' "$MERGE_WHILE_COMBINING"
+	)
+	echo "$line"
+
+	if $PARALLEL_COMBINING && ! $PARALLEL_MERGE ; then
+		echo "Skipping (unsupported configuration)"
+		echo "$line: Skipped" >> report.txt
+		continue
+	fi
+
+	if [[ "$DISK" == DISK_POSIX && "$OS" == windows-* ]] ; then
+		echo "Skipping (OS incompatibility)"
+		echo "$line: Skipped" >> report.txt
+		continue
+	fi
+	if [[ "$DISK" == DISK_MMAP && "$OS" == windows-* ]] ; then
+		echo "Skipping (OS incompatibility)"
+		echo "$line: Skipped" >> report.txt
+		continue
+	fi
+	if [[ "$DISK" == DISK_URING && ( "$OS" == windows-* || "$OS" == macos-* ) ]] ; then
+		echo "Skipping (OS incompatibility)"
+		echo "$line: Skipped" >> report.txt
+		continue
+	fi
+
+	defines=("$DISK")
+	if $PARALLEL_MERGE             ; then defines+=(PARALLEL_MERGE)             ; fi
+	if $PARALLEL_COMBINING         ; then defines+=(PARALLEL_COMBINING)         ; fi
+	if $MERGE_WHILE_COMBINING      ; then defines+=(MERGE_WHILE_COMBINING)      ; fi
+	sampleGrid "$line" "${defines[@]}"
+done
+done
+done
+done
+
+# Options which change how the nodes are stored, looked up, expanded or deduplicated, one set (separated by commas) per run,
+# on DISK_C, which all OSes have.
+for OPTIONS in \
+	'DELTA_CODED_FILES' \
+	'NODE_INDEX' \
+	'DELTA_CODED_FILES,NODE_INDEX' \
+	'ASYNC_IO 2' \
+	'DELTA_CODED_FILES,NODE_INDEX,ASYNC_IO 2' \
+	'TIERED_CLOSED_SET' \
+	'TIERED_CLOSED_SET,DELTA_CODED_FILES,NODE_INDEX' \
+	'NO_CLOSED_FILES' \
+	'PIPELINED_EXPANSION (256*1024)' \
+	'PIPELINED_EXPANSION (256*1024),NO_CLOSED_FILES' \
+	'STATE_CACHE_SHARE 0.125' \
+	; do
+
+	echo "=============================================================="
+
+	line=$(
+		printf -- 'SampleGrid '
+		printf -- '%-20s ' DISK_C
+		printf -- '%s ' "$OPTIONS"
+	)
+	echo "$line"
+
+	IFS=, read -r -a defines <<< "$OPTIONS"
+	sampleGrid "$line" DISK_C "${defines[@]}"
+done
+
 echo "=============================================================="
 echo "Summary:"
 cat report.txt
@@ -5,10 +5,10 @@
 template<void (*WORKER_FUNCTION)()>
 void THREAD_CREATE(THREAD_ID threadID)
 {
-	new boost::thread([threadID] {
+	boost::thread([threadID] {
 		TLS_SET_THREAD_ID(threadID);
 		WORKER_FUNCTION();
-	});
+	}).detach();
 }
 
 #define THREAD_JOIN(thread) (thread)->join()
@@ -5,10 +5,10 @@
 template<void (*WORKER_FUNCTION)()>
 void THREAD_CREATE(THREAD_ID threadID)
 {
-	new std::thread([threadID] {
+	std::thread([threadID] {
 		TLS_SET_THREAD_ID(threadID);
 		WORKER_FUNCTION();
-	});
+	}).detach();
 }
 
 // #define THREAD_JOIN(thread) (thread)->join()